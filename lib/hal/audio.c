@@ -1,6 +1,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <hal/audio.h>
+#include <hal/audioconv.h>
 #include <xboxkrnl/xboxkrnl.h>
 
 // The foundation for this file came from the Cromwell audio driver by 
@@ -25,13 +26,58 @@
 
 #define AUDIO_IRQ 6
 
-static volatile unsigned int analogBufferCount;
-static volatile unsigned int digitalBufferCount;
+#define MIXER_BUFFERS       4
+#define MIXER_BUFFER_FRAMES 1024    // 21ms at 48kHz
+#define MAXRAM              0x03FFAFFF
+
+#define AC97_RATE 48000
+#define AC97_DESCRIPTORS 32
+#define AC97_MAX_QUEUED (AC97_DESCRIPTORS - 1) // hardware can't tell a full ring from an empty one
+
+#define CONVERT_BUFFER_SIZE (128 * 1024)    // ~680ms of 48kHz 16 bit stereo
+
+// Descriptor ring: the caller is the only producer, the ISR the only
+// consumer. Each counter has a single writer, so they need no locking.
+static volatile unsigned int buffersQueued;     // written by XAudioProvideSamples
+static volatile unsigned int samplesQueued;
+static volatile unsigned int finalQueued;       // buffersQueued value after last final buffer
+static volatile unsigned int analogPlayed;      // written by ISR
+static volatile unsigned int digitalPlayed;
+static volatile unsigned int samplesPlayed;
+static volatile unsigned int underruns;
+static unsigned int lateRefills;
+static unsigned int rejectedBuffers;
+static unsigned int targetSamples;              // 0: only limited by descriptors count
 static bool analogDrained;
-static bool digitalDrained;
+static unsigned int dpcPlayed;                  // buffers played when DPC last ran
+
+// Samples not in 16 bit stereo are converted into this ring (owned by the
+// producer): each descriptor's data starts at convertStart[descriptor].
+static unsigned char *convertBuffer;
+static unsigned int convertHead;
+static unsigned int convertStart[AC97_DESCRIPTORS];
+
+// A buffer can only be reused once both outputs have played it (digital one may lag behind)
+static unsigned int XAudioBuffersPlayed(void)
+{
+	unsigned int analog = analogPlayed;
+	unsigned int digital = digitalPlayed;
+
+	return (analog < digital) ? analog : digital;
+}
+
+static bool XAudioQueueFull(void)
+{
+	// both rings must have a free descriptor
+	unsigned int played = XAudioBuffersPlayed();
+
+	return (buffersQueued - played >= AC97_MAX_QUEUED) ||
+		(targetSamples && (samplesQueued - samplesPlayed >= targetSamples));
+}
 
 static KINTERRUPT InterruptObject;
 static KDPC DPCObject;
+static BOOL InterruptConnected = FALSE;
 
 // global reference to the ac97 device
 AC97_DEVICE ac97Device;
@@ -46,15 +92,50 @@ static void __stdcall DPC(PKDPC Dpc,
 					PVOID SystemArgument2)
 {
 	AC97_DEVICE *pac97device;
+	unsigned int queued, played, retired, calls = 0;
+
+	// one DPC can follow several played buffers (see XAudioOutputPlayed)
+	played = XAudioBuffersPlayed();
+	retired = played - dpcPlayed;
+	dpcPlayed = played;
 
 	pac97device = &ac97Device;
 	if (pac97device)
-		if (pac97device->callback)
-			(pac97device->callback)((void *)pac97device, pac97device->callbackData);
+		if (pac97device->callback) {
+			// ask for a buffer per buffer played, and with a target latency until it
+			// is reached (in both cases until callback stops providing some)
+			do {
+				queued = buffersQueued;
+				(pac97device->callback)((void *)pac97device, pac97device->callbackData);
+				calls++;
+			} while ((buffersQueued != queued) && !XAudioQueueFull() && (targetSamples || (calls < retired)));
+		}
 
 	return;
 }
-	
+
+// Returns buffers played by an output (regs: its busmaster registers, status:
+// its interrupt status), played: its previous count. Several buffers can end
+// before the ISR runs, so progress comes from the current index value (CIV)
+// rather than from the number of interrupts.
+static unsigned int XAudioOutputPlayed(volatile unsigned char *regs, unsigned char status, unsigned int played)
+{
+	unsigned int pending = buffersQueued - played;
+	unsigned int civ = regs[4] % AC97_DESCRIPTORS;
+	unsigned int done = (civ - played) % AC97_DESCRIPTORS;
+
+	// buffers before the current one are done. Once the ring drained CIV is
+	// left on the last buffer (already counted) until a new one restarts it.
+	if (done == AC97_DESCRIPTORS - 1)
+		done = 0;
+
+	// stopped after last valid buffer (CIV = LVI): current one is done too
+	if ((status & 4) && (civ == regs[5]) && (done < pending))
+		done++;
+
+	return played + ((done < pending) ? done : pending);
+}
+
 // Although we have to explicitly clear the S/PDIF interrupt sources, in fact
 // the way we are set up PCM and S/PDIF are in lockstep and we only listen for
 // PCM actions, since S/PDIF is always spooling through the same buffer.
@@ -66,43 +147,37 @@ static BOOLEAN __stdcall ISR(PKINTERRUPT Interrupt, PVOID ServiceContext)
 	unsigned char analogInterrupt = pb[0x116];
 	unsigned char digitalInterrupt = pb[0x176];
 
-	bool waitCompleted = false;
+	unsigned int played = XAudioBuffersPlayed();
+	unsigned int n;
 
 	if (analogInterrupt) {
-		bool waitingForAnalog = (analogBufferCount > digitalBufferCount);
-
-		// Was the interrupt triggered because we were out of data?
-		if ((analogInterrupt & 8) && !analogDrained) {
-			if (analogBufferCount > 0) {
-				waitCompleted |= waitingForAnalog;
-				analogBufferCount--;
-			}
+		// Was the interrupt triggered because buffers have been played?
+		if (analogInterrupt & 0xC) {
+			n = XAudioOutputPlayed(pb + 0x110, analogInterrupt, analogPlayed);
+			for (; analogPlayed != n; analogPlayed++)
+				samplesPlayed += pac97device->pcmOutDescriptor[analogPlayed % AC97_DESCRIPTORS].bufferLengthInSamples;
 		}
 
+		// Last queued buffer played: that's an underrun, unless stream ended there
+		if ((analogInterrupt & 4) && !analogDrained && (finalQueued != buffersQueued))
+			underruns++;
+
 		analogDrained = analogInterrupt & 4;
 
 		pb[0x116]=0xFF; // clear all int sources
 	}
 
 	if (digitalInterrupt) {
-		bool waitingForDigital = (digitalBufferCount > analogBufferCount);
-
-		// Was the interrupt triggered because we were out of data?
-		if ((digitalInterrupt & 8) && !digitalDrained) {
-			if (digitalBufferCount > 0) {
-				waitCompleted |= waitingForDigital;
-				digitalBufferCount--;
-			}
-		}
-
-		digitalDrained = digitalInterrupt & 4;
+		// Was the interrupt triggered because buffers have been played?
+		if (digitalInterrupt & 0xC)
+			digitalPlayed = XAudioOutputPlayed(pb + 0x170, digitalInterrupt, digitalPlayed);
 
 		pb[0x176]=0xFF; // clear all int sources
 	}
 
 
 	// If a buffer was consumed by analog and digital output, we ask for a DPC
-	if (waitCompleted) {
+	if (XAudioBuffersPlayed() != played) {
 		//KeInsertQueueDpc queues Dpc and returns TRUE if Dpc not already queued.
 		//Dpc will be queued only once. So only one Dpc is fired after ISRs cease fire.
 		//DPCs avoid crashes inside non reentrant user callbacks called by nested ISRs.
@@ -115,6 +190,24 @@ static BOOLEAN __stdcall ISR(PKINTERRUPT Interrupt, PVOID ServiceContext)
 }
 
 
+static void UninstallAudioInterrupt(void)
+{
+	volatile unsigned char *pb = (unsigned char *)ac97Device.mmio;
+
+	if (!InterruptConnected)
+		return;
+
+	// stop both outputs (and their interrupts) before the ISR goes away
+	pb[0x11B] = 0;
+	pb[0x17B] = 0;
+	pb[0x116] = 0xFF;
+	pb[0x176] = 0xFF;
+
+	KeDisconnectInterrupt(&InterruptObject);
+	KeRemoveQueueDpc(&DPCObject);
+	InterruptConnected = FALSE;
+}
+
 void XDumpAudioStatus()
 {
 	volatile AC97_DEVICE *pac97device = &ac97Device;
@@ -130,9 +223,9 @@ void XDumpAudioStatus()
 // do that, it is your responsibility to keep feeding the data to
 // XAudioProvideSamples() manually.
 //
-// note that I currently ignore sampleSizeInBits and numChannels.  They
-// are provided to cope with future enhancements. Currently supported samples
-// are 16 bits, 2 channels (stereo)
+// Samples can be 8 bits (unsigned) or 16 bits (signed), 1 or 2 channels.
+// Hardware plays 16 bits stereo: other formats are converted into an
+// internal buffer by XAudioProvideSamples.
 void XAudioInit(int sampleSizeInBits, int numChannels, XAudioCallback callback, void *data)
 {
 	AC97_DEVICE * pac97device = &ac97Device;
@@ -144,6 +237,9 @@ void XAudioInit(int sampleSizeInBits, int numChannels, XAudioCallback callback,
 	// (MmAllocateContiguousMemory) instead.
 	MmLockUnlockBufferPages((PVOID)pac97device, sizeof(AC97_DEVICE), FALSE);
 
+	// interrupt and DPC objects can't be initialized again while connected
+	UninstallAudioInterrupt();
+
 	pac97device->mmio = (unsigned int *)0xfec00000;
 	pac97device->nextDescriptor = 0;
 	pac97device->callback = callback;
@@ -199,10 +295,24 @@ void XAudioInit(int sampleSizeInBits, int numChannels, XAudioCallback callback,
 	XAudioPause(pac97device);
 
 	// reset buffer status
-	analogBufferCount = 0;
-	digitalBufferCount = 0;
+	buffersQueued = 0;
+	samplesQueued = 0;
+	finalQueued = 0;
+	analogPlayed = 0;
+	digitalPlayed = 0;
+	samplesPlayed = 0;
+	underruns = 0;
+	lateRefills = 0;
+	rejectedBuffers = 0;
 	analogDrained = false;
-	digitalDrained = false;
+	dpcPlayed = 0;
+
+	// conversion buffer (kept across calls, not needed for 16 bit stereo)
+	convertHead = 0;
+	if ((sampleSizeInBits != 16 || numChannels != 2) && (convertBuffer == NULL)) {
+		convertBuffer = MmAllocateContiguousMemoryEx(CONVERT_BUFFER_SIZE, 0, MAXRAM, 0,
+			(PAGE_READWRITE | PAGE_WRITECOMBINE));
+	}
 	
 	// Register our ISR
 	vector = HalGetInterruptVector(AUDIO_IRQ, &irql);
@@ -217,7 +327,15 @@ void XAudioInit(int sampleSizeInBits, int numChannels, XAudioCallback callback,
 				LevelSensitive,
 				FALSE);
 	
-	KeConnectInterrupt(&InterruptObject);
+	InterruptConnected = KeConnectInterrupt(&InterruptObject);
+}
+
+// Stops audio and disconnects its interrupt (until next XAudioInit).
+// Buffers given to XAudioProvideSamples aren't read anymore once this returns.
+void XAudioShutdown(void)
+{
+	UninstallAudioInterrupt();
+	ac97Device.callback = NULL;
 }
 
 // tell the chip it is OK to play...
@@ -238,12 +356,65 @@ void XAudioPause()
 	pb[0x17B] = 0x1c; // PCM out - PAUSE, allow interrupts
 }
 
+// Audio queued but not played yet is kept under this duration: XAudioProvideSamples
+// refuses buffers beyond it (0, the default, only limits to 31 queued buffers).
+// Lower means less latency, but more frequent (and more urgent) refills.
+void XAudioSetTargetLatency(unsigned int microseconds)
+{
+	targetSamples = (unsigned int)((unsigned long long)microseconds * AC97_RATE / 1000000) * 2;
+}
+
+void XAudioGetStats(XAUDIO_STATS *stats)
+{
+	unsigned int played = samplesPlayed;
+	unsigned int queued = samplesQueued - played;
+
+	stats->buffersQueued = buffersQueued - XAudioBuffersPlayed();
+	stats->samplesQueued = queued;
+	stats->latency = (unsigned int)((unsigned long long)queued / 2 * 1000000 / AC97_RATE);
+	stats->underruns = underruns;
+	stats->lateRefills = lateRefills;
+	stats->rejectedBuffers = rejectedBuffers;
+}
+
+// Returns offset of size free bytes in conversion ring, -1 if not enough
+// room until more buffers are played
+static int XAudioConvertAlloc(unsigned int size)
+{
+	unsigned int played = XAudioBuffersPlayed();
+	unsigned int tail;
+
+	if (played == buffersQueued)
+		convertHead = 0; // nothing in use
+	else {
+		tail = convertStart[played % AC97_DESCRIPTORS];
+		if (convertHead < tail) {
+			// already wrapped: free space ends at oldest buffer
+			if (size >= tail - convertHead)
+				return -1;
+		} else if (size > CONVERT_BUFFER_SIZE - convertHead) {
+			// no room at the end, wrap if there is some at the start
+			if (size >= tail)
+				return -1;
+			convertHead = 0;
+		}
+	}
+
+	convertHead += size;
+	return convertHead - size;
+}
+
 // This is the function you should call when you want to give the
 // audio chip some more data.  If you have registered a callback, it
 // should call this method.  If you are providing the samples manually,
 // you need to make sure you call this function often enough so the
 // chip doesn't run out of data
-void XAudioProvideSamples(unsigned char *buffer, unsigned short bufferLength, int isFinal)
+// Returns 1 (buffer not queued, retry later) if the descriptor ring is
+// full or if target latency is already reached.
+// bufferLength is in bytes of the format given to XAudioInit. Buffers not in
+// 16 bit stereo are converted (so can be reused as soon as this returns), they
+// can't exceed 64KB once converted: -1 is returned otherwise.
+int XAudioProvideSamples(unsigned char *buffer, unsigned short bufferLength, int isFinal)
 {
 	AC97_DEVICE *pac97device = &ac97Device;
 	volatile unsigned char *pb = (unsigned char *)pac97device->mmio;
@@ -252,21 +423,147 @@ void XAudioProvideSamples(unsigned char *buffer, unsigned short bufferLength, in
 	if (isFinal) 
 		bufferControl |= 0x4000;
 
-	unsigned int address = MmGetPhysicalAddress((PVOID)buffer);
+	unsigned int address;
 	unsigned int wordCount = bufferLength / 2;
+	bool convert = (pac97device->sampleSizeInBits != 16) || (pac97device->numChannels != 2);
+
+	if (XAudioQueueFull()) {
+		rejectedBuffers++;
+		return 1;
+	}
+
+	if (convert) {
+		unsigned int size = XAudioConvertedSize(bufferLength, pac97device->sampleSizeInBits, pac97device->numChannels);
+		KFLOATING_SAVE floatSave;
+		int offset;
+
+		if ((convertBuffer == NULL) || (size == 0) || (size > CONVERT_BUFFER_SIZE / 2))
+			return -1;
+
+		offset = XAudioConvertAlloc(size);
+		if (offset < 0) {
+			rejectedBuffers++;
+			return 1;
+		}
+
+		// conversion uses MMX registers, we may be in a DPC
+		KeSaveFloatingPointState(&floatSave);
+		wordCount = XAudioConvert((short *)(convertBuffer + offset), buffer, bufferLength,
+			pac97device->sampleSizeInBits, pac97device->numChannels);
+		KeRestoreFloatingPointState(&floatSave);
+
+		convertStart[pac97device->nextDescriptor] = offset;
+		address = MmGetPhysicalAddress((PVOID)(convertBuffer + offset));
+	} else
+		address = MmGetPhysicalAddress((PVOID)buffer);
+
+	// hardware was already on its last buffer (or out of data)
+	if ((buffersQueued != 0) && (buffersQueued - analogPlayed <= 1) && (finalQueued != buffersQueued))
+		lateRefills++;
 
 	pac97device->pcmOutDescriptor[pac97device->nextDescriptor].bufferStartAddress    = address;
 	pac97device->pcmOutDescriptor[pac97device->nextDescriptor].bufferLengthInSamples = wordCount;
 	pac97device->pcmOutDescriptor[pac97device->nextDescriptor].bufferControl         = bufferControl;
 	pb[0x115] = pac97device->nextDescriptor; // set last active descriptor
-	analogBufferCount++;
 
 	pac97device->pcmSpdifDescriptor[pac97device->nextDescriptor].bufferStartAddress    = address;
 	pac97device->pcmSpdifDescriptor[pac97device->nextDescriptor].bufferLengthInSamples = wordCount;
 	pac97device->pcmSpdifDescriptor[pac97device->nextDescriptor].bufferControl         = bufferControl;
 	pb[0x175] = pac97device->nextDescriptor; // set last active descriptor
-	digitalBufferCount++;
+
+	// publish buffer to ISR once its descriptors are written
+	samplesQueued += wordCount;
+	buffersQueued++;
+	if (isFinal)
+		finalQueued = buffersQueued;
 
 	// increment to the next buffer descriptor (rolling around to 0 once you get to 31)
-	pac97device->nextDescriptor = (pac97device->nextDescriptor + 1) % 32;
+	pac97device->nextDescriptor = (pac97device->nextDescriptor + 1) % AC97_DESCRIPTORS;
+
+	return 0;
+}
+
+static XAUDIO_MIXER mixer;
+static short *mixerBuffers[MIXER_BUFFERS];
+static unsigned int mixerNextBuffer;
+static bool mixerStarted = false;
+
+// Called from DPC when a buffer has been played: mixes the next one
+static void XAudioMixerCallback(void *pac97Device, void *data)
+{
+	short *buffer = mixerBuffers[mixerNextBuffer];
+
+	// all mixer buffers still queued, or target latency reached
+	if ((buffersQueued - XAudioBuffersPlayed() >= MIXER_BUFFERS) || XAudioQueueFull())
+		return;
+
+	XAudioMixerRender(&mixer, buffer, MIXER_BUFFER_FRAMES);
+	XAudioProvideSamples((unsigned char *)buffer, MIXER_BUFFER_FRAMES * 4, 0);
+
+	mixerNextBuffer = (mixerNextBuffer + 1) % MIXER_BUFFERS;
+}
+
+XAUDIO_MIXER *XAudioStartMixer(void)
+{
+	// still running unless audio was initialized again or shut down since
+	if (mixerStarted && (ac97Device.callback == &XAudioMixerCallback))
+		return &mixer;
+
+	// buffers are kept once allocated
+	for (int i = 0; i < MIXER_BUFFERS; i++) {
+		if (mixerBuffers[i] != NULL)
+			continue;
+		mixerBuffers[i] = MmAllocateContiguousMemoryEx(MIXER_BUFFER_FRAMES * 4, 0, MAXRAM, 0,
+			(PAGE_READWRITE | PAGE_WRITECOMBINE));
+		if (mixerBuffers[i] == NULL) {
+			while (i--) {
+				MmFreeContiguousMemory(mixerBuffers[i]);
+				mixerBuffers[i] = NULL;
+			}
+			return NULL;
+		}
+	}
+
+	XAudioMixerReset(&mixer);
+	mixerNextBuffer = 0;
+
+	XAudioInit(16, 2, &XAudioMixerCallback, NULL);
+
+	// queue all buffers (silence for now) before playing
+	for (int i = 0; i < MIXER_BUFFERS; i++)
+		XAudioMixerCallback(NULL, NULL);
+
+	mixerStarted = true;
+	XAudioPlay();
+
+	return &mixer;
+}
+
+// Voices are changed with DPCs held off, so the mixer never sees a half updated voice
+
+int XAudioPlayVoice(const short *samples, unsigned int frames, int channels, unsigned int rate, int volume, int pan, int loop)
+{
+	KIRQL irql = KeRaiseIrqlToDpcLevel();
+	int voice = XAudioMixerStart(&mixer, samples, frames, channels, rate, volume, pan, loop);
+	KfLowerIrql(irql);
+	return voice;
+}
+
+void XAudioStopVoice(int voice)
+{
+	KIRQL irql = KeRaiseIrqlToDpcLevel();
+	XAudioMixerStop(&mixer, voice);
+	KfLowerIrql(irql);
+}
+
+void XAudioSetVoiceVolume(int voice, int volume, int pan)
+{
+	KIRQL irql = KeRaiseIrqlToDpcLevel();
+	XAudioMixerSetVolume(&mixer, voice, volume, pan);
+	KfLowerIrql(irql);
+}
+
+int XAudioVoicePlaying(int voice)
+{
+	return XAudioMixerIsPlaying(&mixer, voice);
 }
@@ -1,6 +1,8 @@
 #ifndef HAL_AUDIO_H
 #define HAL_AUDIO_H
 
+#include <hal/mixer.h>
+
 #if defined(__cplusplus)
 extern "C"
 {
@@ -31,13 +33,61 @@ typedef struct
 	int                      numChannels;
 } AC97_DEVICE  __attribute__ ((aligned (8)));
 
-// note that I currently ignore sampleSizeInBits and numChannels.  They
-// are provided to cope with future enhancements. Currently supported samples
-// are 16 bit, 2 channels (stereo)
+// audio queue statistics (see XAudioGetStats)
+typedef struct
+{
+	unsigned int buffersQueued;    // buffers not played by both outputs yet (can't be reused)
+	unsigned int samplesQueued;    // 16 bit samples waiting or being played
+	unsigned int latency;          // duration of queued samples (microseconds)
+	unsigned int underruns;        // times hardware ran out of data
+	unsigned int lateRefills;      // buffers provided while hardware was on its last one
+	unsigned int rejectedBuffers;  // XAudioProvideSamples calls refused (ring full or target latency reached)
+} XAUDIO_STATS;
+
+// sampleSizeInBits: 8 (unsigned) or 16 (signed), numChannels: 1 or 2.
+// Formats other than 16 bit stereo are converted when samples are provided.
 void XAudioInit(int sampleSizeInBits, int numChannels, XAudioCallback callback, void *data);
 void XAudioPlay();
 void XAudioPause();
-void XAudioProvideSamples(unsigned char *buffer, unsigned short bufferLength, int isFinal);
+int  XAudioProvideSamples(unsigned char *buffer, unsigned short bufferLength, int isFinal); // returns 1 if queue is full, -1 if buffer can't be converted
+void XAudioSetTargetLatency(unsigned int microseconds);
+void XAudioGetStats(XAUDIO_STATS *stats);
+void XAudioShutdown(void); // stops audio and disconnects its interrupt (XAudioInit starts again)
+
+// Starts audio with a software mixer providing the samples (see mixer.h),
+// instead of a user callback. Returns NULL if buffers couldn't be allocated.
+// Voices can then be controlled from any thread with the functions below.
+XAUDIO_MIXER *XAudioStartMixer(void);
+int  XAudioPlayVoice(const short *samples, unsigned int frames, int channels, unsigned int rate, int volume, int pan, int loop);
+void XAudioStopVoice(int voice);
+void XAudioSetVoiceVolume(int voice, int volume, int pan);
+int  XAudioVoicePlaying(int voice);
+
+// streaming statistics (see XAudioStreamGetStats)
+typedef struct
+{
+	unsigned int framesDecoded;    // 48kHz frames decoded since start
+	unsigned int decodeTime;       // microseconds spent decoding (without file reads)
+	unsigned int decodeCost;       // microseconds of decoding per second of audio
+	unsigned int readTime;         // microseconds spent reading file
+	unsigned int readBytes;
+	unsigned int reads;
+	unsigned int readAhead;        // bytes read but not decoded yet
+	unsigned int buffersQueued;    // decoded buffers waiting or being played
+	unsigned int buffersTotal;
+	unsigned int latency;          // duration of queued audio (microseconds)
+	unsigned int underruns;
+} XAUDIO_STREAM_STATS;
+
+// Plays a WAV file (PCM, IMA ADPCM or Xbox ADPCM, see wavdec.h) from disk:
+// a background thread reads and decodes it as it plays, so it doesn't have
+// to fit in memory. Calls XAudioInit, so can't be used with a callback or
+// with the mixer, and XAudioStreamStop shuts audio down (see XAudioShutdown).
+// Returns -1 if the file can't be opened or isn't supported.
+int  XAudioStreamStart(const char *path, int loop);
+void XAudioStreamStop(void);
+int  XAudioStreamPlaying(void);
+void XAudioStreamGetStats(XAUDIO_STREAM_STATS *stats);
 
 #ifdef __cplusplus
 }
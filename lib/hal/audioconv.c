@@ -0,0 +1,108 @@
+#include <string.h>
+#include <hal/audioconv.h>
+
+#ifdef __MMX__
+#include <mmintrin.h>
+#endif
+
+// 8 bit WAV samples are unsigned: flipping the sign bit and using them as
+// the high byte of a 16 bit sample gives the same signed 16 bit scale.
+
+static unsigned int XAudioConvertMono16(short *dst, const short *src, unsigned int samples)
+{
+	unsigned int i = 0;
+
+#ifdef __MMX__
+	__m64 v;
+
+	for (; i + 4 <= samples; i += 4) {
+		v = *(const __m64 *)(src + i);
+		*(__m64 *)(dst + i * 2) = _mm_unpacklo_pi16(v, v);
+		*(__m64 *)(dst + i * 2 + 4) = _mm_unpackhi_pi16(v, v);
+	}
+	_mm_empty();
+#endif
+
+	for (; i < samples; i++) {
+		dst[i * 2] = src[i];
+		dst[i * 2 + 1] = src[i];
+	}
+
+	return samples * 2;
+}
+
+static unsigned int XAudioConvert8(short *dst, const unsigned char *src, unsigned int samples)
+{
+	unsigned int i = 0;
+
+#ifdef __MMX__
+	const __m64 sign = _mm_set1_pi8((char)0x80);
+	const __m64 zero = _mm_setzero_si64();
+	__m64 v;
+
+	for (; i + 8 <= samples; i += 8) {
+		v = _mm_xor_si64(*(const __m64 *)(src + i), sign);
+		*(__m64 *)(dst + i) = _mm_unpacklo_pi8(zero, v);
+		*(__m64 *)(dst + i + 4) = _mm_unpackhi_pi8(zero, v);
+	}
+	_mm_empty();
+#endif
+
+	for (; i < samples; i++)
+		dst[i] = (short)((src[i] ^ 0x80) << 8);
+
+	return samples;
+}
+
+static unsigned int XAudioConvertMono8(short *dst, const unsigned char *src, unsigned int samples)
+{
+	unsigned int i = 0;
+
+#ifdef __MMX__
+	const __m64 sign = _mm_set1_pi8((char)0x80);
+	const __m64 zero = _mm_setzero_si64();
+	__m64 v, w;
+
+	for (; i + 8 <= samples; i += 8) {
+		v = _mm_xor_si64(*(const __m64 *)(src + i), sign);
+		w = _mm_unpacklo_pi8(zero, v);
+		*(__m64 *)(dst + i * 2) = _mm_unpacklo_pi16(w, w);
+		*(__m64 *)(dst + i * 2 + 4) = _mm_unpackhi_pi16(w, w);
+		w = _mm_unpackhi_pi8(zero, v);
+		*(__m64 *)(dst + i * 2 + 8) = _mm_unpacklo_pi16(w, w);
+		*(__m64 *)(dst + i * 2 + 12) = _mm_unpackhi_pi16(w, w);
+	}
+	_mm_empty();
+#endif
+
+	for (; i < samples; i++) {
+		dst[i * 2] = (short)((src[i] ^ 0x80) << 8);
+		dst[i * 2 + 1] = dst[i * 2];
+	}
+
+	return samples * 2;
+}
+
+unsigned int XAudioConvertedSize(unsigned int srcBytes, int sampleSizeInBits, int numChannels)
+{
+	if (((sampleSizeInBits != 8) && (sampleSizeInBits != 16)) || (numChannels < 1) || (numChannels > 2))
+		return 0;
+
+	// 2 bytes per output sample, 2 output samples per mono sample
+	return srcBytes / (sampleSizeInBits / 8) * 2 * (3 - numChannels);
+}
+
+unsigned int XAudioConvert(short *dst, const void *src, unsigned int srcBytes, int sampleSizeInBits, int numChannels)
+{
+	if (sampleSizeInBits == 8) {
+		if (numChannels == 1)
+			return XAudioConvertMono8(dst, src, srcBytes);
+		return XAudioConvert8(dst, src, srcBytes);
+	}
+
+	if (numChannels == 1)
+		return XAudioConvertMono16(dst, src, srcBytes / 2);
+
+	memcpy(dst, src, srcBytes & ~1);
+	return srcBytes / 2;
+}
@@ -0,0 +1,31 @@
+#ifndef HAL_AUDIOCONV_H
+#define HAL_AUDIOCONV_H
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+// Sample format conversion used by XAudioProvideSamples (see audio.h)
+// when XAudioInit was given another format than 16 bit stereo.
+// It has no kernel dependencies, so it can also be built on a host.
+//
+// Sources are unsigned 8 bit or signed 16 bit PCM (as stored in WAV
+// files), mono or interleaved stereo. Output is signed 16 bit stereo.
+//
+// With MMX (-march=pentium3) 8 source bytes are converted at once.
+// MMX registers alias the FPU ones: callers running in a DPC have to
+// save the FPU state around XAudioConvert (see KeSaveFloatingPointState).
+
+// returns bytes needed to convert srcBytes bytes, 0 if format isn't supported
+unsigned int XAudioConvertedSize(unsigned int srcBytes, int sampleSizeInBits, int numChannels);
+
+// converts srcBytes bytes of src into dst (XAudioConvertedSize bytes),
+// returns number of 16 bit samples written
+unsigned int XAudioConvert(short *dst, const void *src, unsigned int srcBytes, int sampleSizeInBits, int numChannels);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,327 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <hal/audio.h>
+#include <hal/fileio.h>
+#include <hal/wavdec.h>
+#include <xboxkrnl/xboxkrnl.h>
+
+// Streaming player: a thread reads the file with large sequential reads,
+// decodes it into a ring of DMA buffers and queues them to the AC97. The
+// audio DPC only wakes the thread up, so the thread is the only producer
+// of the descriptor ring (see XAudioProvideSamples).
+
+#define STREAM_BUFFERS       8
+#define STREAM_BUFFER_FRAMES 2048           // 43ms at 48kHz
+#define STREAM_READ_SIZE     (64 * 1024)    // bytes read from file at once
+#define STREAM_READ_EXTRA    4096           // room for data left from previous read (biggest block)
+#define STREAM_THREAD_STACK  (16 * 1024)
+#define MAXRAM               0x03FFAFFF
+
+static short *streamBuffers[STREAM_BUFFERS];
+static unsigned int streamNextBuffer;
+static unsigned int streamPending;          // frames decoded in next buffer but not queued yet
+static bool streamPendingFinal;
+
+static XAUDIO_WAV_DECODER *streamDecoder;
+static unsigned char *streamReadBuffer;
+static unsigned int streamReadPos;
+static unsigned int streamReadEnd;
+static LARGE_INTEGER streamFileOffset;
+static HANDLE streamFile;
+static HANDLE streamThread;
+static KEVENT streamEvent;
+static bool streamLoop;
+static volatile bool streamStop;
+static volatile bool streamEnded;           // final buffer queued
+
+// statistics (written by streaming thread)
+static unsigned int streamFramesDecoded;
+static unsigned int streamDecodeTime;       // microseconds
+static unsigned int streamReadTime;
+static ULONGLONG streamDecodeTicks;
+static ULONGLONG streamReadTicks;
+static unsigned int streamReadBytes;
+static unsigned int streamReads;
+static ULONGLONG streamFrequency;
+
+static unsigned int XAudioStreamMicroseconds(ULONGLONG ticks)
+{
+	return (unsigned int)(ticks * 1000000 / streamFrequency);
+}
+
+// reads STREAM_READ_SIZE bytes after data already in read buffer, returns false at end of file
+static bool XAudioStreamReadFile(void)
+{
+	IO_STATUS_BLOCK ioStatusBlock;
+	ULONGLONG start = KeQueryPerformanceCounter();
+	NTSTATUS status;
+
+	// keep unused bytes
+	memmove(streamReadBuffer, streamReadBuffer + streamReadPos, streamReadEnd - streamReadPos);
+	streamReadEnd -= streamReadPos;
+	streamReadPos = 0;
+
+	status = NtReadFile(streamFile, NULL, NULL, NULL, &ioStatusBlock,
+		streamReadBuffer + streamReadEnd, STREAM_READ_SIZE, &streamFileOffset);
+	streamReadTicks += KeQueryPerformanceCounter() - start;
+	streamReadTime = XAudioStreamMicroseconds(streamReadTicks);
+	if (!NT_SUCCESS(status) || (ioStatusBlock.Information == 0))
+		return false;
+
+	streamReadEnd += ioStatusBlock.Information;
+	streamFileOffset.QuadPart += ioStatusBlock.Information;
+	streamReadBytes += ioStatusBlock.Information;
+	streamReads++;
+	return true;
+}
+
+// decoder input (see XAudioWavRead)
+static const unsigned char *XAudioStreamRead(void *context, unsigned int size)
+{
+	const unsigned char *data;
+
+	while (streamReadEnd - streamReadPos < size)
+		if ((size > STREAM_READ_EXTRA) || !XAudioStreamReadFile())
+			return NULL;
+
+	data = streamReadBuffer + streamReadPos;
+	streamReadPos += size;
+	return data;
+}
+
+static void XAudioStreamRewind(void)
+{
+	streamFileOffset.QuadPart = streamDecoder->dataOffset;
+	streamReadPos = 0;
+	streamReadEnd = 0;
+	XAudioWavRewind(streamDecoder);
+}
+
+// decodes and queues next buffer, returns false if none could be queued
+static bool XAudioStreamFill(void)
+{
+	XAUDIO_STATS stats;
+	short *buffer = streamBuffers[streamNextBuffer];
+	ULONGLONG start, readTicks;
+	unsigned int frames, n;
+
+	if (streamEnded)
+		return false;
+
+	XAudioGetStats(&stats);
+	if (stats.buffersQueued >= STREAM_BUFFERS)
+		return false;
+
+	// decode unless previous attempt to queue buffer was refused
+	if (streamPending == 0) {
+		start = KeQueryPerformanceCounter();
+		readTicks = streamReadTicks;
+
+		frames = XAudioWavDecode(streamDecoder, buffer, STREAM_BUFFER_FRAMES, XAudioStreamRead, NULL);
+		// files shorter than a buffer are rewound several times, one that
+		// can't be decoded at all stops the loop
+		while ((frames < STREAM_BUFFER_FRAMES) && streamLoop) {
+			XAudioStreamRewind();
+			n = XAudioWavDecode(streamDecoder, buffer + frames * 2, STREAM_BUFFER_FRAMES - frames, XAudioStreamRead, NULL);
+			if (n == 0)
+				break;
+			frames += n;
+		}
+
+		streamPendingFinal = (frames < STREAM_BUFFER_FRAMES);
+		if (frames == 0) {
+			// end of file matched end of previous buffer: queue a bit of silence as final buffer
+			memset(buffer, 0, 4);
+			frames = 1;
+		}
+		streamPending = frames;
+
+		streamFramesDecoded += frames;
+		// time spent reading file isn't decoding time
+		streamDecodeTicks += KeQueryPerformanceCounter() - start - (streamReadTicks - readTicks);
+		streamDecodeTime = XAudioStreamMicroseconds(streamDecodeTicks);
+	}
+
+	if (XAudioProvideSamples((unsigned char *)buffer, streamPending * 4, streamPendingFinal) != 0)
+		return false;
+
+	streamEnded = streamPendingFinal;
+	streamPending = 0;
+	streamNextBuffer = (streamNextBuffer + 1) % STREAM_BUFFERS;
+	return true;
+}
+
+// Called from DPC when a buffer has been played
+static void XAudioStreamCallback(void *pac97Device, void *data)
+{
+	KeSetEvent(&streamEvent, 0, FALSE);
+}
+
+static void NTAPI XAudioStreamThread(PVOID context)
+{
+	LARGE_INTEGER timeout;
+
+	// in case a wakeup is missed (e.g. a refused buffer)
+	timeout.QuadPart = -10 * 1000 * 10; // 10ms
+
+	while (!streamStop && !streamEnded) {
+		while (!streamStop && XAudioStreamFill())
+			;
+		KeWaitForSingleObject(&streamEvent, Executive, KernelMode, FALSE, &timeout);
+	}
+
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// audio must be shut down first if buffers were queued
+static void XAudioStreamClose(void)
+{
+	for (int i = 0; i < STREAM_BUFFERS; i++) {
+		if (streamBuffers[i] != NULL) {
+			MmFreeContiguousMemory(streamBuffers[i]);
+			streamBuffers[i] = NULL;
+		}
+	}
+	if (streamFile) {
+		NtClose(streamFile);
+		streamFile = NULL;
+	}
+	free(streamDecoder);
+	streamDecoder = NULL;
+	free(streamReadBuffer);
+	streamReadBuffer = NULL;
+}
+
+// Plays a WAV file from disk (see wavdec.h for supported formats), replacing
+// any previous stream. Returns -1 if the file can't be opened or isn't supported.
+int XAudioStreamStart(const char *path, int loop)
+{
+	char xboxPath[MAX_PATH];
+	ANSI_STRING pathString;
+	OBJECT_ATTRIBUTES attributes;
+	IO_STATUS_BLOCK ioStatusBlock;
+	NTSTATUS status;
+
+	XAudioStreamStop();
+
+	if (XConvertDOSFilenameToXBOX(path, xboxPath) != STATUS_SUCCESS)
+		return -1;
+
+	for (int i = 0; i < STREAM_BUFFERS; i++) {
+		streamBuffers[i] = MmAllocateContiguousMemoryEx(STREAM_BUFFER_FRAMES * 4, 0, MAXRAM, 0,
+			(PAGE_READWRITE | PAGE_WRITECOMBINE));
+		if (streamBuffers[i] == NULL) {
+			XAudioStreamClose();
+			return -1;
+		}
+	}
+
+	streamDecoder = malloc(sizeof(XAUDIO_WAV_DECODER));
+	streamReadBuffer = malloc(STREAM_READ_SIZE + STREAM_READ_EXTRA);
+	if ((streamDecoder == NULL) || (streamReadBuffer == NULL)) {
+		XAudioStreamClose();
+		return -1;
+	}
+
+	RtlInitAnsiString(&pathString, xboxPath);
+	InitializeObjectAttributes(&attributes, &pathString, OBJ_CASE_INSENSITIVE, NULL, NULL);
+	status = NtCreateFile(&streamFile, GENERIC_READ | SYNCHRONIZE, &attributes, &ioStatusBlock, NULL, 0,
+		FILE_SHARE_READ, FILE_OPEN, FILE_SYNCHRONOUS_IO_NONALERT | FILE_SEQUENTIAL_ONLY);
+	if (!NT_SUCCESS(status)) {
+		streamFile = NULL;
+		XAudioStreamClose();
+		return -1;
+	}
+
+	streamFrequency = KeQueryPerformanceFrequency();
+	streamFramesDecoded = 0;
+	streamDecodeTime = 0;
+	streamDecodeTicks = 0;
+	streamReadTime = 0;
+	streamReadTicks = 0;
+	streamReadBytes = 0;
+	streamReads = 0;
+
+	// header is parsed from first read
+	streamFileOffset.QuadPart = 0;
+	streamReadPos = 0;
+	streamReadEnd = 0;
+	if (!XAudioStreamReadFile() ||
+		(XAudioWavOpen(streamDecoder, streamReadBuffer, streamReadEnd) != 0)) {
+		XAudioStreamClose();
+		return -1;
+	}
+	streamReadPos = streamDecoder->dataOffset;
+
+	streamNextBuffer = 0;
+	streamPending = 0;
+	streamLoop = loop;
+	streamStop = false;
+	streamEnded = false;
+	KeInitializeEvent(&streamEvent, SynchronizationEvent, FALSE);
+
+	XAudioInit(16, 2, &XAudioStreamCallback, NULL);
+
+	// queue all buffers before playing
+	while (XAudioStreamFill())
+		;
+
+	status = PsCreateSystemThreadEx(&streamThread, 0, STREAM_THREAD_STACK, 0, NULL,
+		XAudioStreamThread, NULL, FALSE, FALSE, NULL);
+	if (!NT_SUCCESS(status)) {
+		streamThread = NULL;
+		XAudioShutdown();
+		XAudioStreamClose();
+		return -1;
+	}
+
+	XAudioPlay();
+	return 0;
+}
+
+void XAudioStreamStop(void)
+{
+	if (streamThread) {
+		streamStop = true;
+		KeSetEvent(&streamEvent, 0, FALSE);
+		NtWaitForSingleObject(streamThread, FALSE, NULL);
+		NtClose(streamThread);
+		streamThread = NULL;
+		XAudioShutdown();
+	}
+
+	XAudioStreamClose();
+}
+
+// true until last buffer of the stream has been played
+int XAudioStreamPlaying(void)
+{
+	XAUDIO_STATS stats;
+
+	if (streamThread == NULL)
+		return 0;
+
+	XAudioGetStats(&stats);
+	return !streamEnded || (stats.buffersQueued != 0);
+}
+
+void XAudioStreamGetStats(XAUDIO_STREAM_STATS *stats)
+{
+	XAUDIO_STATS audioStats;
+	unsigned int frames = streamFramesDecoded;
+
+	XAudioGetStats(&audioStats);
+
+	stats->framesDecoded = frames;
+	stats->decodeTime = streamDecodeTime;
+	stats->decodeCost = frames ? (unsigned int)((unsigned long long)streamDecodeTime * XAUDIO_WAV_RATE / frames) : 0;
+	stats->readTime = streamReadTime;
+	stats->readBytes = streamReadBytes;
+	stats->reads = streamReads;
+	stats->readAhead = streamReadEnd - streamReadPos;
+	stats->buffersQueued = audioStats.buffersQueued;
+	stats->buffersTotal = STREAM_BUFFERS;
+	stats->latency = audioStats.latency;
+	stats->underruns = audioStats.underruns;
+}
@@ -0,0 +1,151 @@
+#include <string.h>
+#include <hal/mixer.h>
+
+// Gains are applied to 16 bit samples and accumulated in 32 bits:
+// 32 voices at full scale and unity gain (256) stay far below overflow.
+
+static void XAudioMixerGains(XAUDIO_MIXER_VOICE *v, int volume, int pan)
+{
+	if (volume < 0) volume = 0;
+	if (volume > XAUDIO_MIXER_VOLUME_MAX) volume = XAUDIO_MIXER_VOLUME_MAX;
+	if (pan < XAUDIO_MIXER_PAN_LEFT) pan = XAUDIO_MIXER_PAN_LEFT;
+	if (pan > XAUDIO_MIXER_PAN_RIGHT) pan = XAUDIO_MIXER_PAN_RIGHT;
+
+	// balance: center keeps both sides at full volume
+	v->left = (pan > 0) ? volume * (XAUDIO_MIXER_PAN_RIGHT - pan) / XAUDIO_MIXER_PAN_RIGHT : volume;
+	v->right = (pan < 0) ? volume * (pan - XAUDIO_MIXER_PAN_LEFT) / XAUDIO_MIXER_PAN_RIGHT : volume;
+}
+
+void XAudioMixerReset(XAUDIO_MIXER *mixer)
+{
+	memset(mixer, 0, sizeof(XAUDIO_MIXER));
+}
+
+int XAudioMixerStart(XAUDIO_MIXER *mixer, const short *samples, unsigned int frames, int channels, unsigned int rate, int volume, int pan, int loop)
+{
+	XAUDIO_MIXER_VOICE *v;
+	int i;
+
+	if ((frames == 0) || (channels < 1) || (channels > 2) || (rate == 0) || (rate > XAUDIO_MIXER_RATE))
+		return -1;
+
+	for (i = 0; i < XAUDIO_MIXER_VOICES; i++)
+		if (!mixer->voices[i].playing)
+			break;
+	if (i == XAUDIO_MIXER_VOICES)
+		return -1;
+
+	v = &mixer->voices[i];
+	v->samples = samples;
+	v->frames = frames;
+	v->channels = channels;
+	v->step = (unsigned int)(((unsigned long long)rate << 16) / XAUDIO_MIXER_RATE);
+	v->pos = 0;
+	v->frac = 0;
+	v->loop = loop;
+	XAudioMixerGains(v, volume, pan);
+	v->playing = 1;
+
+	return i;
+}
+
+void XAudioMixerStop(XAUDIO_MIXER *mixer, int voice)
+{
+	if ((voice >= 0) && (voice < XAUDIO_MIXER_VOICES))
+		mixer->voices[voice].playing = 0;
+}
+
+void XAudioMixerSetVolume(XAUDIO_MIXER *mixer, int voice, int volume, int pan)
+{
+	if ((voice >= 0) && (voice < XAUDIO_MIXER_VOICES))
+		XAudioMixerGains(&mixer->voices[voice], volume, pan);
+}
+
+int XAudioMixerIsPlaying(XAUDIO_MIXER *mixer, int voice)
+{
+	if ((voice < 0) || (voice >= XAUDIO_MIXER_VOICES))
+		return 0;
+	return mixer->voices[voice].playing;
+}
+
+// adds up to frames frames of voice into accum, returns 0 once a non looping voice has ended
+static int XAudioMixerVoice(XAUDIO_MIXER_VOICE *v, int *accum, unsigned int frames)
+{
+	const short *s = v->samples;
+	unsigned int pos = v->pos;
+	unsigned int frac = v->frac;
+	unsigned int next;
+	int l0, l1, r0, r1, l, r;
+	unsigned int i;
+
+	for (i = 0; i < frames; i++) {
+		// sample after pos (first one again if looping, silence otherwise)
+		next = pos + 1;
+		if (next == v->frames)
+			next = v->loop ? 0 : pos;
+
+		if (v->channels == 2) {
+			l0 = s[pos * 2];
+			r0 = s[pos * 2 + 1];
+			l1 = s[next * 2];
+			r1 = s[next * 2 + 1];
+		} else {
+			l0 = r0 = s[pos];
+			l1 = r1 = s[next];
+		}
+
+		if (frac) {
+			// frac is halved so the product can't overflow
+			l = l0 + (((l1 - l0) * (int)(frac >> 1)) >> 15);
+			r = r0 + (((r1 - r0) * (int)(frac >> 1)) >> 15);
+		} else {
+			l = l0;
+			r = r0;
+		}
+
+		accum[i * 2] += l * v->left;
+		accum[i * 2 + 1] += r * v->right;
+
+		frac += v->step;
+		pos += frac >> 16;
+		frac &= 0xFFFF;
+
+		if (pos >= v->frames) {
+			if (!v->loop) {
+				v->playing = 0;
+				return 0;
+			}
+			pos %= v->frames;
+		}
+	}
+
+	v->pos = pos;
+	v->frac = frac;
+	return 1;
+}
+
+void XAudioMixerRender(XAUDIO_MIXER *mixer, short *out, unsigned int frames)
+{
+	unsigned int n, i;
+	int voice, sample;
+
+	while (frames) {
+		n = (frames > XAUDIO_MIXER_CHUNK) ? XAUDIO_MIXER_CHUNK : frames;
+
+		memset(mixer->accum, 0, n * 2 * sizeof(int));
+		for (voice = 0; voice < XAUDIO_MIXER_VOICES; voice++)
+			if (mixer->voices[voice].playing)
+				XAudioMixerVoice(&mixer->voices[voice], mixer->accum, n);
+
+		// remove gain scale and saturate
+		for (i = 0; i < n * 2; i++) {
+			sample = mixer->accum[i] >> 8;
+			if (sample > 32767) sample = 32767;
+			if (sample < -32768) sample = -32768;
+			out[i] = (short)sample;
+		}
+
+		out += n * 2;
+		frames -= n;
+	}
+}
@@ -0,0 +1,63 @@
+#ifndef HAL_MIXER_H
+#define HAL_MIXER_H
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+// Software mixer core used by XAudioStartMixer (see audio.h).
+// It has no kernel dependencies, so it can also be built on a host
+// (e.g. to render mixes into a WAV file).
+//
+// Voices are signed 16 bit PCM, mono or interleaved stereo, at any rate
+// up to 48kHz (22.05kHz and 44.1kHz sources are linearly interpolated).
+// Output is 48kHz signed 16 bit stereo, as the AC97 expects it.
+//
+// Mixing is fixed point: it runs in the audio DPC, where using the FPU
+// (and MMX/SSE registers) would require saving and restoring its state.
+
+#define XAUDIO_MIXER_RATE        48000
+#define XAUDIO_MIXER_VOICES      32
+#define XAUDIO_MIXER_VOLUME_MAX  256     // unity gain
+#define XAUDIO_MIXER_PAN_LEFT    -128
+#define XAUDIO_MIXER_PAN_RIGHT   128
+#define XAUDIO_MIXER_CHUNK       256     // frames mixed at once
+
+typedef struct
+{
+	const short   *samples;
+	unsigned int   frames;
+	int            channels;
+	unsigned int   step;       // source frames per output frame (16.16 fixed point)
+	unsigned int   pos;        // current source frame
+	unsigned int   frac;       // position between pos and pos+1 (16 bits)
+	int            left;       // gains (0 to XAUDIO_MIXER_VOLUME_MAX)
+	int            right;
+	int            loop;
+	int            playing;
+} XAUDIO_MIXER_VOICE;
+
+typedef struct
+{
+	XAUDIO_MIXER_VOICE voices[XAUDIO_MIXER_VOICES];
+	int                accum[XAUDIO_MIXER_CHUNK * 2];
+} XAUDIO_MIXER;
+
+void XAudioMixerReset(XAUDIO_MIXER *mixer);
+
+// starts a voice, returns its index (-1 if all voices are busy)
+// volume: 0 to XAUDIO_MIXER_VOLUME_MAX, pan: XAUDIO_MIXER_PAN_LEFT to XAUDIO_MIXER_PAN_RIGHT (0 is center)
+int  XAudioMixerStart(XAUDIO_MIXER *mixer, const short *samples, unsigned int frames, int channels, unsigned int rate, int volume, int pan, int loop);
+void XAudioMixerStop(XAUDIO_MIXER *mixer, int voice);
+void XAudioMixerSetVolume(XAUDIO_MIXER *mixer, int voice, int volume, int pan);
+int  XAudioMixerIsPlaying(XAUDIO_MIXER *mixer, int voice);
+
+// mixes all playing voices into frames of 48kHz 16 bit stereo (4 bytes per frame)
+void XAudioMixerRender(XAUDIO_MIXER *mixer, short *out, unsigned int frames);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
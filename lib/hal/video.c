@@ -47,11 +47,27 @@ static GAMMA_RAMP_ENTRY	gammaRampEntries[256];
 
 static KINTERRUPT InterruptObject;
 static KDPC DPCObject;
-static HANDLE VBlankEvent;
 static BOOL IsrRegistered = FALSE;
 
 #define VBL_IRQ 3
 
+#define VBLANK_HISTORY 16  // vblank timestamps kept (power of 2)
+
+// Vblank service: the counter and timestamps are written by the ISR.
+// The DPC sets VBlankEvents[count & 1] (and resets the other one), so a
+// waiter which saw count can't miss vblank count+1 by arriving late, and
+// one which saw the latest count always waits on a reset event.
+static volatile ULONG VBlankCount;
+static volatile ULONGLONG VBlankTimestamps[VBLANK_HISTORY];
+static ULONG VBlankDpcCount;
+static KEVENT VBlankEvents[2];
+
+static struct
+{
+	XVideoVBlankCallback callback;
+	void *data;
+} VBlankCallbacks[XVIDEO_VBLANK_CALLBACKS];
+
 typedef struct _VIDEO_MODE_SETTING
 {
 	DWORD dwMode;
@@ -129,17 +145,35 @@ PVOID DeferredContext,
 PVOID SystemArgument1,
 PVOID SystemArgument2)
 {
-	/* Wake up waiting threads */
-	NtPulseEvent(VBlankEvent, NULL);
+	ULONG count = VBlankCount;
+	ULONGLONG timestamp = VBlankTimestamps[count & (VBLANK_HISTORY - 1)];
+	int i;
+
+	/* Wake up waiting threads. If a vblank was missed, threads waiting for it
+	 * are released too, but its event is left reset: a waiter which already
+	 * saw count would otherwise find it signaled and spin until next DPC */
+	KeSetEvent(&VBlankEvents[count & 1], 0, FALSE);
+	if (count - VBlankDpcCount == 1)
+		KeResetEvent(&VBlankEvents[(count + 1) & 1]);
+	else
+		KePulseEvent(&VBlankEvents[(count + 1) & 1], 0, FALSE);
+	VBlankDpcCount = count;
+
+	/* Registered callbacks are called once per DPC, with latest vblank */
+	for (i = 0; i < XVIDEO_VBLANK_CALLBACKS; i++)
+		if (VBlankCallbacks[i].callback)
+			VBlankCallbacks[i].callback(count, timestamp, VBlankCallbacks[i].data);
 	return;
 }
 
 static BOOLEAN __stdcall ISR(PKINTERRUPT Interrupt, PVOID ServiceContext)
 {
-	if (VIDEOREG(NV_PMC_INTR_EN_0))
+	if (VIDEOREG(PCRTC_INTR) & PCRTC_INTR_VBLANK_RESET)
 	{
 		/* Reset interrupt */
 		VIDEOREG(PCRTC_INTR)=PCRTC_INTR_VBLANK_RESET;
+		VBlankTimestamps[(VBlankCount + 1) & (VBLANK_HISTORY - 1)] = KeQueryPerformanceCounter();
+		VBlankCount++;
 		/* Call our Dpc */
 		KeInsertQueueDpc(&DPCObject,NULL,NULL);
 		return TRUE;
@@ -163,7 +197,9 @@ static int InstallVBLInterrupt(void)
 
 	vector = HalGetInterruptVector(VBL_IRQ, &irql);
 
-	NtCreateEvent(&VBlankEvent, NULL, NotificationEvent, FALSE);
+	KeInitializeEvent(&VBlankEvents[0], NotificationEvent, FALSE);
+	KeInitializeEvent(&VBlankEvents[1], NotificationEvent, FALSE);
+	VBlankDpcCount = VBlankCount;
 	
 	KeInitializeDpc(&DPCObject,&DPC,NULL);
 
@@ -189,7 +225,6 @@ static void UninstallVBLInterrupt(void)
 	VIDEOREG(PCRTC_INTR_EN)=PCRTC_INTR_EN_VBLANK_DISABLED;
 	VIDEOREG(PCRTC_INTR)=PCRTC_INTR_VBLANK_RESET;
 	KeDisconnectInterrupt(&InterruptObject);
-	NtClose(VBlankEvent);
 }
 
 DWORD XVideoGetEncoderSettings(void)
@@ -473,25 +508,97 @@ void XVideoSetGammaRamp(unsigned int offset, const GAMMA_RAMP_ENTRY *entries, un
 }
 
 
-void XVideoWaitForVBlank()
+// Installs ISR and leaves vblank interrupt enabled from then on
+static BOOL StartVBlankService(void)
 {
 	if (! IsrRegistered) {
 		if (InstallVBLInterrupt())
 			IsrRegistered = TRUE;
 		else
-			return; //Prevents deadlock in case user code hooks IRQ3 first
+			return FALSE; //Prevents deadlock in case user code hooks IRQ3 first
+
+		/* Enable vblank interrupt */
+		VIDEOREG(PCRTC_INTR)=PCRTC_INTR_VBLANK_RESET;
+		VIDEOREG(PCRTC_INTR_EN)=PCRTC_INTR_EN_VBLANK_ENABLED;
 	}
+	return TRUE;
+}
 
-	/* Enable vblank interrupt */
-	VIDEOREG(PCRTC_INTR)=PCRTC_INTR_VBLANK_RESET;
-	VIDEOREG(PCRTC_INTR_EN)=PCRTC_INTR_EN_VBLANK_ENABLED;
-	
-	/* Wait for vblank */
-	NtWaitForSingleObject(VBlankEvent, FALSE, NULL);
-	
-	/* Disable vblank interrupt */
-	VIDEOREG(PCRTC_INTR_EN)=PCRTC_INTR_EN_VBLANK_DISABLED;
-	VIDEOREG(PCRTC_INTR)=PCRTC_INTR_VBLANK_RESET;
+void XVideoWaitForVBlank()
+{
+	if (! StartVBlankService())
+		return;
+
+	XVideoWaitForVBlankCount(VBlankCount + 1);
+}
+
+ULONG XVideoGetVBlankCount(void)
+{
+	StartVBlankService();
+	return VBlankCount;
+}
+
+ULONG XVideoWaitForVBlankCount(ULONG count)
+{
+	ULONG current;
+
+	if (! StartVBlankService())
+		return VBlankCount;
+
+	/* Counter wraps around, compare distance */
+	while ((LONG)(count - (current = VBlankCount)) > 0)
+		KeWaitForSingleObject(&VBlankEvents[(current + 1) & 1], Executive, KernelMode, FALSE, NULL);
+
+	return current;
+}
+
+ULONGLONG XVideoGetVBlankTimestamp(ULONG count)
+{
+	ULONGLONG timestamp;
+	ULONG current;
+
+	do {
+		current = VBlankCount;
+		/* Only last vblanks are kept */
+		if (current - count >= VBLANK_HISTORY)
+			return 0;
+		timestamp = VBlankTimestamps[count & (VBLANK_HISTORY - 1)];
+	} while (current != VBlankCount);
+
+	return timestamp;
+}
+
+int XVideoRegisterVBlankCallback(XVideoVBlankCallback callback, void *data)
+{
+	KIRQL oldIrql;
+	int i;
+
+	if (! StartVBlankService())
+		return -1;
+
+	oldIrql = KeRaiseIrqlToDpcLevel();
+	for (i = 0; i < XVIDEO_VBLANK_CALLBACKS; i++) {
+		if (VBlankCallbacks[i].callback == NULL) {
+			VBlankCallbacks[i].data = data;
+			VBlankCallbacks[i].callback = callback;
+			break;
+		}
+	}
+	KfLowerIrql(oldIrql);
+
+	return (i == XVIDEO_VBLANK_CALLBACKS) ? -1 : i;
+}
+
+void XVideoUnregisterVBlankCallback(int id)
+{
+	KIRQL oldIrql;
+
+	if ((id < 0) || (id >= XVIDEO_VBLANK_CALLBACKS))
+		return;
+
+	oldIrql = KeRaiseIrqlToDpcLevel();
+	VBlankCallbacks[id].callback = NULL;
+	KfLowerIrql(oldIrql);
 }
 
 unsigned char* XVideoGetVideoBase()
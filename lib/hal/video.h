@@ -74,7 +74,23 @@ If a value of 0 is provided for the bpp a default value of 32bpp is used.
 */
 BOOLEAN XVideoListModes(VIDEO_MODE *vm, int bpp, int refresh, void **p);
 
+/*
+Vblank service. The vblank interrupt stays enabled once one of these functions
+has been called, and a counter is incremented at each vblank (it wraps around).
+Timestamps are KeQueryPerformanceCounter values taken in the interrupt, the
+last 16 are kept. Callbacks run in a DPC with the latest vblank count and its
+timestamp: they must be short, and save FPU state if they use it.
+*/
+#define XVIDEO_VBLANK_CALLBACKS 8
+
+typedef void (*XVideoVBlankCallback)(ULONG count, ULONGLONG timestamp, void *data);
+
 void XVideoWaitForVBlank();
+ULONG XVideoGetVBlankCount(void);
+ULONG XVideoWaitForVBlankCount(ULONG count); // returns immediately if count is already reached
+ULONGLONG XVideoGetVBlankTimestamp(ULONG count); // 0 if vblank is too old or not reached
+int XVideoRegisterVBlankCallback(XVideoVBlankCallback callback, void *data); // returns id, -1 if none is free
+void XVideoUnregisterVBlankCallback(int id);
 unsigned char* XVideoGetVideoBase();
 int XVideoVideoMemorySize();
 
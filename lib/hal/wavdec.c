@@ -0,0 +1,225 @@
+#include <string.h>
+#include <hal/audioconv.h>
+#include <hal/wavdec.h>
+
+static const signed char imaIndexTable[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const unsigned short imaStepTable[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+	19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+	130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+	337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+	876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+	2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+	5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static unsigned int XAudioWavRead16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned int XAudioWavRead32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+int XAudioWavOpen(XAUDIO_WAV_DECODER *decoder, const unsigned char *header, unsigned int size)
+{
+	unsigned int offset, chunkSize, perChannel;
+	int fmtFound = 0;
+
+	if ((size < 12) || memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4))
+		return -1;
+
+	memset(decoder, 0, sizeof(XAUDIO_WAV_DECODER) - sizeof(decoder->pcm));
+
+	for (offset = 12; offset + 8 <= size; offset += 8 + ((chunkSize + 1) & ~1)) {
+		chunkSize = XAudioWavRead32(header + offset + 4);
+
+		if (!memcmp(header + offset, "fmt ", 4) && (chunkSize >= 16) && (offset + 24 <= size)) {
+			decoder->format = XAudioWavRead16(header + offset + 8);
+			decoder->channels = XAudioWavRead16(header + offset + 10);
+			decoder->rate = XAudioWavRead32(header + offset + 12);
+			decoder->blockAlign = XAudioWavRead16(header + offset + 20);
+			decoder->bitsPerSample = XAudioWavRead16(header + offset + 22);
+			fmtFound = 1;
+		} else if (!memcmp(header + offset, "data", 4)) {
+			decoder->dataOffset = offset + 8;
+			decoder->dataSize = chunkSize;
+			break;
+		}
+	}
+
+	if (!fmtFound || (decoder->dataOffset == 0))
+		return -1;
+	if ((decoder->channels < 1) || (decoder->channels > 2) || (decoder->rate == 0) || (decoder->rate > XAUDIO_WAV_RATE))
+		return -1;
+
+	switch (decoder->format) {
+	case XAUDIO_WAV_PCM:
+		if (((decoder->bitsPerSample != 8) && (decoder->bitsPerSample != 16)) ||
+			(decoder->blockAlign != decoder->channels * decoder->bitsPerSample / 8))
+			return -1;
+		decoder->blockBytes = XAUDIO_WAV_PCM_FRAMES * decoder->blockAlign;
+		break;
+
+	case XAUDIO_WAV_IMA_ADPCM:
+	case XAUDIO_WAV_XBOX_ADPCM:
+		// per channel: 4 bytes header (first sample), then 2 samples per byte
+		perChannel = decoder->blockAlign / decoder->channels;
+		if ((decoder->bitsPerSample != 4) || (decoder->blockAlign % (4 * decoder->channels)) || (perChannel < 8) ||
+			(1 + (perChannel - 4) * 2 > XAUDIO_WAV_MAX_BLOCK_FRAMES))
+			return -1;
+		decoder->blockBytes = decoder->blockAlign;
+		break;
+
+	default:
+		return -1;
+	}
+
+	decoder->step = (unsigned int)(((unsigned long long)decoder->rate << 16) / XAUDIO_WAV_RATE);
+	XAudioWavRewind(decoder);
+	return 0;
+}
+
+void XAudioWavRewind(XAUDIO_WAV_DECODER *decoder)
+{
+	decoder->remaining = decoder->dataSize;
+}
+
+// decodes one IMA ADPCM block (all channels) into stereo frames, returns frames count
+static unsigned int XAudioWavDecodeAdpcm(short *out, const unsigned char *block, int channels, unsigned int blockAlign)
+{
+	const unsigned char *data = block + 4 * channels;
+	unsigned int frames = 1 + (blockAlign / channels - 4) * 2;
+	unsigned int i, j, n;
+	int c, predictor, index, step, diff;
+
+	for (c = 0; c < channels; c++) {
+		short *o = out + c;
+
+		predictor = (short)XAudioWavRead16(block + c * 4);
+		index = block[c * 4 + 2];
+		if (index > 88)
+			index = 88;
+
+		*o = (short)predictor;
+		o += 2;
+
+		// 4 bytes (8 samples) of each channel in turn
+		for (i = 0; i < (frames - 1) / 8; i++) {
+			const unsigned char *p = data + (i * channels + c) * 4;
+
+			for (j = 0; j < 8; j++) {
+				n = (p[j >> 1] >> ((j & 1) * 4)) & 15;
+
+				step = imaStepTable[index];
+				diff = step >> 3;
+				if (n & 4) diff += step;
+				if (n & 2) diff += step >> 1;
+				if (n & 1) diff += step >> 2;
+				predictor += (n & 8) ? -diff : diff;
+				if (predictor > 32767) predictor = 32767;
+				if (predictor < -32768) predictor = -32768;
+
+				index += imaIndexTable[n];
+				if (index < 0) index = 0;
+				if (index > 88) index = 88;
+
+				*o = (short)predictor;
+				o += 2;
+			}
+		}
+	}
+
+	// mono: right channel is a copy of left one
+	if (channels == 1)
+		for (i = 0; i < frames; i++)
+			out[i * 2 + 1] = out[i * 2];
+
+	return frames;
+}
+
+// reads and decodes next block after frame decoder->frames-1, returns 0 at end of data
+static int XAudioWavNextBlock(XAUDIO_WAV_DECODER *decoder, XAudioWavRead read, void *context)
+{
+	unsigned int size = decoder->blockBytes;
+	unsigned int keep = decoder->frames ? 1 : 0;
+	const unsigned char *block;
+	unsigned int frames;
+
+	if (decoder->remaining < size) {
+		// a partial ADPCM block can't be decoded
+		if (decoder->format != XAUDIO_WAV_PCM)
+			return 0;
+		size = decoder->remaining - decoder->remaining % decoder->blockAlign;
+	}
+	if (size == 0)
+		return 0;
+
+	block = read(context, size);
+	if (block == NULL) {
+		decoder->remaining = 0;
+		return 0;
+	}
+	decoder->remaining -= size;
+
+	// interpolation between blocks needs previous last frame
+	if (keep) {
+		decoder->pcm[0] = decoder->pcm[(decoder->frames - 1) * 2];
+		decoder->pcm[1] = decoder->pcm[(decoder->frames - 1) * 2 + 1];
+	}
+
+	if (decoder->format == XAUDIO_WAV_PCM)
+		frames = XAudioConvert(decoder->pcm + keep * 2, block, size, decoder->bitsPerSample, decoder->channels) / 2;
+	else
+		frames = XAudioWavDecodeAdpcm(decoder->pcm + keep * 2, block, decoder->channels, decoder->blockAlign);
+
+	decoder->pos -= decoder->frames - keep;
+	decoder->frames = keep + frames;
+	return 1;
+}
+
+unsigned int XAudioWavDecode(XAUDIO_WAV_DECODER *decoder, short *out, unsigned int frames, XAudioWavRead read, void *context)
+{
+	unsigned int done = 0;
+	unsigned int n;
+	const short *s;
+
+	while (done < frames) {
+		// frame after pos is needed for interpolation
+		while (decoder->pos + 1 >= decoder->frames)
+			if (!XAudioWavNextBlock(decoder, read, context))
+				return done;
+
+		// 48kHz source: plain copy
+		if ((decoder->step == 0x10000) && (decoder->frac == 0)) {
+			n = decoder->frames - 1 - decoder->pos;
+			if (n > frames - done)
+				n = frames - done;
+			memcpy(out + done * 2, decoder->pcm + decoder->pos * 2, n * 4);
+			decoder->pos += n;
+			done += n;
+			continue;
+		}
+
+		for (; (done < frames) && (decoder->pos + 1 < decoder->frames); done++) {
+			s = decoder->pcm + decoder->pos * 2;
+			// frac is halved so the product can't overflow
+			out[done * 2] = (short)(s[0] + (((s[2] - s[0]) * (int)(decoder->frac >> 1)) >> 15));
+			out[done * 2 + 1] = (short)(s[1] + (((s[3] - s[1]) * (int)(decoder->frac >> 1)) >> 15));
+
+			decoder->frac += decoder->step;
+			decoder->pos += decoder->frac >> 16;
+			decoder->frac &= 0xFFFF;
+		}
+	}
+
+	return done;
+}
@@ -0,0 +1,63 @@
+#ifndef HAL_WAVDEC_H
+#define HAL_WAVDEC_H
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+// WAV decoder used by XAudioStreamStart (see audio.h).
+// It has no kernel dependencies, so it can also be built on a host
+// (e.g. to benchmark decoding of a file).
+//
+// Supported files are PCM (8 or 16 bits), IMA ADPCM and Xbox ADPCM (IMA
+// ADPCM with 36 bytes per channel blocks), mono or stereo, at any rate up
+// to 48kHz. Output is 48kHz signed 16 bit stereo, as the AC97 expects it:
+// other rates are linearly interpolated, like mixer voices.
+
+#define XAUDIO_WAV_PCM              0x0001
+#define XAUDIO_WAV_IMA_ADPCM        0x0011
+#define XAUDIO_WAV_XBOX_ADPCM       0x0069
+
+#define XAUDIO_WAV_RATE             48000
+#define XAUDIO_WAV_MAX_BLOCK_FRAMES 4096    // decoded frames per ADPCM block
+#define XAUDIO_WAV_PCM_FRAMES       1024    // frames read at once from PCM files
+
+// Returns a pointer to the next size bytes of the data chunk,
+// NULL if they can't be read (end of file)
+typedef const unsigned char *(*XAudioWavRead)(void *context, unsigned int size);
+
+typedef struct
+{
+	int            format;     // XAUDIO_WAV_*
+	int            channels;
+	int            bitsPerSample;
+	unsigned int   rate;
+	unsigned int   blockAlign;
+	unsigned int   dataOffset; // data chunk position in file
+	unsigned int   dataSize;
+	unsigned int   blockBytes; // bytes decoded at once
+	unsigned int   remaining;  // bytes of data chunk not read yet
+	unsigned int   step;       // source frames per output frame (16.16 fixed point)
+	unsigned int   pos;        // current frame in pcm
+	unsigned int   frac;       // position between pos and pos+1 (16 bits)
+	unsigned int   frames;     // frames in pcm (first one is last frame of previous block)
+	short          pcm[(XAUDIO_WAV_MAX_BLOCK_FRAMES + 1) * 2];
+} XAUDIO_WAV_DECODER;
+
+// parses WAV header (first size bytes of the file, they must include the
+// start of data chunk), returns -1 if file isn't supported
+int XAudioWavOpen(XAUDIO_WAV_DECODER *decoder, const unsigned char *header, unsigned int size);
+
+// restarts reading at start of data chunk (decoding continues seamlessly, for loops)
+void XAudioWavRewind(XAUDIO_WAV_DECODER *decoder);
+
+// decodes up to frames 48kHz stereo frames into out, returns number of frames
+// decoded (less than frames once end of data is reached)
+unsigned int XAudioWavDecode(XAUDIO_WAV_DECODER *decoder, short *out, unsigned int frames, XAudioWavRead read, void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
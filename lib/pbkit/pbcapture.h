@@ -0,0 +1,30 @@
+//pbKit binary capture format (written by pb_start_capture, read by tools/pbstat)
+// This library is free software; you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as
+// published by the Free Software Foundation; either version 2.1 of the
+// License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, see <http://www.gnu.org/licenses/>
+
+#ifndef _PBCAPTURE_H_
+#define _PBCAPTURE_H_
+
+//All values are little endian 32 bits words.
+//File starts with magic and version, then a sequence of records.
+//Each record is: tag, number of payload words, payload words.
+
+#define PB_CAPTURE_MAGIC            0x50434250  //"PBCP"
+#define PB_CAPTURE_VERSION          1
+
+#define PB_CAPTURE_FRAME            1   //payload: frame number (written by pb_reset)
+#define PB_CAPTURE_BLOCK            2   //payload: block dwords, as sent to push buffer by pb_end
+#define PB_CAPTURE_LIST             3   //payload: physical address of display list, then its dwords
+                            //(written by pb_list_end, target of push buffer calls)
+
+#endif
@@ -0,0 +1,43 @@
+//pbKit fence values (used by pb_fence_* and the GPU memory pool, free of kernel dependencies for host side tests)
+// This library is free software; you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as
+// published by the Free Software Foundation; either version 2.1 of the
+// License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, see <http://www.gnu.org/licenses/>
+
+#ifndef _PBFENCE_H_
+#define _PBFENCE_H_
+
+#include <stdint.h>
+
+//Each fence inserted takes next value of a counter, GPU releases it into the
+//semaphore page once previous commands are executed: semaphore holds the value
+//of the last fence reached. Counter may wrap around, values are compared by
+//distance, so fences in flight must stay within 2^31 of each other.
+
+//returns next fence value (counter is last value inserted)
+static inline uint32_t pb_fence_next(uint32_t *counter)
+{
+    return ++(*counter);
+}
+
+//returns 1 if fence is reached, semaphore being the last value released by GPU
+static inline int pb_fence_passed(uint32_t semaphore, uint32_t fence)
+{
+    return ((int32_t)(semaphore-fence))>=0;
+}
+
+//returns 1 if fence has been inserted, counter being the last value inserted
+static inline int pb_fence_inserted(uint32_t counter, uint32_t fence)
+{
+    return ((int32_t)(fence-counter))<=0;
+}
+
+#endif
@@ -0,0 +1,39 @@
+//pbKit 16 bits index packing (used by pb_draw_indexed, free of kernel dependencies for host side tests)
+// This library is free software; you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as
+// published by the Free Software Foundation; either version 2.1 of the
+// License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, see <http://www.gnu.org/licenses/>
+
+#ifndef _PBINDEX_H_
+#define _PBINDEX_H_
+
+#include <stdint.h>
+
+//ARRAY_ELEMENT16 takes two indices per dword, first one in low half.
+//An odd last index has to be sent alone with ARRAY_ELEMENT32.
+
+//number of dwords needed for count indices
+static inline uint32_t pb_packed_indices16_size(uint32_t count)
+{
+    return count/2;
+}
+
+//packs pairs of indices into dst, returns where next dword goes (odd last index is left out)
+static inline uint32_t *pb_pack_indices16(uint32_t *dst, const uint16_t *indices, uint32_t count)
+{
+    uint32_t    i;
+
+    for(i=0;i+1<count;i+=2) *(dst++)=indices[i]|((uint32_t)indices[i+1]<<16);
+
+    return dst;
+}
+
+#endif
@@ -27,6 +27,13 @@
 #include "outer.h"
 #include "nv_objects.h"  //shared with renouveau files
 #include "nv20_shader.h" //(search "nouveau" on wiki)
+#include "pbcapture.h"
+#include "pbfence.h"
+#include "pbpacket.h"
+#include "pbvolatile.h"
+#include "pbindex.h"
+#include "pbpool.h"
+#include "pbswizzle.h"
 
 
 
@@ -34,6 +41,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <threads.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 //a macro used to build up a valid method
 #define EncodeMethod(subchannel,command,nparam) ((nparam<<18)+(subchannel<<13)+command)
@@ -63,6 +75,10 @@
 
 #define MAX_EXTRA_BUFFERS               8
 
+#define PB_TILES                    8
+#define PB_ZTAG_COUNT                   0x4C000 //Z compression tags (D3DTILE_MAXTAGS in XDK headers: 19Mb of compressed depth)
+#define PB_ZTAG_BYTES                   64  //depth stencil bytes covered by 1 tag
+
 #define MAXRAM                      0x03FFAFFF
 
 #define NONE                        -1
@@ -72,6 +88,36 @@
 #define PB_SETOUTER                 0xB2A
 #define PB_SETNOISE                 0xBAA
 #define PB_FINISHED                 0xFAB
+#define PB_MARKER                   0xA1A
+
+#define PB_RING_MARGIN                  (8*1024/4)  //a block never exceeds the 8Kb allocated after pb_Tail
+
+#define PB_FENCE_OFFSET                 0x100   //fence value location in semaphore page (Dma channel ID 8)
+
+#define PB_LIST_MARGIN                  (128+1) //dwords allocated after display list limit (1 block and return)
+#define PB_RETURN                   0x00020000  //ends a push buffer subroutine (display list)
+
+#define PB_CAPTURE_BUFFER_SIZE              (64*1024/4) //dwords buffered before writing capture file
+
+#define PB_BLOCK_SIZE                   128 //dwords a block may hold (see pb_begin)
+#define PB_CLEAR_BLOCK_RECTS                30  //rectangles per pb_clear block (4 dwords each)
+
+#define PB_COPY_LINE                    4096    //bytes per memory to memory line (see pb_copy)
+#define PB_COPY_MAX_LINES               2047
+#define PB_COPY_BLOCK_OPS               12  //memory to memory operations per block (9 dwords each)
+#define PB_BLIT_BLOCK_OPS               29  //image blits per block (4 dwords each, first block also holds 7 dwords of setup and 2 of restore)
+#define PB_DMA_ALL                  3   //Dma channel ID 3 covers all RAM (offsets are physical addresses)
+#define PB_DMA_DRAW                 11  //Dma channel ID 11 follows draw buffer (see set_surfaces)
+
+#define PB_MEM_ARENA_SIZE               (4*1024*1024)   //contiguous memory reserved at once by GPU memory pool
+
+#define PB_VS_SLOTS                 136 //transform program memory size (instructions)
+#define PB_VS_MAX_RESIDENT              32
+#define PB_VS_PACKET                    8   //instructions per packet (NV097_SET_TRANSFORM_PROGRAM has 32 registers)
+#define PB_VS_CONST_PACKET              8   //constants per packet (NV097_SET_TRANSFORM_CONSTANT has 32 registers)
+
+#define PB_MARKER_FRAMES                3   //frames GPU may lag behind, each has its own markers
+#define PB_MARKER_DEPTH                 8   //nesting levels of pb_marker_begin
 
 struct s_CtxDma
 {
@@ -112,7 +158,7 @@ static  DWORD           pb_OldFBConfig0;
 static  DWORD           pb_OldFBConfig1;
 static  DWORD           pb_OldVideoStart;
 
-static  DWORD           *pb_DmaBuffer8; //points at 32 contiguous bytes (Dma Channel ID 8 buffer)
+static  DWORD           *pb_DmaBuffer8; //points at 4096 contiguous bytes (Dma Channel ID 8 buffer, semaphores)
 static  DWORD           *pb_DmaBuffer2; //points at 32 contiguous bytes (Dma Channel ID 2 buffer)
 static  DWORD           *pb_DmaBuffer7; //points at 32 contiguous bytes (Dma Channel ID 7 buffer)
 
@@ -121,6 +167,97 @@ static  uint32_t        *pb_Head;   //points at push buffer head
 static  uint32_t        *pb_Tail;   //points at push buffer tail
 static  uint32_t        *pb_Put=NULL;   //where next command+params are to be written
 
+static  int         pb_RingMode=0;  //1: push buffer wraps around instead of being reset at each frame
+static  DWORD           pb_FrameBytes=0;    //bytes written since last pb_reset
+static  DWORD           pb_LastFrameBytes=0;
+static  ULONGLONG       pb_FrameStall=0;    //time spent waiting for free push buffer space (performance counter ticks)
+static  ULONGLONG       pb_LastFrameStall=0;
+static  DWORD           pb_Wraps=0;
+static  DWORD           pb_PeakFrameBytes=0;    //biggest frame since pb_init
+static  DWORD           pb_HighWater=0;     //furthest offset from push buffer head written since pb_init
+static  DWORD           pb_LargestBlock=0;  //bytes
+static  int         pb_SafeWrap=0;      //1: wraps around instead of overflowing if pb_reset comes too late
+static  int         pb_SafeWrapped=0;   //1 if push buffer wrapped since last pb_reset
+static  DWORD           pb_SafeWraps=0;
+
+static  uint32_t        pb_FenceLast=0; //last fence value inserted into push buffer
+
+//GPU memory pool (see pb_mem_alloc)
+static  int         pb_MemReady=0;
+static  RTL_CRITICAL_SECTION    pb_MemLock;
+static  PKTHREAD    pb_RenderThread;    //thread which called pb_init, the only one inserting fences for pool
+static  pb_pool_t       pb_Mem;
+static  int         pb_MemFenceNeeded=0;    //1 if blocks were freed after last fence
+
+//vertex programs resident in transform program memory (see pb_vs_bind)
+static  pb_vs_program_t     *pb_VsResident[PB_VS_MAX_RESIDENT]; //sorted by slot
+static  int         pb_VsResidentCount=0;
+static  pb_vs_program_t     *pb_VsBound=NULL;   //program transform program start points at
+static  DWORD           pb_VsClock=0;
+
+//CPU copy of vertex constants (see pb_vs_const_set)
+static  float           pb_VsConst[PB_VS_CONSTANTS][4] __attribute__((aligned(16)));
+static  DWORD           pb_VsConstValid[PB_VS_CONSTANTS/32];    //1 bit per constant, set if GPU has pb_VsConst value
+static  DWORD           pb_VsConstDirty[PB_VS_CONSTANTS/32];    //1 bit per constant, set if it has to be sent
+static  int         pb_VsConstDirtyAny=0;
+
+//profiling markers (see pb_marker_begin)
+typedef struct
+{
+    const char      *name;
+    int         depth;
+    ULONGLONG       cpu_begin;
+    ULONGLONG       cpu_end;
+    ULONGLONG       gpu_begin;  //written by pb_subprog when GPU reaches marker
+    ULONGLONG       gpu_end;
+} pb_marker_t;
+
+typedef struct
+{
+    pb_marker_t     markers[PB_MAX_MARKERS];
+    int         count;
+    DWORD           frame;
+    int         pending;    //1 while waiting for GPU timestamps
+    volatile DWORD      gpu_stamps; //timestamps written by pb_subprog
+} pb_marker_frame_t;
+
+static  pb_marker_frame_t   pb_MarkerFrames[PB_MARKER_FRAMES];
+static  int         pb_MarkerCurrent=0;
+static  DWORD           pb_MarkerFrame=0;
+static  int         pb_MarkerStack[PB_MARKER_DEPTH];
+static  int         pb_MarkerDepth=0;
+static  int         pb_MarkerOverflow=0;    //nested pb_marker_begin calls beyond PB_MARKER_DEPTH
+static  pb_marker_result_t  pb_MarkerResults[PB_MAX_MARKERS];  //last resolved frame
+static  int         pb_MarkerResultCount=0;
+static  FILE            *pb_MarkerTrace=NULL;
+static  ULONGLONG       pb_MarkerTraceStart;
+static  int         pb_MarkerTraceEvents;
+
+//optional shadow copy of 3D class state (filters out writes of unchanged values)
+static  int         pb_ShadowEnabled=0;
+static  DWORD           pb_Shadow[2048];    //last value sent to each 3D class method (index=method>>2)
+static  DWORD           pb_ShadowValid[2048/32];    //1 bit per method, set if pb_Shadow value is known
+static  DWORD           pb_ShadowVolatile[2048/32]; //1 bit per method, set if method must always be sent
+static  DWORD           pb_ShadowSaved=0;   //dwords not sent since last pb_reset
+static  DWORD           pb_LastShadowSaved=0;
+
+//Block building state is per thread, so worker threads can record their own
+//display lists while render thread fills push buffer (see pb_list_begin)
+
+//optional coalescing of writes to adjacent registers into one packet
+static  int         pb_CoalesceEnabled=0;
+static thread_local pb_packet_t pb_Packet;  //last packet of current block (head is NULL if it can't grow)
+
+static thread_local pb_list_t   *pb_Recording=NULL; //display list being recorded (blocks go there instead of push buffer)
+
+//binary capture of push buffer contents (see pbcapture.h)
+static  FILE            *pb_CaptureFile=NULL;
+static  int         pb_CaptureLockReady=0;
+static  RTL_CRITICAL_SECTION    pb_CaptureLock; //display lists may be recorded by other threads
+static  DWORD           pb_CaptureBuffer[PB_CAPTURE_BUFFER_SIZE];
+static  DWORD           pb_CaptureUsed;
+static  DWORD           pb_CaptureFrame;
+
 static  float           pb_CpuFrequency;
 
 static  DWORD           pb_GpuInstMem;
@@ -147,8 +284,22 @@ static  BYTE            pb_GammaRamp[3][3][256];
 
 static  int         pb_BackBufferNxt=0;
 static  int         pb_BackBufferNxtVBL=0;
-static  int         pb_BackBufferbReady[3]={0,0,0};
-static  int         pb_BackBufferIndex[3];
+static  int         pb_BackBufferbReady[PB_MAX_BACK_BUFFERS+1]={0,0,0,0,0};
+static  int         pb_BackBufferIndex[PB_MAX_BACK_BUFFERS+1];
+static  DWORD           pb_BackBuffersCount=2;  //rotating back buffers (see pb_back_buffers)
+
+//presentation (see pb_present)
+static  int         pb_PresentMode=PB_PRESENT_VSYNC;
+static volatile DWORD       pb_Presented=0;     //frames queued (written by CPU)
+static volatile DWORD       pb_Flipped=0;       //frames that reached screen (written by Dpc)
+static  DWORD           pb_FlipVBL;     //pb_vbl_counter value at last flip
+static  ULONGLONG       pb_PresentStamp[PB_MAX_BACK_BUFFERS+1]; //when each queued frame was presented
+static  DWORD           pb_MissedVBlanks=0;
+static  DWORD           pb_TornFlips=0;
+static  DWORD           pb_PresentTimeouts=0;
+static  ULONGLONG       pb_LatencyLast=0;   //performance counter ticks
+static  ULONGLONG       pb_LatencySum=0;
+static  ULONGLONG       pb_LatencyMax=0;
 
 static  DWORD           pb_FifoChannelsReady=0;
 static  DWORD           pb_FifoChannelsMode=NV_PFIFO_MODE_ALL_PIO;
@@ -162,7 +313,7 @@ static  DWORD           pb_FrameBuffersWidth;
 static  DWORD           pb_FrameBuffersHeight;
 static  DWORD           pb_FrameBuffersAddr;
 static  DWORD           pb_FrameBuffersPitch;
-static  DWORD           pb_FBAddr[3];       //frame buffers addresses
+static  DWORD           pb_FBAddr[PB_MAX_BACK_BUFFERS+1];   //frame buffers addresses
 static  DWORD           pb_FBSize;      //size of 1 buffer
 static  DWORD           pb_FBGlobalSize;    //size of all buffers
 static  DWORD           pb_FBVFlag;
@@ -170,9 +321,16 @@ static  DWORD           pb_GPUFrameBuffersFormat;//encoded format for GPU
 static  DWORD           pb_EXAddr[8];       //extra buffers addresses
 static  DWORD           pb_ExtraBuffersCount=0;
 
+//NV_PFB tiles and Z compression tags (see pb_rt_create)
+static  DWORD           pb_TilesUsed=0;     //1 bit per tile
+static  DWORD           pb_ZTagStart[PB_TILES];
+static  DWORD           pb_ZTagCount[PB_TILES]; //0 if tile doesn't use Z compression
+
 static  DWORD           pb_DepthStencilAddr;
 static  DWORD           pb_DepthStencilPitch;
 static int          pb_DepthStencilLast;
+static  DWORD           pb_DepthStencilLastLimit;   //last byte of depth stencil Dma bound (depends on height and pitch)
+static  int         pb_ColorWritesOff=0;    //1 while a depth only target is bound (see pb_color_writes)
 static  DWORD           pb_DSAddr;      //depth stencil address
 static  DWORD           pb_DSSize;      //size of depth stencil buffer
 static  DWORD           pb_GPUDepthStencilFormat;//encoded format for GPU
@@ -180,6 +338,9 @@ static  DWORD           pb_GPUDepthStencilFormat;//encoded format for GPU
 static  int         pb_front_index;
 static  int         pb_back_index;
 
+static  DWORD           pb_SurfaceWidth;    //size of surfaces rendering goes into (see set_surfaces)
+static  DWORD           pb_SurfaceHeight;
+
 static  DWORD           pb_Viewport_x;
 static  DWORD           pb_Viewport_y;
 static  DWORD           pb_Viewport_width;
@@ -201,11 +362,11 @@ static  DWORD           pb_DmaChID11Inst;
 
 static volatile DWORD  *pb_DmaUserAddr;
 
-static  DWORD           pb_PushIndex;
-static  DWORD           *pb_PushStart;
-static  DWORD           *pb_PushNext;
+static thread_local DWORD   pb_PushIndex;
+static thread_local DWORD   *pb_PushStart;
+static thread_local DWORD   *pb_PushNext;
 
-static int          pb_BeginEndPair=0;
+static thread_local int     pb_BeginEndPair=0;
 
 static float            pb_FixedPipelineConstants[12]={
                     0.0f,   0.5f,   1.0f,   2.0f,
@@ -237,6 +398,11 @@ static HAL_SHUTDOWN_REGISTRATION pb_shutdown_registration;
 
 //forward references
 static void pb_load_gr_ctx(int ctx_id);
+static DWORD pb_surface_color(DWORD color);
+static void pb_capture(DWORD tag, const DWORD *head, DWORD nhead, const void *data, DWORD n);
+static DWORD pb_fence_current(void);
+static void pb_marker_stamp(DWORD id);
+static void pb_marker_frame(void);
 static NTAPI VOID pb_shutdown_notification_routine (PHAL_SHUTDOWN_REGISTRATION ShutdownRegistration);
 
 
@@ -250,6 +416,21 @@ static  char        pb_text_screen[ROWS][COLS];
 static int      pb_next_row=0;
 static int      pb_next_col=0;
 
+#define PB_GLYPH_MAX_RECTS  16  //max rectangles kept for one glyph of systemFont
+#define PB_TEXT_BLOCK_RECTS 30  //rectangles per begin-end block (keeps blocks under 128 dwords)
+
+//glyph atlas: each systemFont glyph is converted once into a few rectangles
+//(runs of lit pixels, merged with identical runs on following lines)
+static int      pb_GlyphAtlasReady=0;
+static BYTE     pb_GlyphRectCount[256];
+static BYTE     pb_GlyphRects[256][PB_GLYPH_MAX_RECTS][4];  //x,line,width,lines
+
+//screen rectangles of each text row, only rebuilt when the row text changes
+//packed as x1|(y1<<10)|(w<<20)|(h<<24)
+static char     pb_TextRowDrawn[ROWS][COLS];
+static int      pb_TextRowCount[ROWS];
+static DWORD        pb_TextRowRects[ROWS][COLS*PB_GLYPH_MAX_RECTS];
+
 static unsigned char systemFont[] =
 {
     0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
@@ -446,13 +627,39 @@ static void pb_set_gamma_ramp(BYTE *pGammaRamp)
 
 
 
+//called in Dpc when a queued frame reaches screen
+static void pb_flipped(void)
+{
+    int         index;
+    ULONGLONG       latency;
+
+    index=pb_GammaRampIdx;
+    if (pb_GammaRampbReady[index])
+    {
+        pb_set_gamma_ramp(&pb_GammaRamp[index][0][0]);
+        pb_GammaRampbReady[index]=0;
+        index=(index+1)%3;
+        pb_GammaRampIdx=index;
+    }
+
+    VIDEOREG(NV_PGRAPH_INCREMENT)|=NV_PGRAPH_INCREMENT_READ_3D_TRIGGER;
+
+    //frames reach screen in the order they were presented
+    latency=KeQueryPerformanceCounter()-pb_PresentStamp[pb_Flipped%pb_FrameBuffersCount];
+    pb_LatencyLast=latency;
+    pb_LatencySum+=latency;
+    if (latency>pb_LatencyMax) pb_LatencyMax=latency;
+
+    pb_FlipVBL=pb_vbl_counter;
+    pb_Flipped++;
+}
+
 static void pb_vbl_handler(void)
 {
     BYTE        old_color_addr; //important index to preserve if we are called from Dpc or Isr
 
     int     flag;
     int     next;
-    int     index;
 
     old_color_addr=VIDEOREG8(NV_PRMCIO_CRX__COLOR);
 
@@ -467,21 +674,15 @@ static void pb_vbl_handler(void)
         //screen swapping has been done already, theoretically, in ISR
         pb_BackBufferbReady[next]=0;
 
-        index=pb_GammaRampIdx;
-        if (pb_GammaRampbReady[index])
-        {
-            pb_set_gamma_ramp(&pb_GammaRamp[index][0][0]);
-            pb_GammaRampbReady[index]=0;
-            index=(index+1)%3;
-            pb_GammaRampIdx=index;
-        }
-
-        VIDEOREG(NV_PGRAPH_INCREMENT)|=NV_PGRAPH_INCREMENT_READ_3D_TRIGGER;
+        pb_flipped();
 
-        //rotate next back buffer & gamma ramp index
-        next=(next+1)%3;
+        //rotate next back buffer
+        next=(next+1)%pb_FrameBuffersCount;
         pb_BackBufferNxtVBL=next;
     }
+    else
+    if ((pb_Presented!=pb_Flipped)&&(pb_PresentMode!=PB_PRESENT_IMMEDIATE))
+        pb_MissedVBlanks++; //a frame is queued, but GPU hasn't finished drawing it yet
 
     do
     {
@@ -540,11 +741,27 @@ static void pb_subprog(DWORD subprogID, DWORD paramA, DWORD paramB)
             VIDEOREG(NV_PGRAPH_RDI_DATA)=paramA;
             break;
 
+        case PB_MARKER: //GPU has reached a profiling marker (paramA: frame set, frame, marker, begin/end)
+            pb_marker_stamp(paramA);
+            break;
+
         case PB_FINISHED: //warns that all drawing has been finished for the frame
+            //no frame waiting for VBlank? then tearing modes may show it at once
+            //(adaptive only does it if the VBlank following last flip has been missed)
+            if ((pb_BackBufferbReady[pb_BackBufferNxtVBL]==0)&&(pb_debug_screen_active==0))
+            if ((pb_PresentMode==PB_PRESENT_IMMEDIATE)||
+                ((pb_PresentMode==PB_PRESENT_ADAPTIVE)&&(pb_vbl_counter!=pb_FlipVBL)))
+            {
+                VIDEOREG(PCRTC_START)=pb_FBAddr[paramA]&0x03FFFFFF;
+                pb_TornFlips++;
+                pb_flipped();
+                break;
+            }
+
             next=pb_BackBufferNxt;
             pb_BackBufferIndex[next]=paramA;
             pb_BackBufferbReady[next]=1;
-            next=(next+1)%3;
+            next=(next+1)%pb_FrameBuffersCount;
             pb_BackBufferNxt=next;
             break;
 
@@ -1779,6 +1996,137 @@ static void pb_jump_to_head(void)
 
 
 
+//1 if GPU Get doesn't let us write the next block at pb_Put yet
+static int pb_ring_blocked(uint32_t *pGetAddr, int wrapping)
+{
+    //Get==pb_Head after the jump to head could mean GPU followed it (caught up)
+    //or GPU didn't even start the lap we are finishing (full). To tell them apart
+    //we never wrap while Get is still at pb_Head (one slot gap).
+    if (wrapping) return pGetAddr==pb_Head;
+
+    return (pGetAddr>pb_Put)&&(pGetAddr-pb_Put<PB_RING_MARGIN);
+}
+
+static void pb_ring_wait(int wrapping)
+{
+    uint32_t        *pGetAddr;
+
+    DWORD           TimeStampTicks;
+    ULONGLONG       StallStart;
+
+    pGetAddr=(uint32_t *)((*(pb_DmaUserAddr+0x44/4))|0x80000000);
+    if (!pb_ring_blocked(pGetAddr,wrapping)) return;
+
+    StallStart=KeQueryPerformanceCounter();
+    TimeStampTicks=KeTickCount;
+
+    do
+    {
+        if ((*(pb_DmaUserAddr+0x44/4))>0x04000000)
+        {
+#ifdef DBG
+            debugPrint("pb_begin: bad getaddr\n");
+#endif
+            break;
+        }
+
+        if (KeTickCount-TimeStampTicks>TICKSTIMEOUT)
+        {
+            debugPrint("pb_begin: waited too long for push buffer space\n");
+            break;
+        }
+
+        pGetAddr=(uint32_t *)((*(pb_DmaUserAddr+0x44/4))|0x80000000);
+    }while (pb_ring_blocked(pGetAddr,wrapping));
+
+    pb_FrameStall+=KeQueryPerformanceCounter()-StallStart;
+}
+
+static void pb_ring_reserve(void)
+{
+    //Ring mode: when tail is reached, a jump to head is written and we keep going.
+    //GPU Get is never ahead of pb_Put, so if Get>pb_Put, GPU is still reading the
+    //previous lap and we only wait if it hasn't consumed the space next block needs.
+
+    if (pb_Put>=pb_Tail)
+    {
+        pb_ring_wait(1);
+        *(pb_Put+0)=1+(((DWORD)pb_Head)&0x0FFFFFFF);
+        pb_Put=pb_Head;
+        pb_start();
+        pb_Wraps++;
+    }
+
+    pb_ring_wait(0);
+}
+
+
+
+
+
+//returns 1 if the values are already known to be in these 3D class registers
+//otherwise records them and returns 0
+static int pb_shadow_filter(DWORD subchannel, DWORD command, DWORD nparam, DWORD *params)
+{
+    DWORD       i,m;
+
+    //display lists run later, in a state we don't know
+    if ((pb_Recording)||(subchannel!=SUBCH_3D)||(command&0x40000000)) return 0;
+
+    m=(command&0x1FFC)>>2;
+    if (m+nparam>2048) return 0;
+
+    for(i=0;i<nparam;i++)
+    {
+        if ((pb_ShadowValid[(m+i)>>5]&(1<<((m+i)&31)))==0) break;
+        if (pb_Shadow[m+i]!=params[i]) break;
+    }
+    if (i==nparam)
+    {
+        pb_ShadowSaved+=1+nparam;
+        return 1;
+    }
+
+    for(i=0;i<nparam;i++,m++)
+    {
+        pb_Shadow[m]=params[i];
+        if ((pb_ShadowVolatile[m>>5]&(1<<(m&31)))==0) pb_ShadowValid[m>>5]|=1<<(m&31);
+    }
+    return 0;
+}
+
+//forgets values of registers written without going through pb_shadow_filter
+static void pb_shadow_forget(DWORD subchannel, DWORD command, DWORD nparam)
+{
+    DWORD       m;
+
+    if ((pb_Recording)||(subchannel!=SUBCH_3D)) return;
+
+    m=(command&0x1FFC)>>2;
+    if (command&0x40000000) nparam=1; //non-incrementing method
+
+    for(;(nparam>0)&&(m<2048);nparam--,m++) pb_ShadowValid[m>>5]&=~(1<<(m&31));
+}
+
+//forgets resident vertex programs and/or constants values after a display list
+//changed them (see pb_vs_bind and pb_vs_const_set while recording)
+static void pb_vs_forget(DWORD changed)
+{
+    int         i;
+
+    if (changed&PB_LIST_VS_PROGRAM)
+    {
+        for(i=0;i<pb_VsResidentCount;i++) pb_VsResident[i]->slot=-1;
+        pb_VsResidentCount=0;
+        pb_VsBound=NULL;
+    }
+    if (changed&PB_LIST_VS_CONSTANTS) memset(pb_VsConstValid,0,sizeof(pb_VsConstValid));
+}
+
+
+
+
+
 //public functions
 
 int pb_busy(void)
@@ -1835,26 +2183,20 @@ DWORD *pb_extra_buffer(int buffer_index)
 }
 
 
-static void set_draw_buffer(DWORD buffer_addr)
+//points GPU at color and depth stencil surfaces (depth_addr=0: no depth stencil)
+static void set_surfaces(DWORD buffer_addr, DWORD pitch, DWORD depth_addr, DWORD pitch_depth_stencil, DWORD width, DWORD height)
 {
     uint32_t        *p;
 
-    DWORD           width;
-    DWORD           height;
-    DWORD           pitch;
-    DWORD           pitch_depth_stencil;
-
     DWORD           dma_flags;
     DWORD           dma_addr;
     DWORD           dma_limit;
+    DWORD           depth_limit;
 
     int         flag;
-    int         depth_stencil;
-    
-    width=pb_FrameBuffersWidth;
-    height=pb_FrameBuffersHeight;
-    pitch=pb_FrameBuffersPitch;
-    pitch_depth_stencil=pb_DepthStencilPitch;
+
+    pb_SurfaceWidth=width;
+    pb_SurfaceHeight=height;
 
     //DMA channel 9 is used by GPU in order to render pixels
     dma_addr=buffer_addr;
@@ -1894,16 +2236,16 @@ static void set_draw_buffer(DWORD buffer_addr)
     p=pb_push1_to(SUBCH_4,p,NV20_TCL_PRIMITIVE_3D_SET_OBJECT2,11);
     pb_end(p);
 
-    depth_stencil=1;
+    depth_limit=(depth_addr)?height*pitch_depth_stencil-1:0; //(last byte)
 
-    if (depth_stencil!=-1) //don't care
-    if (pb_DepthStencilLast!=depth_stencil) //changed?
+    //same address with another size (e.g. render target reallocated) needs a new limit
+    if ((pb_DepthStencilLast!=(int)depth_addr)||(pb_DepthStencilLastLimit!=depth_limit)) //changed?
     {
         //DMA channel 10 is used by GPU in order to render depth stencil
-        if (depth_stencil)
+        if (depth_addr)
         {
-            dma_addr=pb_DSAddr&0x03FFFFFF;
-            dma_limit=height*pitch_depth_stencil-1; //(last byte)
+            dma_addr=depth_addr;
+            dma_limit=depth_limit;
             dma_flags=DMA_CLASS_3D|0x0000B000;
             dma_addr|=3;
             flag=1;
@@ -1915,7 +2257,6 @@ static void set_draw_buffer(DWORD buffer_addr)
             dma_flags=DMA_CLASS_3D|0x0000B000;
             dma_addr|=3;
             flag=0;
-            pitch_depth_stencil=pitch;
         }
         
         p=pb_begin();
@@ -1933,9 +2274,12 @@ static void set_draw_buffer(DWORD buffer_addr)
         p=pb_push1(p,NV20_TCL_PRIMITIVE_3D_STENCIL_ENABLE,1);   //StencilEnable=TRUE
         pb_end(p);
 
-        pb_DepthStencilLast=depth_stencil;
+        pb_DepthStencilLast=depth_addr;
+        pb_DepthStencilLastLimit=depth_limit;
     }
 
+    if (depth_addr==0) pitch_depth_stencil=pitch;
+
     p=pb_begin();
     p=pb_push3(p,NV20_TCL_PRIMITIVE_3D_BUFFER_PITCH,(pitch_depth_stencil<<16)|(pitch&0xFFFF),0,0);
     p=pb_push2(p,NV20_TCL_PRIMITIVE_3D_VIEWPORT_HORIZ,width<<16,height<<16);
@@ -1948,6 +2292,32 @@ static void set_draw_buffer(DWORD buffer_addr)
     pb_end(p);
 }
 
+//depth only targets point color surface at depth stencil, so color writes are masked
+//while they are bound (color mask is set back to all channels afterwards)
+static void pb_color_writes(int enable)
+{
+    uint32_t        *p;
+
+    if (enable!=pb_ColorWritesOff) return; //unchanged
+
+    p=pb_begin();
+    p=pb_push1(p,NV097_SET_COLOR_MASK,(enable)?(NV097_SET_COLOR_MASK_BLUE_WRITE_ENABLE|NV097_SET_COLOR_MASK_GREEN_WRITE_ENABLE|
+                        NV097_SET_COLOR_MASK_RED_WRITE_ENABLE|NV097_SET_COLOR_MASK_ALPHA_WRITE_ENABLE):0);
+    pb_end(p);
+    pb_ColorWritesOff=!enable;
+}
+
+static void set_draw_buffer(DWORD buffer_addr)
+{
+    pb_color_writes(1);
+    set_surfaces(   buffer_addr,
+            pb_FrameBuffersPitch,
+            pb_DSAddr&0x03FFFFFF,
+            pb_DepthStencilPitch,
+            pb_FrameBuffersWidth,
+            pb_FrameBuffersHeight   );
+}
+
 
 void pb_target_back_buffer(void)
 {
@@ -1965,6 +2335,159 @@ void pb_target_extra_buffer(int buffer_index)
     set_draw_buffer(pb_EXAddr[buffer_index]&0x03FFFFFF);
 }
 
+//looks for count free Z compression tags (first fit), returns 0 if there is no room
+static int pb_ztag_alloc(DWORD count, DWORD *start)
+{
+    DWORD           tag;
+    int         i;
+
+    tag=0;
+    i=0;
+    while(i<PB_TILES)
+    {
+        if ((pb_ZTagCount[i])&&(tag<pb_ZTagStart[i]+pb_ZTagCount[i])&&(pb_ZTagStart[i]<tag+count))
+        {
+            //overlaps tags of tile i, retry after them (start tag has to be a multiple of 4)
+            tag=(pb_ZTagStart[i]+pb_ZTagCount[i]+3)&~3;
+            i=0;
+        }
+        else
+            i++;
+    }
+
+    if (tag+count>PB_ZTAG_COUNT) return 0;
+
+    *start=tag;
+    return 1;
+}
+
+//covers a surface with a free tile (depth: with Z compression if tags are left), returns -1 if none is free
+static int pb_tile_alloc(DWORD addr, DWORD size, DWORD pitch, int depth)
+{
+    DWORD           start;
+    DWORD           count;
+    int         i;
+
+    for(i=0;i<PB_TILES;i++) if ((pb_TilesUsed&(1<<i))==0) break;
+    if (i==PB_TILES) return -1;
+
+    pb_TilesUsed|=1<<i;
+    pb_ZTagCount[i]=0;
+
+    count=size/PB_ZTAG_BYTES;
+    if ((depth)&&(pb_ztag_alloc(count,&start)))
+    {
+        pb_ZTagStart[i]=start;
+        pb_ZTagCount[i]=count;
+        pb_assign_tile(i,addr&0x03FFFFFF,size,pitch,start,0,0x84000001); //Z compressed, 32 bits
+    }
+    else
+        pb_assign_tile(i,addr&0x03FFFFFF,size,pitch,0,0,depth?0x00000001:0);
+
+    return i;
+}
+
+static void pb_tile_free(int index)
+{
+    if (index<0) return;
+
+    pb_release_tile(index,0);
+    pb_ZTagCount[index]=0;
+    pb_TilesUsed&=~(1<<index);
+}
+
+static DWORD pb_rt_alloc(DWORD width, DWORD height, DWORD *pitch, DWORD *size)
+{
+    DWORD           Pitch;
+    int         i;
+
+    //tiled surfaces need a listed pitch, and addr & size 16Kb aligned
+    Pitch=((width*4)+0x3F)&0xFFFFFFC0;
+    for(i=0;i<16;i++)
+    {
+        if (pb_TilePitches[i]>=Pitch)
+        {
+            Pitch=pb_TilePitches[i];
+            break;
+        }
+    }
+
+    *pitch=Pitch;
+    *size=(Pitch*height+0x3FFF)&0xFFFFC000;
+
+    return (DWORD)MmAllocateContiguousMemoryEx(*size,0,0x03FFB000,0x4000,0x404);
+}
+
+int pb_rt_create(pb_render_target_t *rt, DWORD width, DWORD height, DWORD flags)
+{
+    memset(rt,0,sizeof(pb_render_target_t));
+    rt->width=width;
+    rt->height=height;
+    rt->color_tile=-1;
+    rt->depth_tile=-1;
+
+    if ((flags&(PB_RT_COLOR|PB_RT_DEPTH))==0) return -1;
+    if (width*4>pb_TilePitches[15]) return -1;
+
+    if (flags&PB_RT_COLOR)
+    {
+        rt->color=(DWORD *)pb_rt_alloc(width,height,&rt->color_pitch,&rt->color_size);
+        if (rt->color==NULL) return -2;
+        rt->color_tile=pb_tile_alloc((DWORD)rt->color,rt->color_size,rt->color_pitch,0);
+    }
+
+    if (flags&PB_RT_DEPTH)
+    {
+        rt->depth=(DWORD *)pb_rt_alloc(width,height,&rt->depth_pitch,&rt->depth_size);
+        if (rt->depth==NULL)
+        {
+            pb_rt_destroy(rt);
+            return -2;
+        }
+        rt->depth_tile=pb_tile_alloc((DWORD)rt->depth,rt->depth_size,rt->depth_pitch,1);
+        if (rt->depth_tile>=0) rt->compressed=(pb_ZTagCount[rt->depth_tile]!=0);
+    }
+
+    return 0;
+}
+
+void pb_rt_destroy(pb_render_target_t *rt)
+{
+    //GPU may still be drawing into target
+    if ((rt->color)||(rt->depth)) pb_fence_wait(pb_fence_insert());
+
+    pb_tile_free(rt->color_tile);
+    pb_tile_free(rt->depth_tile);
+    if (rt->color) MmFreeContiguousMemory(rt->color);
+    if (rt->depth) MmFreeContiguousMemory(rt->depth);
+
+    rt->color=NULL;
+    rt->depth=NULL;
+    rt->color_tile=-1;
+    rt->depth_tile=-1;
+    rt->compressed=0;
+}
+
+void pb_target_render_target(pb_render_target_t *rt)
+{
+    //depth only target: color surface points at depth stencil, color writes are masked
+    pb_color_writes(rt->color!=NULL);
+    if (rt->color)
+        set_surfaces(   (DWORD)rt->color&0x03FFFFFF,
+                rt->color_pitch,
+                (DWORD)rt->depth&0x03FFFFFF,
+                rt->depth_pitch,
+                rt->width,
+                rt->height  );
+    else
+        set_surfaces(   (DWORD)rt->depth&0x03FFFFFF,
+                rt->depth_pitch,
+                (DWORD)rt->depth&0x03FFFFFF,
+                rt->depth_pitch,
+                rt->width,
+                rt->height  );
+}
+
 DWORD pb_get_vbl_counter(void)
 {
     return pb_vbl_counter; //allows caller to know if a frame has been missed
@@ -2016,53 +2539,144 @@ void pb_erase_text_screen(void)
     memset(pb_text_screen,0,sizeof(pb_text_screen));
 }
 
-void pb_draw_text_screen(void)
+static void pb_build_glyph_atlas(void)
+{
+    int c,l,n,k,x1,x2,r;
+    BYTE run[8][4][2];  //x,width of each run of lit pixels, per line
+    int nruns[8];
+    BYTE bits;
+
+    for(c=0;c<256;c++)
+    {
+        for(l=0;l<8;l++)
+        {
+            bits=systemFont[c*8+l];
+            for(k=0,nruns[l]=0;k<8;)
+            {
+                if ((bits<<k)&0x80)
+                {
+                    for(x1=k;(k<8)&&((bits<<k)&0x80);k++);
+                    run[l][nruns[l]][0]=x1;
+                    run[l][nruns[l]][1]=k-x1;
+                    nruns[l]++;
+                }
+                else
+                    k++;
+            }
+        }
+
+        //a run starts a new rectangle unless the line above had the same run
+        pb_GlyphRectCount[c]=0;
+        for(l=0;l<8;l++)
+        for(r=0;r<nruns[l];r++)
+        {
+            if (l>0)
+            {
+                for(n=0;n<nruns[l-1];n++)
+                    if ((run[l-1][n][0]==run[l][r][0])&&(run[l-1][n][1]==run[l][r][1])) break;
+                if (n<nruns[l-1]) continue;
+            }
+
+            for(x2=l+1;x2<8;x2++)
+            {
+                for(n=0;n<nruns[x2];n++)
+                    if ((run[x2][n][0]==run[l][r][0])&&(run[x2][n][1]==run[l][r][1])) break;
+                if (n==nruns[x2]) break;
+            }
+
+            if (pb_GlyphRectCount[c]==PB_GLYPH_MAX_RECTS)
+            {
+                debugPrint("pb_build_glyph_atlas: glyph %d too complex, truncated\n",c);
+                break;
+            }
+            n=pb_GlyphRectCount[c]++;
+            pb_GlyphRects[c][n][0]=run[l][r][0];
+            pb_GlyphRects[c][n][1]=l;
+            pb_GlyphRects[c][n][2]=run[l][r][1];
+            pb_GlyphRects[c][n][3]=x2-l;
+        }
+    }
+
+    pb_GlyphAtlasReady=1;
+}
+
+static void pb_build_text_row(int i)
 {
-    int i,j,k,l,m,x1,x2,y;
+    int j,k,n,x,y;
     unsigned char c;
+    BYTE *r;
+    DWORD *q;
 
-    for(i=0;i<ROWS;i++)
-    for(j=0;j<COLS;j++)
+    q=&pb_TextRowRects[i][0];
+    y=25+i*25;
+    for(j=0,n=0;j<COLS;j++)
     {
         c=pb_text_screen[i][j];
-        if ((c==' ')||(c=='\t')) pb_text_screen[i][j]=0;
+        x=20+j*10;
+        for(k=0;k<pb_GlyphRectCount[c];k++)
+        {
+            r=pb_GlyphRects[c][k];
+            q[n++]=(x+r[0])|((y+r[1]*2)<<10)|(r[2]<<20)|((r[3]*2)<<24);
+        }
+    }
+    pb_TextRowCount[i]=n;
+    memcpy(&pb_TextRowDrawn[i][0],&pb_text_screen[i][0],COLS);
+}
+
+//The glyph atlas isn't a texture: glyphs are drawn as CLEAR_SURFACE rectangles
+//(about 4 per glyph, 3 dwords each), which needs no texture stage, combiner or
+//vertex program state, so drawing text doesn't disturb the caller's 3D state.
+void pb_draw_text_screen(void)
+{
+    int i,k,n,x1,y1,x2,y2;
+    DWORD   *q;
+    uint32_t    *p;
+    
+    if (!pb_GlyphAtlasReady) pb_build_glyph_atlas();
+
+    //rebuild rectangles of rows which changed since last call
+    for(i=0,n=0;i<ROWS;i++)
+    {
+        if (memcmp(&pb_TextRowDrawn[i][0],&pb_text_screen[i][0],COLS))
+            pb_build_text_row(i);
+        n+=pb_TextRowCount[i];
     }
+    if (n==0) return;
+
+    p=pb_begin();
+    p=pb_push1(p,NV097_SET_COLOR_CLEAR_VALUE,pb_surface_color(0xFFFFFF));
 
-    //convert pb_text_screen characters into push buffer commands
-    //TODO: replace rectangle fill with texture copy when available!
-    for(i=0;i<ROWS;i++)
-    for(j=0;j<COLS;j++)
+    //all glyph rectangles are cleared in a few blocks. Rectangle coordinates
+    //and trigger share one packet: the trigger fires on the previous rectangle
+    for(i=0,n=0;i<ROWS;i++)
     {
-        c=pb_text_screen[i][j];
-        if (c)
+        for(k=0,q=&pb_TextRowRects[i][0];k<pb_TextRowCount[i];k++,q++)
         {
-            for(l=0,x1=-1,x2=-1;l<8;l++,x1=-1,x2=-1)
-            for(k=0,m=0x80;k<8;k++,m>>=1)                   
-            if (systemFont[c*8+l]&m)
+            x1=*q&0x3FF;
+            y1=(*q>>10)&0x3FF;
+            x2=x1+((*q>>20)&0xF);
+            y2=y1+(*q>>24);
+            if (n==0)
+                pb_push(p++,NV097_SET_CLEAR_RECT_HORIZONTAL,2);
+            else
             {
-                if (x1>=0) 
-                    x2=20+j*10+k;
-                else
-                    x1=20+j*10+k;
+                pb_push(p++,NV097_CLEAR_SURFACE,3);
+                *(p++)=NV097_CLEAR_SURFACE_COLOR;
             }
-            else
+            *(p++)=((x2-1)<<16)|x1;
+            *(p++)=((y2-1)<<16)|y1;
+            if (++n==PB_TEXT_BLOCK_RECTS)
             {
-                if (x2>=0)
-                {
-                    y=25+i*25+l*2;
-                    pb_fill(x1,y,x2-x1+1,2,0xFFFFFF);
-                    x1=x2=-1;
-                }
-                else
-                if (x1>=0)
-                {
-                    y=25+i*25+l*2;
-                    pb_fill(x1,y,1,2,0xFFFFFF);
-                    x1=-1;
-                }
+                p=pb_push1(p,NV097_CLEAR_SURFACE,NV097_CLEAR_SURFACE_COLOR);
+                pb_end(p);
+                p=pb_begin();
+                n=0;
             }
         }
-    }   
+    }
+
+    if (n) p=pb_push1(p,NV097_CLEAR_SURFACE,NV097_CLEAR_SURFACE_COLOR);
+    pb_end(p);
 }
 
 
@@ -2074,6 +2688,17 @@ void pb_extra_buffers(int n)
         pb_ExtraBuffersCount=n;
 }
 
+void pb_back_buffers(int n)
+{
+    if ((n<2)||(n>PB_MAX_BACK_BUFFERS))
+        debugPrint("Back buffers count must be 2 to %d\n",PB_MAX_BACK_BUFFERS);
+    else
+    if (pb_running)
+        debugPrint("Can't set back buffers count while push buffer Dma engine is running.\n");
+    else
+        pb_BackBuffersCount=n;
+}
+
 void pb_size(DWORD size)
 {
     if (pb_running)
@@ -2093,22 +2718,286 @@ void pb_size(DWORD size)
 
 void pb_reset(void)
 {
-    pb_jump_to_head();
-}
-
+    if (pb_FrameBytes>pb_PeakFrameBytes) pb_PeakFrameBytes=pb_FrameBytes;
+    pb_LastFrameBytes=pb_FrameBytes;
+    pb_LastFrameStall=pb_FrameStall;
+    pb_LastShadowSaved=pb_ShadowSaved;
+    pb_FrameBytes=0;
+    pb_FrameStall=0;
+    pb_ShadowSaved=0;
+
+    if (pb_CaptureFile)
+    {
+        pb_capture(PB_CAPTURE_FRAME,&pb_CaptureFrame,1,NULL,0);
+        pb_CaptureFrame++;
+    }
 
-uint32_t *pb_begin(void)
+    if (pb_MemReady)
+    {
+        //memory freed during last frame can be reused once GPU has executed that frame
+        RtlEnterCriticalSection(&pb_MemLock);
+        if (pb_MemFenceNeeded)
+        {
+            pb_fence_insert();
+            pb_MemFenceNeeded=0;
+        }
+        pb_pool_collect(&pb_Mem,pb_fence_current());
+        RtlLeaveCriticalSection(&pb_MemLock);
+    }
+
+    pb_marker_frame();
+
+    if (pb_RingMode==0)
+    {
+        pb_jump_to_head();
+        pb_SafeWrapped=0;
+    }
+}
+
+void pb_ring_mode(int enable)
+{
+#ifdef DBG
+    if (pb_BeginEndPair) debugPrint("pb_ring_mode musn't be called inside a begin-end block.\n");
+#endif
+    pb_RingMode=enable;
+}
+
+void pb_safe_wrap(int enable)
+{
+    pb_SafeWrap=enable;
+}
+
+void pb_shadow_state(int enable)
+{
+    DWORD       i,m;
+
+    memset(pb_ShadowValid,0,sizeof(pb_ShadowValid));
+    memset(pb_ShadowVolatile,0,sizeof(pb_ShadowVolatile));
+    for(i=0;i<sizeof(pb_VolatileRanges)/sizeof(pb_VolatileRanges[0]);i++)
+    for(m=pb_VolatileRanges[i][0]>>2;m<=pb_VolatileRanges[i][1]>>2;m++)
+        pb_ShadowVolatile[m>>5]|=1<<(m&31);
+
+    pb_ShadowEnabled=enable;
+}
+
+int pb_list_create(pb_list_t *list, DWORD size)
+{
+    list->start=MmAllocateContiguousMemoryEx(size+PB_LIST_MARGIN*4,0,MAXRAM,0,0x404);
+        //NumberOfBytes,LowestAcceptableAddress,HighestAcceptableAddress,Alignment OPTIONAL,ProtectionType
+    if (list->start==NULL) return -1;
+
+    list->put=list->start;
+    list->limit=list->start+size/4;
+    list->overflow=0;
+    list->vs_changed=0;
+    return 0;
+}
+
+void pb_list_destroy(pb_list_t *list)
+{
+    if (list->start) MmFreeContiguousMemory(list->start);
+    list->start=NULL;
+    list->put=NULL;
+    list->limit=NULL;
+}
+
+void pb_list_begin(pb_list_t *list)
+{
+    if (pb_Recording) debugPrint("pb_list_begin: already recording a display list\n");
+#ifdef DBG
+    if (pb_BeginEndPair) debugPrint("pb_list_begin musn't be called inside a begin-end block.\n");
+#endif
+    list->put=list->start;
+    list->overflow=0;
+    list->vs_changed=0;
+    pb_Recording=list;
+}
+
+int pb_list_end(void)
+{
+    DWORD       addr;
+    pb_list_t   *list;
+
+#ifdef DBG
+    if (pb_BeginEndPair) debugPrint("pb_list_end musn't be called inside a begin-end block.\n");
+#endif
+    if (pb_Recording==NULL)
+    {
+        debugPrint("pb_list_end without a pb_list_begin\n");
+        return -1;
+    }
+
+    list=pb_Recording;
+    pb_Recording=NULL;
+
+    if (list->overflow)
+    {
+        debugPrint("ERROR! Display list overflow! Enlarge display list!\n");
+        return -1;
+    }
+
+    *(list->put++)=PB_RETURN;
+
+    if (pb_CaptureFile)
+    {
+        addr=((DWORD)list->start)&0x0FFFFFFF;
+        pb_capture(PB_CAPTURE_LIST,&addr,1,list->start,list->put-list->start);
+    }
+
+    return 0;
+}
+
+void pb_coalesce_writes(int enable)
+{
+    pb_CoalesceEnabled=enable;
+    pb_Packet.head=NULL;
+}
+
+void pb_shadow_invalidate(void)
+{
+    memset(pb_ShadowValid,0,sizeof(pb_ShadowValid));
+}
+
+void pb_get_stats(pb_stats_t *stats)
+{
+    ULONGLONG       freq;
+
+    freq=KeQueryPerformanceFrequency();
+
+    stats->frame_bytes=pb_LastFrameBytes;
+    stats->frame_stall_us=(DWORD)(pb_LastFrameStall*1000000/freq);
+    stats->wraps=pb_Wraps;
+    stats->frame_shadow_saved=pb_LastShadowSaved;
+    stats->peak_frame_bytes=pb_PeakFrameBytes;
+    stats->high_water_bytes=pb_HighWater;
+    stats->largest_block_bytes=pb_LargestBlock;
+    stats->size=pb_Size;
+    stats->safe_wraps=pb_SafeWraps;
+}
+
+
+uint32_t *pb_begin(void)
 {
+    uint32_t    *p;
+
+    if (pb_Recording)
+    {
+        p=pb_Recording->put;
+        if (p>=pb_Recording->limit)
+        {
+            //list is full: block is written over the margin (room for 1 block) and
+            //dropped, list is refused by pb_list_end and pb_push_call
+            pb_Recording->overflow=1;
+            p=pb_Recording->limit;
+        }
+    }
+    else
+    {
+        if (pb_RingMode) pb_ring_reserve();
+        else
+        if ((pb_SafeWrap)&&((pb_Put>=pb_Tail)||(pb_SafeWrapped)))
+        {
+            //frame doesn't fit in push buffer: behave like ring mode until next pb_reset
+            if (pb_Put>=pb_Tail)
+            {
+                pb_SafeWrapped=1;
+                pb_SafeWraps++;
+            }
+            pb_ring_reserve();
+        }
+        p=pb_Put;
 #ifdef DBG
-    if (pb_Put>=pb_Tail) debugPrint("ERROR! Push buffer overflow! Use pb_reset more often or enlarge push buffer!\n");
+        if (pb_Put>=pb_Tail) debugPrint("ERROR! Push buffer overflow! Use pb_reset more often, enlarge push buffer or use pb_safe_wrap!\n");
+#endif
+    }
 
+    pb_Packet.head=NULL;
+
+#ifdef DBG
     if (pb_BeginEndPair==1) debugPrint("pb_begin without a pb_end earlier\n");
     pb_BeginEndPair=1;
     pb_PushIndex=0;
-    pb_PushNext=pb_Put;
-    pb_PushStart=pb_Put;
+    pb_PushNext=p;
+    pb_PushStart=p;
 #endif
-    return pb_Put;
+    return p;
+}
+
+static void pb_capture_write(const void *data, DWORD n)
+{
+    DWORD       k;
+    const BYTE  *src=data;
+
+    while(n)
+    {
+        if (pb_CaptureUsed==PB_CAPTURE_BUFFER_SIZE)
+        {
+            fwrite(pb_CaptureBuffer,4,pb_CaptureUsed,pb_CaptureFile);
+            pb_CaptureUsed=0;
+        }
+        k=PB_CAPTURE_BUFFER_SIZE-pb_CaptureUsed;
+        if (k>n) k=n;
+        memcpy(&pb_CaptureBuffer[pb_CaptureUsed],src,k*4);
+        pb_CaptureUsed+=k;
+        src+=k*4;
+        n-=k;
+    }
+}
+
+//writes a record made of tag, size, then nhead words from head and n words from data
+static void pb_capture(DWORD tag, const DWORD *head, DWORD nhead, const void *data, DWORD n)
+{
+    DWORD       h[2];
+
+    RtlEnterCriticalSection(&pb_CaptureLock);
+    if (pb_CaptureFile)
+    {
+        h[0]=tag;
+        h[1]=nhead+n;
+        pb_capture_write(h,2);
+        pb_capture_write(head,nhead);
+        pb_capture_write(data,n);
+    }
+    RtlLeaveCriticalSection(&pb_CaptureLock);
+}
+
+int pb_start_capture(const char *filename)
+{
+    DWORD       h[2]={PB_CAPTURE_MAGIC,PB_CAPTURE_VERSION};
+
+    if (!pb_CaptureLockReady)
+    {
+        RtlInitializeCriticalSection(&pb_CaptureLock);
+        pb_CaptureLockReady=1;
+    }
+
+    pb_stop_capture();
+
+    RtlEnterCriticalSection(&pb_CaptureLock);
+    pb_CaptureFile=fopen(filename,"wb");
+    if (pb_CaptureFile)
+    {
+        pb_CaptureUsed=0;
+        pb_CaptureFrame=0;
+        pb_capture_write(h,2);
+    }
+    RtlLeaveCriticalSection(&pb_CaptureLock);
+
+    return (pb_CaptureFile)?0:-1;
+}
+
+void pb_stop_capture(void)
+{
+    if (!pb_CaptureLockReady) return;
+
+    RtlEnterCriticalSection(&pb_CaptureLock);
+    if (pb_CaptureFile)
+    {
+        fwrite(pb_CaptureBuffer,4,pb_CaptureUsed,pb_CaptureFile);
+        fclose(pb_CaptureFile);
+        pb_CaptureFile=NULL;
+    }
+    RtlLeaveCriticalSection(&pb_CaptureLock);
 }
 
 #ifdef LOG
@@ -2139,6 +3028,7 @@ void pb_end(uint32_t *pEnd)
 {
     DWORD           TimeStamp1;
     DWORD           TimeStamp2;
+    DWORD           bytes;
     
     int         i;
 
@@ -2174,7 +3064,23 @@ void pb_end(uint32_t *pEnd)
     pb_BeginEndPair=0;
 #endif
 
+    if (pb_Recording)
+    {
+        //block stays in display list, GPU will read it when list is called
+        pb_Recording->put=pEnd;
+        pb_Packet.head=NULL;
+        return;
+    }
+
+    if (pb_CaptureFile) pb_capture(PB_CAPTURE_BLOCK,NULL,0,pb_Put,pEnd-pb_Put);
+
+    bytes=(DWORD)pEnd-(DWORD)pb_Put;
+    pb_FrameBytes+=bytes;
+    if (bytes>pb_LargestBlock) pb_LargestBlock=bytes;
+    bytes=(DWORD)pEnd-(DWORD)pb_Head;
+    if (bytes>pb_HighWater) pb_HighWater=bytes;
     pb_Put=pEnd;
+    pb_Packet.head=NULL; //GPU may read it from now on
     
     pb_start(); //start (or continue) reading and sending data to GPU
 
@@ -2200,276 +3106,1351 @@ void pb_end(uint32_t *pEnd)
 }
 
 
-void pb_push_to(DWORD subchannel, uint32_t *p, DWORD command, DWORD nparam)
+//writes a method header at p, or grows previous packet if command follows its last
+//register (coalescing enabled). Returns where parameters have to be written.
+static uint32_t *pb_push_header(DWORD subchannel, uint32_t *p, DWORD command, DWORD nparam)
+{
+    if (pb_packet_append(&pb_Packet,p,subchannel,command,nparam))
+    {
+#ifdef DBG
+        if (p!=pb_PushNext)
+        {
+            debugPrint("pb_push_to: new write address invalid or not following previous write addresses\n");
+            assert(false);
+        }
+        pb_PushIndex += nparam;
+        pb_PushNext += nparam;
+        if (pb_PushIndex>128)
+        {
+            debugPrint("pb_push_to: begin-end block musn't exceed 128 dwords\n");
+            assert(false);
+        }
+#endif
+        return p;
+    }
+
+#ifdef DBG
+    if (p!=pb_PushNext)
+    {
+        debugPrint("pb_push_to: new write address invalid or not following previous write addresses\n");
+        assert(false);
+    }
+    if (pb_BeginEndPair==0)
+    {
+        debugPrint("pb_push_to: missing pb_begin earlier\n");
+        assert(false);
+    }
+    pb_PushIndex += 1 + nparam;
+    pb_PushNext += 1 + nparam;
+    if (pb_PushIndex>128)
+    {
+        debugPrint("pb_push_to: begin-end block musn't exceed 128 dwords\n");
+        assert(false);
+    }
+#endif
+
+    return pb_packet_start(&pb_Packet,pb_CoalesceEnabled,p,subchannel,command,nparam);
+}
+
+void pb_push_to(DWORD subchannel, uint32_t *p, DWORD command, DWORD nparam)
+{
+    //parameters will be written by caller, shadow state can't know them
+    if (pb_ShadowEnabled) pb_shadow_forget(subchannel,command,nparam);
+
+    //caller expects header at p, so never grow previous packet here
+    pb_Packet.head=NULL;
+    pb_push_header(subchannel,p,command,nparam);
+}
+
+uint32_t *pb_push1_to(DWORD subchannel, uint32_t *p, DWORD command, DWORD param1)
+{
+    if (pb_ShadowEnabled&&pb_shadow_filter(subchannel,command,1,&param1)) return p;
+
+    p=pb_push_header(subchannel,p,command,1);
+    *(p+0)=param1;
+    return p+1;
+}
+
+uint32_t *pb_push2_to(DWORD subchannel, uint32_t *p, DWORD command, DWORD param1, DWORD param2)
+{
+    if (pb_ShadowEnabled)
+    {
+        DWORD v[2]={param1,param2};
+        if (pb_shadow_filter(subchannel,command,2,v)) return p;
+    }
+
+    p=pb_push_header(subchannel,p,command,2);
+    *(p+0)=param1;
+    *(p+1)=param2;
+    return p+2;
+}
+
+uint32_t *pb_push3_to(DWORD subchannel, uint32_t *p, DWORD command, DWORD param1, DWORD param2, DWORD param3)
+{
+    if (pb_ShadowEnabled)
+    {
+        DWORD v[3]={param1,param2,param3};
+        if (pb_shadow_filter(subchannel,command,3,v)) return p;
+    }
+
+    p=pb_push_header(subchannel,p,command,3);
+    *(p+0)=param1;
+    *(p+1)=param2;
+    *(p+2)=param3;
+    return p+3;
+}
+
+uint32_t *pb_push4_to(DWORD subchannel, uint32_t *p, DWORD command, DWORD param1, DWORD param2, DWORD param3, DWORD param4)
+{
+    if (pb_ShadowEnabled)
+    {
+        DWORD v[4]={param1,param2,param3,param4};
+        if (pb_shadow_filter(subchannel,command,4,v)) return p;
+    }
+
+    p=pb_push_header(subchannel,p,command,4);
+    *(p+0)=param1;
+    *(p+1)=param2;
+    *(p+2)=param3;
+    *(p+3)=param4;
+    return p+4;
+}
+
+uint32_t *pb_push4f_to(DWORD subchannel, uint32_t *p, DWORD command, float param1, float param2, float param3, float param4)
+{
+    if (pb_ShadowEnabled)
+    {
+        float f[4]={param1,param2,param3,param4};
+        DWORD v[4];
+        memcpy(v,f,sizeof(v));
+        if (pb_shadow_filter(subchannel,command,4,v)) return p;
+    }
+
+    p=pb_push_header(subchannel,p,command,4);
+    *((float *)(p+0))=param1;
+    *((float *)(p+1))=param2;
+    *((float *)(p+2))=param3;
+    *((float *)(p+3))=param4;
+    return p+4;
+}
+
+uint32_t *pb_push_call(uint32_t *p, pb_list_t *list)
+{
+    if (pb_Recording)
+    {
+        debugPrint("pb_push_call: display lists can't call other display lists\n");
+        return p;
+    }
+
+    if (list->overflow)
+    {
+        debugPrint("pb_push_call: display list overflowed while recorded\n");
+        return p;
+    }
+
+#ifdef DBG
+    if (p!=pb_PushNext)
+    {
+        debugPrint("pb_push_call: new write address invalid or not following previous write addresses\n");
+        assert(false);
+    }
+    if (list->put==list->start)
+    {
+        debugPrint("pb_push_call: display list hasn't been recorded\n");
+        assert(false);
+    }
+    pb_PushIndex++;
+    pb_PushNext++;
+#endif
+
+    //GPU jumps to list and comes back here when it reads the return at its end
+    *(p++)=(((DWORD)list->start)&0x0FFFFFFF)|2;
+
+    pb_Packet.head=NULL;
+    if (pb_ShadowEnabled) pb_shadow_invalidate(); //list may have changed any register
+    if (list->vs_changed) pb_vs_forget(list->vs_changed);
+
+    return p;
+}
+
+void pb_push(uint32_t *p, DWORD command, DWORD nparam)
+{
+    pb_push_to(SUBCH_3D,p,command,nparam);
+}
+
+uint32_t *pb_push1(uint32_t *p, DWORD command, DWORD param1)
+{
+    return pb_push1_to(SUBCH_3D,p,command,param1);
+}
+
+uint32_t *pb_push2(uint32_t *p, DWORD command, DWORD param1, DWORD param2)
+{
+    return pb_push2_to(SUBCH_3D,p,command,param1,param2);
+}
+
+uint32_t *pb_push3(uint32_t *p, DWORD command, DWORD param1, DWORD param2, DWORD param3)
+{
+    return pb_push3_to(SUBCH_3D,p,command,param1,param2,param3);
+}
+
+uint32_t *pb_push4(uint32_t *p, DWORD command, DWORD param1, DWORD param2, DWORD param3, DWORD param4)
+{
+    return pb_push4_to(SUBCH_3D,p,command,param1,param2,param3,param4);
+}
+
+uint32_t *pb_push4f(uint32_t *p, DWORD command, float param1, float param2, float param3, float param4)
+{
+    return pb_push4f_to(SUBCH_3D,p,command,param1,param2,param3,param4);
+}
+
+uint32_t *pb_push_transposed_matrix(uint32_t *p, DWORD command, float *m)
+{
+    pb_push_to(SUBCH_3D,p++,command,16);
+
+    *((float *)p++)=m[_11];
+    *((float *)p++)=m[_21];
+    *((float *)p++)=m[_31];
+    *((float *)p++)=m[_41];
+
+    *((float *)p++)=m[_12];
+    *((float *)p++)=m[_22];
+    *((float *)p++)=m[_32];
+    *((float *)p++)=m[_42];
+
+    *((float *)p++)=m[_13];
+    *((float *)p++)=m[_23];
+    *((float *)p++)=m[_33];
+    *((float *)p++)=m[_43];
+
+    *((float *)p++)=m[_14];
+    *((float *)p++)=m[_24];
+    *((float *)p++)=m[_34];
+    *((float *)p++)=m[_44];
+
+    return p;
+}
+
+void pb_draw_indexed(DWORD primitive, const uint16_t *indices, DWORD count)
+{
+    //One begin-end pair for whole draw, spread over as many blocks as needed.
+    //Each block is filled with one non-incrementing ARRAY_ELEMENT16 packet
+    //(2 indices per dword), odd last index is sent with ARRAY_ELEMENT32.
+
+    uint32_t        *p;
+    DWORD           used,n,pairs;
+
+    if (count==0) return;
+
+    pb_vs_const_flush();
+
+    p=pb_begin();
+    p=pb_push1(p,NV097_SET_BEGIN_END,primitive);
+    used=2;
+
+    pairs=pb_packed_indices16_size(count);
+    while(pairs)
+    {
+        if (used+2>PB_BLOCK_SIZE)
+        {
+            pb_end(p);
+            p=pb_begin();
+            used=0;
+        }
+
+        n=PB_BLOCK_SIZE-used-1;
+        if (n>pairs) n=pairs;
+
+        pb_push_to(SUBCH_3D,p++,0x40000000|NV097_ARRAY_ELEMENT16,n);
+        p=pb_pack_indices16(p,indices,n*2);
+
+        indices+=n*2;
+        pairs-=n;
+        used+=1+n;
+    }
+
+    if (used+4>PB_BLOCK_SIZE)
+    {
+        pb_end(p);
+        p=pb_begin();
+    }
+    if (count&1) p=pb_push1(p,NV097_ARRAY_ELEMENT32,indices[0]);
+    p=pb_push1(p,NV097_SET_BEGIN_END,NV097_SET_BEGIN_END_OP_END);
+    pb_end(p);
+}
+
+
+
+void pb_show_front_screen(void)
+{
+    VIDEOREG(PCRTC_START)=pb_FBAddr[pb_front_index]&0x03FFFFFF;
+    pb_debug_screen_active=0;
+}
+
+void pb_show_debug_screen(void)
+{
+    VIDEOREG(PCRTC_START)=((DWORD)XVideoGetFB())&0x0FFFFFFF;
+    pb_debug_screen_active=1;
+}
+
+void pb_show_depth_screen(void)
+{
+    VIDEOREG(PCRTC_START)=pb_DSAddr&0x0FFFFFFF;
+    pb_debug_screen_active=1;
+}
+
+
+
+
+
+
+
+void pb_set_viewport(int dwx,int dwy,int width,int height,float zmin,float zmax)
+{
+    uint32_t        *p;
+    DWORD           dwzminscaled;
+    DWORD           dwzmaxscaled;
+    float           x,y,w,h;
+
+    if (dwx<0) dwx=0;
+    if (dwy<0) dwy=0;
+    if (dwx+width>pb_FrameBuffersWidth) width=pb_FrameBuffersWidth-dwx;
+    if (dwy+height>pb_FrameBuffersHeight) height=pb_FrameBuffersHeight-dwy;
+
+    pb_Viewport_x=dwx;
+    pb_Viewport_y=dwy;
+    pb_Viewport_width=width;
+    pb_Viewport_height=height;
+    pb_Viewport_zmin=zmin;
+    pb_Viewport_zmax=zmax;
+
+    x=0.53125f+(float)dwx;
+    y=0.53125f+(float)dwy;
+    w=0.5f*((float)pb_Viewport_width);
+    h=-0.5f*((float)pb_Viewport_height);
+    *((float *)&dwzminscaled)=zmin*pb_ZScale;
+    *((float *)&dwzmaxscaled)=zmax*pb_ZScale;
+/*
+    p=pb_begin();
+    p=pb_push4f(p,NV20_TCL_PRIMITIVE_3D_VIEWPORT_OX,x+0.53125f,y+0.53125f,0.0f,0.0f);
+    p=pb_push2(p,NV20_TCL_PRIMITIVE_3D_DEPTH_RANGE_NEAR,dwzminscaled,dwzmaxscaled);
+    pb_end(p);
+*/
+    p=pb_begin();
+    p=pb_push4f(p,NV20_TCL_PRIMITIVE_3D_VIEWPORT_OX,x+w,y-h,zmin*pb_ZScale,0.0f);
+    p=pb_push4f(p,NV20_TCL_PRIMITIVE_3D_VIEWPORT_PX_DIV2,w,h,(zmax-zmin)*pb_ZScale,0.0f);
+    p=pb_push2(p,NV20_TCL_PRIMITIVE_3D_DEPTH_RANGE_NEAR,dwzminscaled,dwzmaxscaled);
+    pb_end(p);
+}
+
+
+
+//converts an A8R8G8B8 color into current color surface format
+static DWORD pb_surface_color(DWORD color)
+{
+    switch(pb_ColorFmt) {
+    case NV097_SET_SURFACE_FORMAT_COLOR_LE_X1R5G5B5_Z1R5G5B5:
+    case NV097_SET_SURFACE_FORMAT_COLOR_LE_X1R5G5B5_O1R5G5B5:
+        color=((color>>16)&0x8000)|((color>>7)&0x7C00)|((color>>5)&0x03E0)|((color>>3)&0x001F);
+        break;
+    case NV097_SET_SURFACE_FORMAT_COLOR_LE_R5G6B5:
+        color=((color>>8)&0xF800)|((color>>5)&0x07E0)|((color>>3)&0x001F);
+        break;
+    case NV097_SET_SURFACE_FORMAT_COLOR_LE_A8R8G8B8:
+        // Nothing to do, input is A8R8G8B8
+        break;
+    default:
+        assert(false);
+        break;
+    }
+    return color;
+}
+
+void pb_clear(const pb_rect_t *rects, int n, DWORD flags, DWORD color, float depth, DWORD stencil)
+{
+    uint32_t    *p;
+    pb_rect_t   all;
+    int     i,k;
+
+    if (rects==NULL)
+    {
+        all.x=0;
+        all.y=0;
+        all.w=pb_SurfaceWidth;
+        all.h=pb_SurfaceHeight;
+        rects=&all;
+        n=1;
+    }
+
+    p=pb_begin();
+    pb_push(p++,NV097_SET_ZSTENCIL_CLEAR_VALUE,2);  //sets data used to fill in rectangles
+    *(p++)=(((DWORD)(depth*pb_ZScale))<<8)|(stencil&0xFF);  //(depth<<8)|stencil
+    *(p++)=pb_surface_color(color);
+
+    //Rectangle coordinates and trigger share one packet: the trigger fires on the previous rectangle
+    for(i=0,k=0;i<n;i++)
+    {
+        if (k==0)
+            pb_push(p++,NV097_SET_CLEAR_RECT_HORIZONTAL,2);
+        else
+        {
+            pb_push(p++,NV097_CLEAR_SURFACE,3);
+            *(p++)=flags;
+        }
+        *(p++)=((rects[i].x+rects[i].w-1)<<16)|rects[i].x;
+        *(p++)=((rects[i].y+rects[i].h-1)<<16)|rects[i].y;
+        if (++k==PB_CLEAR_BLOCK_RECTS)
+        {
+            p=pb_push1(p,NV097_CLEAR_SURFACE,flags);
+            pb_end(p);
+            p=pb_begin();
+            k=0;
+        }
+    }
+
+    if (k) p=pb_push1(p,NV097_CLEAR_SURFACE,flags);
+    pb_end(p);
+}
+
+void pb_fill(int x, int y, int w, int h, DWORD color)
+{
+    pb_rect_t   r;
+
+    r.x=x;
+    r.y=y;
+    r.w=w;
+    r.h=h;
+    pb_clear(&r,1,PB_CLEAR_COLOR,color,0.0f,0);
+}
+
+
+
+//ALWAYS use this at beginning of frame or you may lose one third of performance because
+//automatic compression algorithm for tile #1 can't afford any garbage left behind...
+//Also, try to draw from closest distance to farest distance to help algorithm
+//Depth is set to max and stencil is set to 0. We assume D24S8 format is used.
+//Implies that depth test function is set to "less or equal"
+void pb_erase_depth_stencil_buffer(int x, int y, int w, int h)
+{
+    pb_rect_t   r;
+
+    r.x=x;
+    r.y=y;
+    r.w=w;
+    r.h=h;
+    pb_clear(&r,1,PB_CLEAR_DEPTH|PB_CLEAR_STENCIL,0,1.0f,0);
+}
+
+
+
+
+//queues a memory to memory copy (size bytes, lines of PB_COPY_LINE bytes), returns where next one goes
+static uint32_t *pb_copy_op(uint32_t *p, DWORD dst, DWORD dst_pitch, DWORD src, DWORD src_pitch, DWORD line_bytes, DWORD lines)
+{
+    pb_push_to(SUBCH_2,p++,NV_MEMORY_TO_MEMORY_FORMAT_OFFSET_IN,8);
+    *(p++)=src;
+    *(p++)=dst;
+    *(p++)=src_pitch;
+    *(p++)=dst_pitch;
+    *(p++)=line_bytes;
+    *(p++)=lines;
+    *(p++)=0x101;       //format: 1 byte increments in & out
+    *(p++)=0;           //buffer notify: triggers the copy
+    return p;
+}
+
+DWORD pb_copy_lines(void *dst, DWORD dst_pitch, const void *src, DWORD src_pitch, DWORD line_bytes, DWORD lines)
+{
+    uint32_t    *p;
+    DWORD       d,s,n,k;
+
+    d=(DWORD)dst&0x03FFFFFF;
+    s=(DWORD)src&0x03FFFFFF;
+
+    p=pb_begin();
+    p=pb_push2_to(SUBCH_2,p,NV_MEMORY_TO_MEMORY_FORMAT_OBJECT_IN,PB_DMA_ALL,PB_DMA_ALL);
+    for(k=0;lines;k++)
+    {
+        if (k==PB_COPY_BLOCK_OPS)
+        {
+            pb_end(p);
+            p=pb_begin();
+            k=0;
+        }
+        n=(lines>PB_COPY_MAX_LINES)?PB_COPY_MAX_LINES:lines;
+        p=pb_copy_op(p,d,dst_pitch,s,src_pitch,line_bytes,n);
+        d+=n*dst_pitch;
+        s+=n*src_pitch;
+        lines-=n;
+    }
+    pb_end(p);
+
+    return pb_fence_insert();
+}
+
+//copies size bytes forward with as few operations as possible
+static void pb_copy_forward(DWORD d, DWORD s, DWORD size)
+{
+    uint32_t    *p;
+    DWORD       n;
+    int     k;
+
+    p=pb_begin();
+    p=pb_push2_to(SUBCH_2,p,NV_MEMORY_TO_MEMORY_FORMAT_OBJECT_IN,PB_DMA_ALL,PB_DMA_ALL);
+    for(k=0;size;k++)
+    {
+        if (k==PB_COPY_BLOCK_OPS)
+        {
+            pb_end(p);
+            p=pb_begin();
+            k=0;
+        }
+        if (size>=PB_COPY_LINE)
+        {
+            n=size/PB_COPY_LINE;
+            if (n>PB_COPY_MAX_LINES) n=PB_COPY_MAX_LINES;
+            p=pb_copy_op(p,d,PB_COPY_LINE,s,PB_COPY_LINE,PB_COPY_LINE,n);
+            n*=PB_COPY_LINE;
+        }
+        else
+        {
+            n=size;
+            p=pb_copy_op(p,d,n,s,n,n,1); //leftover
+        }
+        d+=n;
+        s+=n;
+        size-=n;
+    }
+    pb_end(p);
+}
+
+DWORD pb_copy(void *dst, const void *src, DWORD size)
+{
+    DWORD       d,s,n,gap;
+
+    d=(DWORD)dst&0x03FFFFFF;
+    s=(DWORD)src&0x03FFFFFF;
+
+    if ((d<=s)||(d>=s+size))
+        pb_copy_forward(d,s,size); //forward copy never reads what it has already written
+    else
+    {
+        //destination overlaps end of source: copy chunks not bigger than the gap, last one first
+        gap=d-s;
+        if (gap<PB_COPY_LINE)
+        {
+            //too many chunks, let CPU do it once GPU is done with both ranges
+            pb_fence_wait(pb_fence_insert());
+            memmove(dst,src,size);
+            return pb_fence_insert();
+        }
+        while(size)
+        {
+            n=(size>gap)?gap:size;
+            size-=n;
+            pb_copy_forward(d+size,s+size,n);
+        }
+    }
+
+    return pb_fence_insert();
+}
+
+//2D engine surfaces: source and destination through Dma channel 3
+static uint32_t *pb_blit_surfaces(uint32_t *p, DWORD dst, DWORD dst_pitch, DWORD src, DWORD src_pitch, DWORD bytes_per_pixel)
+{
+    DWORD       format;
+
+    switch(bytes_per_pixel)
+    {
+        case 1: format=0x01; break; //Y8
+        case 2: format=0x04; break; //R5G6B5
+        default: format=0x0B; break;    //Y32
+    }
+
+    p=pb_push1_to(SUBCH_4,p,NV10_CONTEXT_SURFACES_2D_SET_DMA_IN_MEMORY1,PB_DMA_ALL);
+    pb_push_to(SUBCH_4,p++,NV10_CONTEXT_SURFACES_2D_FORMAT,4);
+    *(p++)=format;
+    *(p++)=(dst_pitch<<16)|(src_pitch&0xFFFF);
+    *(p++)=src;
+    *(p++)=dst;
+    return p;
+}
+
+DWORD pb_blit(void *dst, DWORD dst_pitch, int dx, int dy, const void *src, DWORD src_pitch, int sx, int sy, int w, int h, DWORD bytes_per_pixel)
+{
+    uint32_t    *p;
+    int     step,n,k;
+
+#ifdef DBG
+    if ((((DWORD)dst|(DWORD)src|dst_pitch|src_pitch)&63)||(dst_pitch>=0x10000)||(src_pitch>=0x10000))
+        debugPrint("pb_blit: surfaces addresses and pitches must be 64 bytes aligned (and pitches < 64Kb)\n");
+#endif
+
+    p=pb_begin();
+    p=pb_blit_surfaces(p,(DWORD)dst&0x03FFFFFF,dst_pitch,(DWORD)src&0x03FFFFFF,src_pitch,bytes_per_pixel);
+
+    if ((dst==src)&&(dst_pitch==src_pitch)&&(abs(dx-sx)<w)&&(abs(dy-sy)<h)&&((dy>sy)||((dy==sy)&&(dx>sx))))
+    {
+        //rectangles overlap and a forward copy would read pixels it has already written:
+        //blit bands that don't overlap their destination, last one first
+        if (dy>sy)
+        {
+            step=dy-sy;
+            for(n=h,k=0;n>0;n-=step,k++)
+            {
+                if (k==PB_BLIT_BLOCK_OPS) { pb_end(p); p=pb_begin(); k=0; }
+                if (step>n) step=n;
+                pb_push_to(SUBCH_3,p++,NV_IMAGE_BLIT_POINT_IN,3);
+                *(p++)=((sy+n-step)<<16)|sx;
+                *(p++)=((dy+n-step)<<16)|dx;
+                *(p++)=(step<<16)|w;
+            }
+        }
+        else
+        {
+            step=dx-sx;
+            for(n=w,k=0;n>0;n-=step,k++)
+            {
+                if (k==PB_BLIT_BLOCK_OPS) { pb_end(p); p=pb_begin(); k=0; }
+                if (step>n) step=n;
+                pb_push_to(SUBCH_3,p++,NV_IMAGE_BLIT_POINT_IN,3);
+                *(p++)=(sy<<16)|(sx+n-step);
+                *(p++)=(dy<<16)|(dx+n-step);
+                *(p++)=(h<<16)|step;
+            }
+        }
+    }
+    else
+    {
+        pb_push_to(SUBCH_3,p++,NV_IMAGE_BLIT_POINT_IN,3);
+        *(p++)=(sy<<16)|sx;
+        *(p++)=(dy<<16)|dx;
+        *(p++)=(h<<16)|w;
+    }
+
+    //2D engine destination follows draw buffer again
+    p=pb_push1_to(SUBCH_4,p,NV10_CONTEXT_SURFACES_2D_SET_DMA_IN_MEMORY1,PB_DMA_DRAW);
+    pb_end(p);
+
+    return pb_fence_insert();
+}
+
+DWORD pb_fence_insert(void)
+{
+    uint32_t    *p;
+
+    //GPU writes the value into semaphore page once all previous commands are fully executed
+    p=pb_begin();
+    p=pb_push2(p,NV097_SET_SEMAPHORE_OFFSET,PB_FENCE_OFFSET,pb_fence_next(&pb_FenceLast)); //offset, then release value
+    pb_end(p);
+
+    return pb_FenceLast;
+}
+
+static DWORD pb_fence_current(void)
+{
+    return *(volatile DWORD *)((BYTE *)pb_DmaBuffer8+PB_FENCE_OFFSET);
+}
+
+int pb_fence_reached(DWORD fence)
+{
+    return pb_fence_passed(pb_fence_current(),fence);
+}
+
+void pb_fence_wait(DWORD fence)
+{
+    DWORD       TimeStampTicks;
+
+#ifdef DBG
+    if (!pb_fence_inserted(pb_FenceLast,fence)) debugPrint("pb_fence_wait: fence hasn't been inserted yet\n");
+#endif
+
+    TimeStampTicks=KeTickCount;
+
+    while(!pb_fence_reached(fence))
+    {
+        if (KeTickCount-TimeStampTicks>TICKSTIMEOUT)
+        {
+            debugPrint("pb_fence_wait: waited too long for fence %d\n",fence);
+            break;
+        }
+    }
+}
+
+static int pb_mem_add_arena(DWORD size, DWORD align)
+{
+    void        *base;
+
+    size=(size+align+PB_MEM_ARENA_SIZE-1)&~(PB_MEM_ARENA_SIZE-1);
+    base=MmAllocateContiguousMemoryEx(size,0,MAXRAM,(align>PB_POOL_PAGE)?align:0,0x404); //write-combined
+    if (base==NULL) return -1;
+
+    if (pb_pool_add_arena(&pb_Mem,(uintptr_t)base,size))
+    {
+        MmFreeContiguousMemory(base);
+        return -1;
+    }
+    return 0;
+}
+
+void *pb_mem_alloc(DWORD size, DWORD align)
+{
+    uintptr_t   addr;
+
+    if (!pb_MemReady)
+    {
+        debugPrint("pb_mem_alloc: call pb_init first\n");
+        return NULL;
+    }
+
+    RtlEnterCriticalSection(&pb_MemLock);
+
+    addr=pb_pool_alloc(&pb_Mem,size,align);
+
+    if ((addr==0)&&(pb_mem_add_arena(size,align)==0)) addr=pb_pool_alloc(&pb_Mem,size,align);
+
+    if ((addr==0)&&(pb_Mem.pending_count))
+    {
+        //freed blocks GPU is already done with
+        pb_pool_collect(&pb_Mem,pb_fence_current());
+        addr=pb_pool_alloc(&pb_Mem,size,align);
+    }
+
+    //a fence can only be inserted by render thread, and not while it records a display list
+    //(fence would go into list), other callers get NULL instead of waiting for GPU
+    if ((addr==0)&&(pb_Mem.pending_count)&&(KeGetCurrentThread()==pb_RenderThread)&&(pb_Recording==NULL))
+    {
+        //no more contiguous memory, wait until GPU is done with freed blocks
+        pb_fence_wait(pb_fence_insert());
+        pb_MemFenceNeeded=0;
+        pb_pool_collect(&pb_Mem,pb_fence_current());
+        addr=pb_pool_alloc(&pb_Mem,size,align);
+    }
+
+    RtlLeaveCriticalSection(&pb_MemLock);
+
+    if (addr==0) debugPrint("pb_mem_alloc: no contiguous memory left for %d bytes\n",size);
+    return (void *)addr;
+}
+
+void pb_mem_free(void *ptr)
+{
+    if (ptr==NULL) return;
+
+    if (!pb_MemReady)
+    {
+        debugPrint("pb_mem_free: pool is empty\n");
+        return;
+    }
+
+    RtlEnterCriticalSection(&pb_MemLock);
+    //GPU may still read it until next fence (inserted by pb_reset) has been reached
+    if (pb_pool_free(&pb_Mem,(uintptr_t)ptr,pb_FenceLast+1))
+        debugPrint("pb_mem_free: %08x wasn't allocated by pb_mem_alloc\n",(DWORD)ptr);
+    else
+        pb_MemFenceNeeded=1;
+    RtlLeaveCriticalSection(&pb_MemLock);
+}
+
+void pb_mem_get_stats(pb_pool_stats_t *stats)
+{
+    if (!pb_MemReady)
+    {
+        memset(stats,0,sizeof(pb_pool_stats_t));
+        return;
+    }
+
+    RtlEnterCriticalSection(&pb_MemLock);
+    pb_pool_get_stats(&pb_Mem,stats);
+    RtlLeaveCriticalSection(&pb_MemLock);
+}
+
+void *pb_texture_upload(const void *src, DWORD pitch, DWORD width, DWORD height, DWORD bytes_per_texel)
+{
+    void        *dst;
+
+    if ((width&(width-1))||(height&(height-1))||(width==0)||(height==0))
+    {
+        debugPrint("pb_texture_upload: swizzled texture dimensions must be powers of 2 (%dx%d)\n",width,height);
+        return NULL;
+    }
+    if ((bytes_per_texel!=1)&&(bytes_per_texel!=2)&&(bytes_per_texel!=4))
+    {
+        debugPrint("pb_texture_upload: unsupported texel size (%d bytes)\n",bytes_per_texel);
+        return NULL;
+    }
+
+    //texels are written only once, straight into write-combined memory
+    dst=pb_mem_alloc(width*height*bytes_per_texel,PB_MEM_ALIGN_TEXTURE);
+    if (dst) pb_swizzle(src,pitch,dst,width,height,bytes_per_texel);
+
+    return dst;
+}
+
+
+
+void pb_vs_program_init(pb_vs_program_t *prog, const DWORD *code, DWORD instructions)
+{
+    prog->code=code;
+    prog->size=instructions;
+    prog->slot=-1;
+    prog->last_use=0;
+}
+
+static void pb_vs_remove(int index)
+{
+    pb_vs_program_t *prog;
+
+    prog=pb_VsResident[index];
+    prog->slot=-1;
+    if (prog==pb_VsBound) pb_VsBound=NULL;
+
+    pb_VsResidentCount--;
+    memmove(&pb_VsResident[index],&pb_VsResident[index+1],(pb_VsResidentCount-index)*sizeof(pb_vs_program_t *));
+}
+
+static void pb_vs_evict(void)
+{
+    int         i,lru;
+
+    //least recently bound program leaves (GPU reads commands in order, so
+    //draws already sent keep using old program until new one is uploaded)
+    lru=0;
+    for(i=1;i<pb_VsResidentCount;i++)
+        if ((int)(pb_VsResident[i]->last_use-pb_VsResident[lru]->last_use)<0) lru=i;
+
+    pb_vs_remove(lru);
+}
+
+//returns index in pb_VsResident where a program of size instructions fits, -1 if none
+static int pb_vs_find_gap(DWORD size, int *slot)
+{
+    int         i,start;
+
+    start=0;
+    for(i=0;i<pb_VsResidentCount;i++)
+    {
+        if (pb_VsResident[i]->slot-start>=(int)size) break;
+        start=pb_VsResident[i]->slot+pb_VsResident[i]->size;
+    }
+    if ((i==pb_VsResidentCount)&&(PB_VS_SLOTS-start<(int)size)) return -1;
+
+    *slot=start;
+    return i;
+}
+
+static void pb_vs_upload(pb_vs_program_t *prog, int slot)
+{
+    uint32_t        *p;
+    DWORD           i,k,n;
+
+    //load cursor advances by itself, 3 packets of 8 instructions per block
+    i=0;
+    while(i<prog->size)
+    {
+        p=pb_begin();
+        if (i==0) p=pb_push1(p,NV097_SET_TRANSFORM_PROGRAM_LOAD,slot);
+        for(k=0;(k<3)&&(i<prog->size);k++)
+        {
+            n=prog->size-i;
+            if (n>PB_VS_PACKET) n=PB_VS_PACKET;
+            pb_push_to(SUBCH_3D,p++,NV097_SET_TRANSFORM_PROGRAM,n*4);
+            memcpy(p,&prog->code[i*4],n*16);
+            p+=n*4;
+            i+=n;
+        }
+        pb_end(p);
+    }
+}
+
+void pb_vs_bind(pb_vs_program_t *prog)
+{
+    uint32_t        *p;
+    int         index,slot;
+
+    if ((prog->size==0)||(prog->size>PB_VS_SLOTS))
+    {
+        debugPrint("pb_vs_bind: vertex program size invalid (%d instructions)\n",prog->size);
+        return;
+    }
+
+    if (pb_Recording)
+    {
+        //resident programs belong to render thread and may be evicted before list
+        //is called: list uploads program itself (at slot 0), pb_push_call then
+        //forgets resident programs
+        pb_vs_upload(prog,0);
+        p=pb_begin();
+        p=pb_push1(p,NV097_SET_TRANSFORM_PROGRAM_START,0);
+        pb_end(p);
+        pb_Recording->vs_changed|=PB_LIST_VS_PROGRAM;
+        return;
+    }
+
+    if (prog->slot<0)
+    {
+
+        if (pb_VsResidentCount==PB_VS_MAX_RESIDENT) pb_vs_evict();
+        while((index=pb_vs_find_gap(prog->size,&slot))<0) pb_vs_evict();
+
+        memmove(&pb_VsResident[index+1],&pb_VsResident[index],(pb_VsResidentCount-index)*sizeof(pb_vs_program_t *));
+        pb_VsResident[index]=prog;
+        pb_VsResidentCount++;
+        prog->slot=slot;
+
+        pb_vs_upload(prog,prog->slot);
+    }
+
+    prog->last_use=++pb_VsClock;
+
+    if (prog==pb_VsBound) return;
+
+    p=pb_begin();
+    p=pb_push1(p,NV097_SET_TRANSFORM_PROGRAM_START,prog->slot);
+    pb_end(p);
+    pb_VsBound=prog;
+}
+
+//sends count constants of v to constant slot start, in block p (begun by caller with
+//used dwords in it, or NULL), returns block where next dwords go (caller ends it)
+static uint32_t *pb_vs_const_push(uint32_t *p, DWORD *used, DWORD start, const float *v, DWORD count)
 {
-#ifdef DBG
-    if (p!=pb_PushNext)
+    DWORD           n;
+
+    //cursor, then packets of 8 constants (cursor advances by itself)
+    if ((p)&&(*used+2+1+4>PB_BLOCK_SIZE))
     {
-        debugPrint("pb_push_to: new write address invalid or not following previous write addresses\n");
-        assert(false);
+        pb_end(p);
+        p=NULL;
     }
-    if (pb_BeginEndPair==0)
+    if (p==NULL)
     {
-        debugPrint("pb_push_to: missing pb_begin earlier\n");
-        assert(false);
+        p=pb_begin();
+        *used=0;
     }
-    pb_PushIndex += 1 + nparam;
-    pb_PushNext += 1 + nparam;
-    if (pb_PushIndex>128)
+    p=pb_push1(p,NV097_SET_TRANSFORM_CONSTANT_LOAD,start);
+    *used+=2;
+
+    while(count)
     {
-        debugPrint("pb_push_to: begin-end block musn't exceed 128 dwords\n");
-        assert(false);
+        if (*used+1+4>PB_BLOCK_SIZE)
+        {
+            pb_end(p);
+            p=pb_begin();
+            *used=0;
+        }
+        n=count;
+        if (n>PB_VS_CONST_PACKET) n=PB_VS_CONST_PACKET;
+        if (n>(PB_BLOCK_SIZE-*used-1)/4) n=(PB_BLOCK_SIZE-*used-1)/4;
+
+        pb_push_to(SUBCH_3D,p++,NV097_SET_TRANSFORM_CONSTANT,n*4);
+        memcpy(p,v,n*16);
+        p+=n*4;
+        *used+=1+n*4;
+        v+=n*4;
+        count-=n;
     }
-#endif
 
-    *(p+0)=EncodeMethod(subchannel,command,nparam);
+    return p;
 }
 
-uint32_t *pb_push1_to(DWORD subchannel, uint32_t *p, DWORD command, DWORD param1)
+static void pb_vs_const_store(DWORD slot, const float *v)
 {
-    pb_push_to(subchannel,p,command,1);
-    *(p+1)=param1;
-    return p+2;
-}
+    DWORD       bit;
 
-uint32_t *pb_push2_to(DWORD subchannel, uint32_t *p, DWORD command, DWORD param1, DWORD param2)
-{
-    pb_push_to(subchannel,p,command,2);
-    *(p+1)=param1;
-    *(p+2)=param2;
-    return p+3;
-}
+    bit=1<<(slot&31);
+    if ((pb_VsConstValid[slot>>5]&bit)&&(memcmp(pb_VsConst[slot],v,16)==0)) return;
 
-uint32_t *pb_push3_to(DWORD subchannel, uint32_t *p, DWORD command, DWORD param1, DWORD param2, DWORD param3)
-{
-    pb_push_to(subchannel,p,command,3);
-    *(p+1)=param1;
-    *(p+2)=param2;
-    *(p+3)=param3;
-    return p+4;
+    memcpy(pb_VsConst[slot],v,16);
+    pb_VsConstValid[slot>>5]|=bit;
+    pb_VsConstDirty[slot>>5]|=bit;
+    pb_VsConstDirtyAny=1;
 }
 
-uint32_t *pb_push4_to(DWORD subchannel, uint32_t *p, DWORD command, DWORD param1, DWORD param2, DWORD param3, DWORD param4)
+void pb_vs_const_set(DWORD slot, const float *v, DWORD count)
 {
-    pb_push_to(subchannel,p,command,4);
-    *(p+1)=param1;
-    *(p+2)=param2;
-    *(p+3)=param3;
-    *(p+4)=param4;
-    return p+5;
-}
+    uint32_t        *p;
+    DWORD           used;
 
-uint32_t *pb_push4f_to(DWORD subchannel, uint32_t *p, DWORD command, float param1, float param2, float param3, float param4)
-{
-    pb_push_to(subchannel,p,command,4);
-    *((float *)(p+1))=param1;
-    *((float *)(p+2))=param2;
-    *((float *)(p+3))=param3;
-    *((float *)(p+4))=param4;
-    return p+5;
+    if (slot+count>PB_VS_CONSTANTS)
+    {
+        debugPrint("pb_vs_const_set: constants %d-%d out of range\n",slot,slot+count-1);
+        return;
+    }
+
+    if (pb_Recording)
+    {
+        //written straight into list, CPU copy and its dirty state are left alone
+        //(pb_push_call forgets CPU copy once list has been called)
+        p=pb_vs_const_push(NULL,&used,slot,v,count);
+        pb_end(p);
+        pb_Recording->vs_changed|=PB_LIST_VS_CONSTANTS;
+        return;
+    }
+
+    while(count--)
+    {
+        pb_vs_const_store(slot++,v);
+        v+=4;
+    }
 }
 
-void pb_push(uint32_t *p, DWORD command, DWORD nparam)
+void pb_vs_const_set_transposed_matrix(DWORD slot, const float *m)
 {
-    pb_push_to(SUBCH_3D,p,command,nparam);
+#ifdef __SSE__
+    float       t[4][4] __attribute__((aligned(16)));
+    __m128      r0,r1,r2,r3;
+#else
+    float       t[4][4];
+    int         i,j;
+#endif
+
+    if (slot+4>PB_VS_CONSTANTS)
+    {
+        debugPrint("pb_vs_const_set_transposed_matrix: constants %d-%d out of range\n",slot,slot+3);
+        return;
+    }
+
+#ifdef __SSE__
+    r0=_mm_loadu_ps(&m[_11]);
+    r1=_mm_loadu_ps(&m[_21]);
+    r2=_mm_loadu_ps(&m[_31]);
+    r3=_mm_loadu_ps(&m[_41]);
+    _MM_TRANSPOSE4_PS(r0,r1,r2,r3);
+    _mm_store_ps(t[0],r0);
+    _mm_store_ps(t[1],r1);
+    _mm_store_ps(t[2],r2);
+    _mm_store_ps(t[3],r3);
+#else
+    for(i=0;i<4;i++)
+        for(j=0;j<4;j++)
+            t[i][j]=m[j*4+i];
+#endif
+
+    pb_vs_const_set(slot,t[0],4);
 }
 
-uint32_t *pb_push1(uint32_t *p, DWORD command, DWORD param1)
+void pb_vs_const_flush(void)
 {
-    return pb_push1_to(SUBCH_3D,p,command,param1);
+    uint32_t        *p;
+    DWORD           used,start,end;
+
+    //CPU copy is render thread's, lists send constants as they are set
+    if ((pb_Recording)||(!pb_VsConstDirtyAny)) return;
+
+    //one load per run of dirty constants, runs share blocks
+    p=NULL;
+    used=0;
+    end=0;
+    while(end<PB_VS_CONSTANTS)
+    {
+        if ((pb_VsConstDirty[end>>5]&(1<<(end&31)))==0)
+        {
+            end++;
+            continue;
+        }
+        start=end;
+        while((end<PB_VS_CONSTANTS)&&(pb_VsConstDirty[end>>5]&(1<<(end&31)))) end++;
+
+        p=pb_vs_const_push(p,&used,start,pb_VsConst[start],end-start);
+    }
+    if (p) pb_end(p);
+
+    memset(pb_VsConstDirty,0,sizeof(pb_VsConstDirty));
+    pb_VsConstDirtyAny=0;
 }
 
-uint32_t *pb_push2(uint32_t *p, DWORD command, DWORD param1, DWORD param2)
+void pb_vs_const_invalidate(void)
 {
-    return pb_push2_to(SUBCH_3D,p,command,param1,param2);
+    memset(pb_VsConstValid,0,sizeof(pb_VsConstValid));
+    memset(pb_VsConstDirty,0,sizeof(pb_VsConstDirty));
+    pb_VsConstDirtyAny=0;
 }
 
-uint32_t *pb_push3(uint32_t *p, DWORD command, DWORD param1, DWORD param2, DWORD param3)
+void pb_vs_program_release(pb_vs_program_t *prog)
 {
-    return pb_push3_to(SUBCH_3D,p,command,param1,param2,param3);
+    int         i;
+
+    for(i=0;i<pb_VsResidentCount;i++)
+        if (pb_VsResident[i]==prog)
+        {
+            pb_vs_remove(i);
+            return;
+        }
 }
 
-uint32_t *pb_push4(uint32_t *p, DWORD command, DWORD param1, DWORD param2, DWORD param3, DWORD param4)
+
+
+//called by DPC, records when GPU reached a marker
+static void pb_marker_stamp(DWORD id)
 {
-    return pb_push4_to(SUBCH_3D,p,command,param1,param2,param3,param4);
+    pb_marker_frame_t   *f;
+    int         index;
+
+    if ((id>>24)>=PB_MARKER_FRAMES) return;
+
+    f=&pb_MarkerFrames[id>>24];
+    index=(id>>1)&0x7FFF;
+    if ((((id>>16)&0xFF)!=(f->frame&0xFF))||(index>=f->count)) return; //set reused since then
+
+    if (id&1)
+        f->markers[index].gpu_end=KeQueryPerformanceCounter();
+    else
+        f->markers[index].gpu_begin=KeQueryPerformanceCounter();
+    f->gpu_stamps++;
 }
 
-uint32_t *pb_push4f(uint32_t *p, DWORD command, float param1, float param2, float param3, float param4)
+static void pb_marker_push(int index, int end)
 {
-    return pb_push4f_to(SUBCH_3D,p,command,param1,param2,param3,param4);
+    uint32_t        *p;
+    DWORD           id;
+
+    id=(pb_MarkerCurrent<<24)|((pb_MarkerFrame&0xFF)<<16)|(index<<1)|end;
+
+    //GPU waits for idle, so timestamp tells when previous commands are really done
+    p=pb_begin();
+    p=pb_push1(p,NV20_TCL_PRIMITIVE_3D_ASK_FOR_IDLE,0);
+    p=pb_push1(p,NV20_TCL_PRIMITIVE_3D_NOP,0);
+    p=pb_push1(p,NV20_TCL_PRIMITIVE_3D_WAIT_MAKESPACE,0);
+    p=pb_push1(p,NV20_TCL_PRIMITIVE_3D_PARAMETER_A,id);
+    p=pb_push1(p,NV20_TCL_PRIMITIVE_3D_FIRE_INTERRUPT,PB_MARKER);
+    pb_end(p);
 }
 
-uint32_t *pb_push_transposed_matrix(uint32_t *p, DWORD command, float *m)
+void pb_marker_begin(const char *name)
 {
-    pb_push_to(SUBCH_3D,p++,command,16);
-
-    *((float *)p++)=m[_11];
-    *((float *)p++)=m[_21];
-    *((float *)p++)=m[_31];
-    *((float *)p++)=m[_41];
+    pb_marker_frame_t   *f;
+    pb_marker_t     *m;
 
-    *((float *)p++)=m[_12];
-    *((float *)p++)=m[_22];
-    *((float *)p++)=m[_32];
-    *((float *)p++)=m[_42];
+    if (pb_MarkerDepth==PB_MARKER_DEPTH)
+    {
+        debugPrint("pb_marker_begin: markers nested too deeply (%s)\n",name);
+        pb_MarkerOverflow++;
+        return;
+    }
 
-    *((float *)p++)=m[_13];
-    *((float *)p++)=m[_23];
-    *((float *)p++)=m[_33];
-    *((float *)p++)=m[_43];
+    f=&pb_MarkerFrames[pb_MarkerCurrent];
+    if (f->count==PB_MAX_MARKERS)
+    {
+        debugPrint("pb_marker_begin: too many markers in frame (%s)\n",name);
+        pb_MarkerStack[pb_MarkerDepth++]=-1;
+        return;
+    }
 
-    *((float *)p++)=m[_14];
-    *((float *)p++)=m[_24];
-    *((float *)p++)=m[_34];
-    *((float *)p++)=m[_44];
+    m=&f->markers[f->count];
+    m->name=name;
+    m->depth=pb_MarkerDepth;
+    m->gpu_begin=0;
+    m->gpu_end=0;
+    pb_MarkerStack[pb_MarkerDepth++]=f->count;
+    f->count++;
 
-    return p;
+    pb_marker_push(f->count-1,0);
+    m->cpu_begin=KeQueryPerformanceCounter();
 }
 
+void pb_marker_end(void)
+{
+    pb_marker_frame_t   *f;
+    int         index;
+
+    if (pb_MarkerOverflow)
+    {
+        pb_MarkerOverflow--;
+        return;
+    }
+    if (pb_MarkerDepth==0)
+    {
+        debugPrint("pb_marker_end without a pb_marker_begin\n");
+        return;
+    }
 
+    index=pb_MarkerStack[--pb_MarkerDepth];
+    if (index<0) return;
 
-void pb_show_front_screen(void)
-{
-    VIDEOREG(PCRTC_START)=pb_FBAddr[pb_front_index]&0x03FFFFFF;
-    pb_debug_screen_active=0;
+    f=&pb_MarkerFrames[pb_MarkerCurrent];
+    f->markers[index].cpu_end=KeQueryPerformanceCounter();
+    pb_marker_push(index,1);
 }
 
-void pb_show_debug_screen(void)
+static DWORD pb_marker_us(ULONGLONG t, ULONGLONG freq)
 {
-    VIDEOREG(PCRTC_START)=((DWORD)XVideoGetFB())&0x0FFFFFFF;
-    pb_debug_screen_active=1;
+    return (DWORD)((t*1000000)/freq);
 }
 
-void pb_show_depth_screen(void)
+static void pb_marker_resolve(pb_marker_frame_t *f)
 {
-    VIDEOREG(PCRTC_START)=pb_DSAddr&0x0FFFFFFF;
-    pb_debug_screen_active=1;
-}
+    ULONGLONG       freq;
+    pb_marker_t     *m;
+    int         i;
 
+    freq=KeQueryPerformanceFrequency();
 
+    for(i=0;i<f->count;i++)
+    {
+        m=&f->markers[i];
+        pb_MarkerResults[i].name=m->name;
+        pb_MarkerResults[i].depth=m->depth;
+        pb_MarkerResults[i].cpu_us=pb_marker_us(m->cpu_end-m->cpu_begin,freq);
+        pb_MarkerResults[i].gpu_us=pb_marker_us(m->gpu_end-m->gpu_begin,freq);
+    }
+    pb_MarkerResultCount=f->count;
 
+    if (pb_MarkerTrace)
+    {
+        //Chrome trace events, CPU on thread 0, GPU on thread 1 (times in microseconds)
+        for(i=0;i<f->count;i++)
+        {
+            m=&f->markers[i];
+            fprintf(pb_MarkerTrace,"%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":%lu,\"dur\":%lu}",
+                (pb_MarkerTraceEvents++)?",\n":"",m->name,
+                pb_marker_us(m->cpu_begin-pb_MarkerTraceStart,freq),pb_marker_us(m->cpu_end-m->cpu_begin,freq));
+            fprintf(pb_MarkerTrace,",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":1,\"ts\":%lu,\"dur\":%lu}",
+                m->name,
+                pb_marker_us(m->gpu_begin-pb_MarkerTraceStart,freq),pb_marker_us(m->gpu_end-m->gpu_begin,freq));
+        }
+    }
 
+    f->pending=0;
+}
 
+//at frame start: current markers wait for GPU, oldest frames GPU is done with are resolved
+static void pb_marker_frame(void)
+{
+    pb_marker_frame_t   *f;
+    int         i;
 
+    if (pb_MarkerDepth)
+    {
+        debugPrint("pb_marker_begin without a pb_marker_end at frame end\n");
+        pb_MarkerDepth=0;
+        pb_MarkerOverflow=0;
+    }
 
-void pb_set_viewport(int dwx,int dwy,int width,int height,float zmin,float zmax)
-{
-    uint32_t        *p;
-    DWORD           dwzminscaled;
-    DWORD           dwzmaxscaled;
-    float           x,y,w,h;
+    f=&pb_MarkerFrames[pb_MarkerCurrent];
+    if (f->count) f->pending=1;
 
-    if (dwx<0) dwx=0;
-    if (dwy<0) dwy=0;
-    if (dwx+width>pb_FrameBuffersWidth) width=pb_FrameBuffersWidth-dwx;
-    if (dwy+height>pb_FrameBuffersHeight) height=pb_FrameBuffersHeight-dwy;
+    for(i=1;i<=PB_MARKER_FRAMES;i++)
+    {
+        f=&pb_MarkerFrames[(pb_MarkerCurrent+i)%PB_MARKER_FRAMES];
+        if ((f->pending)&&(f->gpu_stamps==(DWORD)f->count*2)) pb_marker_resolve(f);
+    }
 
-    pb_Viewport_x=dwx;
-    pb_Viewport_y=dwy;
-    pb_Viewport_width=width;
-    pb_Viewport_height=height;
-    pb_Viewport_zmin=zmin;
-    pb_Viewport_zmax=zmax;
+    //next set (dropped if GPU still hasn't reached its markers)
+    pb_MarkerCurrent=(pb_MarkerCurrent+1)%PB_MARKER_FRAMES;
+    pb_MarkerFrame++;
 
-    x=0.53125f+(float)dwx;
-    y=0.53125f+(float)dwy;
-    w=0.5f*((float)pb_Viewport_width);
-    h=-0.5f*((float)pb_Viewport_height);
-    *((float *)&dwzminscaled)=zmin*pb_ZScale;
-    *((float *)&dwzmaxscaled)=zmax*pb_ZScale;
-/*
-    p=pb_begin();
-    p=pb_push4f(p,NV20_TCL_PRIMITIVE_3D_VIEWPORT_OX,x+0.53125f,y+0.53125f,0.0f,0.0f);
-    p=pb_push2(p,NV20_TCL_PRIMITIVE_3D_DEPTH_RANGE_NEAR,dwzminscaled,dwzmaxscaled);
-    pb_end(p);
-*/
-    p=pb_begin();
-    p=pb_push4f(p,NV20_TCL_PRIMITIVE_3D_VIEWPORT_OX,x+w,y-h,zmin*pb_ZScale,0.0f);
-    p=pb_push4f(p,NV20_TCL_PRIMITIVE_3D_VIEWPORT_PX_DIV2,w,h,(zmax-zmin)*pb_ZScale,0.0f);
-    p=pb_push2(p,NV20_TCL_PRIMITIVE_3D_DEPTH_RANGE_NEAR,dwzminscaled,dwzmaxscaled);
-    pb_end(p);
+    f=&pb_MarkerFrames[pb_MarkerCurrent];
+    f->count=0; //first, so late timestamps of old frame are ignored
+    f->pending=0;
+    f->frame=pb_MarkerFrame;
+    f->gpu_stamps=0;
 }
 
+int pb_marker_results(pb_marker_result_t *results, int max)
+{
+    int         n;
 
+    n=(pb_MarkerResultCount<max)?pb_MarkerResultCount:max;
+    memcpy(results,pb_MarkerResults,n*sizeof(pb_marker_result_t));
+    return n;
+}
 
-void pb_fill(int x, int y, int w, int h, DWORD color)
+void pb_marker_print(void)
 {
-    uint32_t    *p;
+    int         i;
 
-    int     x1,y1,x2,y2;
+    pb_print("%-24s %8s %8s\n","pass","gpu us","cpu us");
+    for(i=0;i<pb_MarkerResultCount;i++)
+        pb_print("%*s%-*s %8d %8d\n",
+            pb_MarkerResults[i].depth,"",24-pb_MarkerResults[i].depth,pb_MarkerResults[i].name,
+            pb_MarkerResults[i].gpu_us,pb_MarkerResults[i].cpu_us);
+}
 
-    x1=x;
-    y1=y;
-    x2=x+w;
-    y2=y+h;
+int pb_marker_trace_start(const char *filename)
+{
+    pb_marker_trace_stop();
 
-    switch(pb_ColorFmt) {
-    case NV097_SET_SURFACE_FORMAT_COLOR_LE_X1R5G5B5_Z1R5G5B5:
-    case NV097_SET_SURFACE_FORMAT_COLOR_LE_X1R5G5B5_O1R5G5B5:
-        color=((color>>16)&0x8000)|((color>>7)&0x7C00)|((color>>5)&0x03E0)|((color>>3)&0x001F);
-        break;
-    case NV097_SET_SURFACE_FORMAT_COLOR_LE_R5G6B5:
-        color=((color>>8)&0xF800)|((color>>5)&0x07E0)|((color>>3)&0x001F);
-        break;
-    case NV097_SET_SURFACE_FORMAT_COLOR_LE_A8R8G8B8:
-        // Nothing to do, input is A8R8G8B8
-        break;
-    default:
-        assert(false);
-        break;
-    }
+    pb_MarkerTrace=fopen(filename,"w");
+    if (pb_MarkerTrace==NULL) return -1;
 
-    p=pb_begin();
-    pb_push(p++,NV20_TCL_PRIMITIVE_3D_CLEAR_VALUE_HORIZ,2);     //sets rectangle coordinates
-    *(p++)=((x2-1)<<16)|x1;
-    *(p++)=((y2-1)<<16)|y1;
-    pb_push(p++,NV20_TCL_PRIMITIVE_3D_CLEAR_VALUE_DEPTH,3);     //sets data used to fill in rectangle
-    *(p++)=0;           //(depth<<8)|stencil
-    *(p++)=color;           //color
-    *(p++)=0xF0;            //triggers the HW rectangle fill (0x03 for D&S)
-    pb_end(p);
+    fprintf(pb_MarkerTrace,"{\"traceEvents\":[\n");
+    pb_MarkerTraceStart=KeQueryPerformanceCounter();
+    pb_MarkerTraceEvents=0;
+    return 0;
 }
 
+void pb_marker_trace_stop(void)
+{
+    if (pb_MarkerTrace==NULL) return;
+
+    fprintf(pb_MarkerTrace,"\n]}\n");
+    fclose(pb_MarkerTrace);
+    pb_MarkerTrace=NULL;
+}
 
 
 
 
-//ALWAYS use this at beginning of frame or you may lose one third of performance because
-//automatic compression algorithm for tile #1 can't afford any garbage left behind...
-//Also, try to draw from closest distance to farest distance to help algorithm
-//Depth is set to max and stencil is set to 0. We assume D24S8 format is used.
-//Implies that depth test function is set to "less or equal"
-void pb_erase_depth_stencil_buffer(int x, int y, int w, int h)
+//returns 1 if next back buffer may still be on screen or queued to show up
+static int pb_present_full(void)
 {
-    uint32_t    *p;
+    //front buffer + queued frames + frame being drawn must fit in frame buffers
+    //(next back buffer is only free once all but one of the older frames have been flipped)
+    return (pb_Presented-pb_Flipped>=pb_BackBuffersCount-1);
+}
 
-    int     x1,y1,x2,y2;
+void pb_present_mode(int mode)
+{
+    pb_PresentMode=mode;
+}
 
-    x1=x;
-    y1=y;
-    x2=x+w;
-    y2=y+h;
-    
-    p=pb_begin();
-    pb_push(p++,NV20_TCL_PRIMITIVE_3D_CLEAR_VALUE_HORIZ,2);     //sets rectangle coordinates
-    *(p++)=((x2-1)<<16)|x1;
-    *(p++)=((y2-1)<<16)|y1;
-    pb_push(p++,NV20_TCL_PRIMITIVE_3D_CLEAR_VALUE_DEPTH,3);     //sets data used to fill in rectangle
-    *(p++)=0xffffff00;      //(depth<<8)|stencil
-    *(p++)=0;           //color
-    *(p++)=0x03;            //triggers the HW rectangle fill (only on D&S)
-    pb_end(p);
+void pb_get_present_stats(pb_present_stats_t *stats)
+{
+    ULONGLONG       freq;
+    DWORD           flipped;
+
+    freq=KeQueryPerformanceFrequency();
+    flipped=pb_Flipped;
+
+    stats->presented=pb_Presented;
+    stats->flipped=flipped;
+    stats->queue_depth=pb_Presented-flipped;
+    stats->missed_vblanks=pb_MissedVBlanks;
+    stats->torn_flips=pb_TornFlips;
+    stats->timeouts=pb_PresentTimeouts;
+    stats->latency_us=(DWORD)(pb_LatencyLast*1000000/freq);
+    stats->latency_avg_us=flipped?(DWORD)(pb_LatencySum/flipped*1000000/freq):0;
+    stats->latency_max_us=(DWORD)(pb_LatencyMax*1000000/freq);
 }
 
+int pb_present(DWORD timeout_ms)
+{
+    DWORD           TimeStampTicks;
+
+    TimeStampTicks=KeTickCount;
 
+    while(pb_present_full())
+    {
+        if ((timeout_ms!=0xFFFFFFFF)&&(KeTickCount-TimeStampTicks>=timeout_ms))
+        {
+            pb_PresentTimeouts++;
+            return 1;
+        }
+        NtYieldExecution();
+    }
 
+    return pb_finished();
+}
 
 //returns 1 if we have to retry later (means no free buffer, draw more details next time)
 int pb_finished(void)
 {
     uint32_t        *p;
 
-    if (pb_BackBufferbReady[pb_BackBufferNxt]) return 1; //table is full, retry later
+    if (pb_present_full()) return 1; //all back buffers are in use, retry later
+
+    pb_PresentStamp[pb_Presented%pb_FrameBuffersCount]=KeQueryPerformanceCounter();
+    pb_Presented++;
 
     //insert in push buffer the commands to trigger screen swapping at next VBlank
     p=pb_begin();
@@ -2483,7 +4464,7 @@ int pb_finished(void)
 
     //insert in push buffer the commands to trigger selection of next back buffer
     //(because previous ones may not have finished yet, so need to use 0x0100 call)
-    pb_back_index=(pb_back_index+1)%3;
+    pb_back_index=(pb_back_index+1)%pb_FrameBuffersCount;
     pb_target_back_buffer();
     
     return 0;
@@ -2542,7 +4523,15 @@ void pb_kill(void)
 #endif
 
     //wait until screen swapping is finished (if one is on its way)
-    while(pb_BackBufferbReady[pb_BackBufferNxt]);
+    TimeStampTicks=KeTickCount;
+    while(pb_Presented!=pb_Flipped)
+    {
+        if (KeTickCount-TimeStampTicks>TICKSTIMEOUT)
+        {
+            debugPrint("pb_kill: last frame didn't show up\n");
+            break;
+        }
+    }
 
     pb_running=0;
 
@@ -2556,6 +4545,13 @@ void pb_kill(void)
 
     if (pb_Head) MmFreeContiguousMemory(pb_Head);
 
+    if (pb_MemReady)
+    {
+        for(i=0;i<pb_Mem.arena_count;i++) MmFreeContiguousMemory((PVOID)pb_Mem.arena_base[i]);
+        pb_pool_destroy(&pb_Mem);
+        pb_MemReady=0;
+    }
+
 
     //eventually restore a previously saved video mode
 
@@ -2738,7 +4734,7 @@ int pb_init(void)
     for(k=0;k<3;k++) for(i=0;i<3;i++) for(j=0;j<256;j++) pb_GammaRamp[k][i][j]=j;
 
     pb_BackBufferNxt=0;
-    for(i=0;i<5;i++) pb_BackBufferbReady[i]=0;
+    for(i=0;i<PB_MAX_BACK_BUFFERS+1;i++) pb_BackBufferbReady[i]=0;
 
     pb_Put=NULL;
 
@@ -2747,12 +4743,17 @@ int pb_init(void)
     pb_FrameBuffersAddr=0;
 
 
-    pb_DmaBuffer8=MmAllocateContiguousMemoryEx(32,0,MAXRAM,0,4);
+    pb_DmaBuffer8=MmAllocateContiguousMemoryEx(4096,0,MAXRAM,0,0x204); //uncached, GPU writes fences there
     pb_DmaBuffer2=MmAllocateContiguousMemoryEx(32,0,MAXRAM,0,4);
     pb_DmaBuffer7=MmAllocateContiguousMemoryEx(32,0,MAXRAM,0,4);
         //NumberOfBytes,LowestAcceptableAddress,HighestAcceptableAddress,Alignment,ProtectionType
     if ((pb_DmaBuffer8==NULL)||(pb_DmaBuffer2==NULL)||(pb_DmaBuffer7==NULL)) return -2;
-    memset(pb_DmaBuffer8,0,32);
+    memset(pb_DmaBuffer8,0,4096);
+    pb_FenceLast=0;
+
+    //transform program memory and constants content is unknown
+    while(pb_VsResidentCount) pb_vs_remove(0);
+    pb_vs_const_invalidate();
     memset(pb_DmaBuffer2,0,32);
     memset(pb_DmaBuffer7,0,32);
 
@@ -2766,13 +4767,35 @@ int pb_init(void)
 
     pb_Put=pb_Head;
 
+    pb_FrameBytes=0;
+    pb_LastFrameBytes=0;
+    pb_FrameStall=0;
+    pb_LastFrameStall=0;
+    pb_Wraps=0;
+    pb_PeakFrameBytes=0;
+    pb_HighWater=0;
+    pb_LargestBlock=0;
+    pb_SafeWrapped=0;
+    pb_SafeWraps=0;
+    pb_ShadowSaved=0;
+    pb_LastShadowSaved=0;
+    memset(pb_ShadowValid,0,sizeof(pb_ShadowValid)); //GPU state is about to be reset
+
     pb_BackBufferNxt=0;     //increments when we finish drawing a frame
-    pb_BackBufferbReady[0]=0;
-    pb_BackBufferbReady[1]=0;
-    pb_BackBufferbReady[2]=0;
+    for(i=0;i<PB_MAX_BACK_BUFFERS+1;i++) pb_BackBufferbReady[i]=0;
 
     pb_BackBufferNxtVBL=0;      //increments when VBlank event fires
 
+    pb_Presented=0;
+    pb_Flipped=0;
+    pb_FlipVBL=pb_vbl_counter;
+    pb_MissedVBlanks=0;
+    pb_TornFlips=0;
+    pb_PresentTimeouts=0;
+    pb_LatencyLast=0;
+    pb_LatencySum=0;
+    pb_LatencyMax=0;
+
     //initialize push buffer DMA engine
     //DMA=Direct Memory Access (means CPU is not involved in the data transfert)
 
@@ -3110,7 +5133,7 @@ int pb_init(void)
     pb_create_dma_ctx(7,DMA_CLASS_3D,(DWORD)pb_DmaBuffer7,0x1F,&sDmaObject7);
     //this one is damn important. memory address 0x80000000 acts as a trigger.
     pb_create_dma_ctx(12,DMA_CLASS_3D,0x80000000,0x10000000,&sDmaObject12);
-    pb_create_dma_ctx(8,DMA_CLASS_3D,(DWORD)pb_DmaBuffer8,0x20,&sDmaObject8);
+    pb_create_dma_ctx(8,DMA_CLASS_3D,(DWORD)pb_DmaBuffer8,0xFFF,&sDmaObject8);
     pb_create_dma_ctx(6,DMA_CLASS_2,0,MAXRAM,&sDmaObject6);
 
     //we initialized channel 0 first, that will match graphic context 0
@@ -3321,6 +5344,10 @@ int pb_init(void)
     pb_FrameBuffersAddr=0;
     pb_DepthStencilAddr=0;
     pb_DepthStencilLast=-2;
+    pb_ColorWritesOff=0;
+
+    pb_TilesUsed=0;
+    for(i=0;i<PB_TILES;i++) pb_ZTagCount[i]=0;
 
     vm=XVideoGetMode();
 
@@ -3364,7 +5391,7 @@ int pb_init(void)
     Width=vm.width;
     Height=vm.height;
 
-    BackBufferCount=2;          //triple buffering technic!
+    BackBufferCount=pb_BackBuffersCount;    //triple buffering technic by default!
                         //allows dynamic details adjustment
 
     pb_FrameBuffersCount=BackBufferCount+1; //front buffer + back buffers
@@ -3450,6 +5477,7 @@ int pb_init(void)
             0,              //DWORD tile_z_offset,
             0               //DWORD tile_flags
             );
+    pb_TilesUsed|=1<<0;
 
 
     //Depth stencil buffer (tile #1)
@@ -3503,6 +5531,9 @@ int pb_init(void)
             0,              //DWORD tile_z_offset,
             0x84000001          //DWORD tile_flags (0x04000000 for 32 bits)
             );
+    pb_TilesUsed|=1<<1;
+    pb_ZTagStart[1]=0;
+    pb_ZTagCount[1]=DSSize/PB_ZTAG_BYTES;
 
 
     if (pb_ExtraBuffersCount)
@@ -3558,6 +5589,7 @@ int pb_init(void)
                 0,              //DWORD tile_z_offset,
                 0               //DWORD tile_flags
             );
+        pb_TilesUsed|=1<<2;
 
     }
 
@@ -3721,6 +5753,15 @@ int pb_init(void)
     pb_front_index=0;       //frame buffer #0 is the front buffer for now
     pb_show_front_screen();     //show it
 
+    //GPU memory pool (arenas are allocated as needed)
+    if (!pb_MemReady)
+    {
+        RtlInitializeCriticalSection(&pb_MemLock);
+        pb_pool_init(&pb_Mem);
+        pb_MemReady=1;
+    }
+    pb_RenderThread=KeGetCurrentThread();
+
     pb_shutdown_registration.NotificationRoutine = pb_shutdown_notification_routine;
     pb_shutdown_registration.Priority = 0;
     HalRegisterShutdownNotification(&pb_shutdown_registration, TRUE);
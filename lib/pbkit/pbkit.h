@@ -29,6 +29,8 @@ extern "C"
 #include "outer.h"
 #include "nv_objects.h"
 #include "nv_regs.h"
+#include "pbpool.h"
+#include "pbswizzle.h"
 
 //4x4 matrices indexes
 #define _11                 0
@@ -48,12 +50,119 @@ extern "C"
 #define _43                 14
 #define _44                 15
 
+//GPU memory pool alignments (see pb_mem_alloc)
+#define PB_MEM_ALIGN_TEXTURE        128
+#define PB_MEM_ALIGN_VERTEX         16
+#define PB_MEM_ALIGN_INDEX          4
+
+//vertex constants (transform program c[0] is slot 96)
+#define PB_VS_CONSTANTS             192
+
 //GPU subchannels
 #define SUBCH_3D                0
 #define SUBCH_2                 2
 #define SUBCH_3                 3
 #define SUBCH_4                 4
 
+//pb_clear flags
+#define PB_CLEAR_DEPTH              NV097_CLEAR_SURFACE_Z
+#define PB_CLEAR_STENCIL            NV097_CLEAR_SURFACE_STENCIL
+#define PB_CLEAR_COLOR              NV097_CLEAR_SURFACE_COLOR
+
+typedef struct
+{
+    int x;
+    int y;
+    int w;
+    int h;
+} pb_rect_t;
+
+//push buffer statistics (see pb_get_stats)
+typedef struct
+{
+    DWORD   frame_bytes;        //bytes written into push buffer during last frame
+    DWORD   frame_stall_us;     //time CPU waited for push buffer space during last frame
+    DWORD   wraps;          //number of times push buffer wrapped back to head (ring mode and safe wraps)
+    DWORD   frame_shadow_saved; //dwords not sent during last frame thanks to shadow state
+    DWORD   peak_frame_bytes;   //biggest frame_bytes since pb_init
+    DWORD   high_water_bytes;   //furthest push buffer offset written since pb_init (above size: overflow)
+    DWORD   largest_block_bytes;    //biggest begin-end block since pb_init
+    DWORD   size;           //push buffer size (see pb_size)
+    DWORD   safe_wraps;     //number of times pb_safe_wrap saved push buffer from overflowing
+} pb_stats_t;
+
+//presentation modes (see pb_present_mode)
+#define PB_PRESENT_VSYNC            0   //frames show up at VBlank (default)
+#define PB_PRESENT_ADAPTIVE         1   //like vsync, but a frame that missed its VBlank shows up at once (tears)
+#define PB_PRESENT_IMMEDIATE        2   //frames show up as soon as GPU has drawn them (tears)
+
+#define PB_MAX_BACK_BUFFERS         4
+
+//presentation statistics (see pb_get_present_stats)
+typedef struct
+{
+    DWORD   presented;      //frames queued by pb_present or pb_finished
+    DWORD   flipped;        //frames that reached screen
+    DWORD   queue_depth;        //frames queued but not on screen yet
+    DWORD   missed_vblanks;     //VBlanks with a frame queued but not drawn yet by GPU
+    DWORD   torn_flips;     //frames shown outside VBlank (adaptive and immediate modes)
+    DWORD   timeouts;       //pb_present calls that gave up
+    DWORD   latency_us;     //time between last flipped frame queuing and its scan out
+    DWORD   latency_avg_us;
+    DWORD   latency_max_us;
+} pb_present_stats_t;
+
+//render target (see pb_rt_create), surfaces are linear (pitch bytes per row) with 32 bits pixels
+#define PB_RT_COLOR             1
+#define PB_RT_DEPTH             2   //Z24S8
+typedef struct
+{
+    DWORD   width;
+    DWORD   height;
+    DWORD   *color;         //NULL if target has no color surface
+    DWORD   color_pitch;
+    DWORD   color_size;
+    DWORD   *depth;         //NULL if target has no depth stencil surface
+    DWORD   depth_pitch;
+    DWORD   depth_size;
+    int color_tile;     //NV_PFB tile covering surface, -1 if all tiles were in use
+    int depth_tile;
+    int compressed;     //1 if depth stencil uses Z compression
+} pb_render_target_t;
+
+//display list: blocks recorded once into their own buffer, then replayed with a push buffer CALL
+//(each thread can record its own list, only render thread sends blocks to push buffer)
+typedef struct
+{
+    uint32_t    *start;
+    uint32_t    *put;       //where next recorded block will be written
+    uint32_t    *limit;
+    int     overflow;   //1 if blocks didn't fit: list can't be called until recorded again
+    DWORD       vs_changed; //PB_LIST_VS_* flags: vertex shader state pb_push_call has to forget
+} pb_list_t;
+
+#define PB_LIST_VS_PROGRAM          1   //list uploaded a vertex program (pb_vs_bind while recording)
+#define PB_LIST_VS_CONSTANTS        2   //list set vertex constants (pb_vs_const_set while recording)
+
+//vertex program (4 dwords per instruction) kept resident in transform program memory by pb_vs_bind
+typedef struct
+{
+    const DWORD *code;      //must stay valid, program is uploaded again after eviction
+    DWORD       size;       //number of instructions
+    int     slot;       //first instruction slot while resident, -1 otherwise
+    DWORD       last_use;
+} pb_vs_program_t;
+
+//profiling marker timing, resolved once GPU has executed the frame (see pb_marker_begin)
+#define PB_MAX_MARKERS              64  //per frame
+typedef struct
+{
+    const char  *name;
+    int     depth;      //nesting level
+    DWORD       gpu_us;     //time GPU spent between begin and end
+    DWORD       cpu_us;     //time CPU spent between begin and end
+} pb_marker_result_t;
+
 
 void    pb_show_front_screen(void); //shows scene (allows VBL synced screen swapping)
 void    pb_show_debug_screen(void); //shows debug screen (default openxdk+SDL buffer)
@@ -69,9 +178,71 @@ DWORD   pb_wait_for_vbl(void);  //waits for VBL, returns VBL counter value as bo
 void    pb_erase_depth_stencil_buffer(int x, int y, int w, int h);
 
 void    pb_reset(void); //forces a jump to push buffer head (do it at frame start)
+void    pb_ring_mode(int enable);   //1: pb_reset doesn't wait for GPU, push buffer wraps around instead
+                    //(CPU only waits if it would overwrite data GPU hasn't read yet)
+void    pb_safe_wrap(int enable);   //1: if a frame reaches push buffer tail before pb_reset, push buffer wraps
+                    //around like ring mode does (instead of overflowing) until next pb_reset
+void    pb_get_stats(pb_stats_t *stats);    //push buffer statistics, updated by pb_reset
+
+void    pb_shadow_state(int enable);    //1: pb_push1..4 drop 3D class writes of values already sent
+                    //(triggers like CLEAR_SURFACE or SET_BEGIN_END are always sent)
+void    pb_shadow_invalidate(void); //forgets shadow state (call it if GPU state was changed behind pbkit)
+int pb_list_create(pb_list_t *list, DWORD size);   //allocates a display list of size bytes (returns 0 if ok)
+void    pb_list_destroy(pb_list_t *list);
+void    pb_list_begin(pb_list_t *list); //from now blocks (pb_begin...pb_end) of this thread are recorded into list
+                    //instead of being sent to GPU (worker threads record, render thread calls
+                    //their lists in the order it wants with pb_push_call once they are done)
+int pb_list_end(void);       //stops recording (pointers returned while recording can be used to patch parameters)
+                    //returns -1 if list overflowed (it's then refused by pb_push_call)
+uint32_t   *pb_push_call(uint32_t *p, pb_list_t *list);   //replays display list (1 dword, lists can't call lists)
+                    //don't patch or record list again until GPU is done with it (see pb_fence_insert)
+int pb_start_capture(const char *filename);  //records all blocks sent to GPU into a binary file (see pbcapture.h)
+void    pb_stop_capture(void);      //flushes and closes capture file (decode it with tools/pbstat)
+
+void    pb_coalesce_writes(int enable); //1: pb_push1..4 extend previous packet when writing next register
+                    //(pointers returned by pb_push1..4 are then the only valid write positions)
 int pb_finished(void);  //prepare screen swapping at VBlank (do it at frame end)
                 //if it returns 1 it failed (too early, just wait & retry)
                 //that means you can draw more details in your scene
+int pb_present(DWORD timeout_ms);   //queues frame like pb_finished, but waits up to timeout_ms for a free
+                    //back buffer (0xFFFFFFFF waits forever), returns 1 if it timed out
+void    pb_present_mode(int mode);  //PB_PRESENT_VSYNC, PB_PRESENT_ADAPTIVE or PB_PRESENT_IMMEDIATE
+void    pb_get_present_stats(pb_present_stats_t *stats);
+
+DWORD   pb_fence_insert(void);  //GPU signals fence once all previous commands are executed (call outside begin-end block)
+int pb_fence_reached(DWORD fence);  //returns 1 if GPU has reached that fence
+void    pb_fence_wait(DWORD fence); //waits until GPU has reached that fence (cheaper than waiting for pb_busy()==0)
+
+void    *pb_mem_alloc(DWORD size, DWORD align); //write-combined contiguous memory for textures, vertices, indices
+                    //(sub-allocated from 4Mb arenas, after pb_init, from any thread. When memory runs out,
+                    //only render thread (the one which called pb_init) outside begin-end block and not
+                    //recording a display list inserts a fence and waits for freed blocks, others get NULL)
+void    pb_mem_free(void *ptr);     //memory is reused once GPU has executed the frame it was freed in (any thread)
+void    pb_mem_get_stats(pb_pool_stats_t *stats);   //pool usage and fragmentation
+void    *pb_texture_upload(const void *src, DWORD pitch, DWORD width, DWORD height, DWORD bytes_per_texel);
+                    //swizzles a linear texture into pool memory (free it with pb_mem_free)
+                    //for SZ_* texture formats, width and height must be powers of 2
+
+void    pb_vs_program_init(pb_vs_program_t *prog, const DWORD *code, DWORD instructions);
+void    pb_vs_bind(pb_vs_program_t *prog);  //makes program current, uploads it first if it isn't resident
+                    //(136 instruction slots shared by resident programs, least recently bound are evicted)
+                    //while recording a display list, program is always uploaded into the list
+void    pb_vs_program_release(pb_vs_program_t *prog);   //call it before freeing program code
+
+void    pb_vs_const_set(DWORD slot, const float *v, DWORD count);   //sets count 4 floats constants (only changes are sent)
+                    //while recording a display list, constants are written into the list at once
+                    //(changes set before pb_push_call are only sent at next flush, after the list)
+void    pb_vs_const_set_transposed_matrix(DWORD slot, const float *m);  //sets 4 constants (replaces pb_push_transposed_matrix)
+void    pb_vs_const_flush(void);    //sends changed constants, 8 per packet (pb_draw_indexed does it by itself)
+void    pb_vs_const_invalidate(void);   //forgets constants (call it if they were sent behind pbkit)
+
+void    pb_marker_begin(const char *name);  //starts timing a pass (name must stay valid, call it outside begin-end block)
+                    //GPU waits for idle at each marker, so use them for profiling only
+void    pb_marker_end(void);        //markers nest, frame's timings are available a few frames later
+int pb_marker_results(pb_marker_result_t *results, int max);  //copies last resolved frame timings, returns count
+void    pb_marker_print(void);      //prints last resolved frame timings with pb_print
+int pb_marker_trace_start(const char *filename); //writes every resolved frame into a Chrome trace (json) file
+void    pb_marker_trace_stop(void);
 
 void pb_wait_until_gr_not_busy(void);
 DWORD pb_wait_until_tiles_not_busy(void);
@@ -93,6 +264,8 @@ uint32_t   *pb_push_transposed_matrix(uint32_t *p, DWORD command, float *m);
 void    pb_end(uint32_t *pEnd);    //end a block with this (triggers the data sending to GPU)
 
 void    pb_extra_buffers(int n);//requests additional back buffers (default is 0) (call it before pb_init)
+void    pb_back_buffers(int n); //sets number of rotating back buffers, 2 to 4 (default is 2) (call it before pb_init)
+                //more buffers let CPU and GPU run further ahead of screen, at the cost of latency
 void    pb_size(DWORD size);    //sets push buffer size (default is 512Kb) (call it before pb_init)
 void    pb_set_color_format(unsigned int fmt, bool swizzled); // sets color surface format (call it before pb_init)
 int     pb_init(void);      //returns 0 if everything went well (starts Dma engine)
@@ -102,9 +275,18 @@ void    pb_print(const char *format, ...);  //populates a text screen array
 void    pb_printat(int row, int col, char *format, ...);    //populates a text screen array
 void    pb_erase_text_screen(void); //clears array
 void    pb_draw_text_screen(void);  //converts array into drawing sequences
+                    //(glyphs are drawn as batched CLEAR_SURFACE rectangles, not textured quads:
+                    //no texture or shader state is touched. Nothing is sent if text screen is empty)
 
 void    pb_target_extra_buffer(int n);  //to have rendering made into a static extra buffer
 void    pb_target_back_buffer(void);    //to have rendering made into normal rotating back buffer
+void    pb_target_render_target(pb_render_target_t *rt);   //to have rendering made into a render target
+                    //(color writes are masked while a depth only target is bound, set viewport to target size)
+
+int pb_rt_create(pb_render_target_t *rt, DWORD width, DWORD height, DWORD flags);  //PB_RT_COLOR and/or PB_RT_DEPTH
+                    //returns 0 if ok, surfaces get a free tile (depth: and free Z compression tags)
+                    //clear depth entirely before each use to benefit from compression
+void    pb_rt_destroy(pb_render_target_t *rt);  //waits for GPU, then releases memory, tile and tags
 
 DWORD   *pb_extra_buffer(int n);    //returns a static extra buffer address
 DWORD   *pb_back_buffer(void);      //returns normal rotating back buffer address
@@ -113,6 +295,20 @@ DWORD   pb_back_buffer_height(void);
 DWORD   pb_back_buffer_pitch(void);
 
 void    pb_fill(int x,int y,int w,int h, DWORD color);  //rectangle fill
+void    pb_clear(const pb_rect_t *rects, int n, DWORD flags, DWORD color, float depth, DWORD stencil);
+                    //clears color (A8R8G8B8) and/or depth (0.0-1.0) & stencil of n rectangles at once
+                    //(rects=NULL: whole surface, one CLEAR_SURFACE per rectangle, 30 rectangles per block)
+void    pb_draw_indexed(DWORD primitive, const uint16_t *indices, DWORD count); //draws with vertex arrays already set
+                    //(one begin-end pair, indices packed by pairs, call outside begin-end block)
+
+DWORD   pb_copy(void *dst, const void *src, DWORD size);   //GPU memory to memory copy of contiguous memory, overlap allowed
+DWORD   pb_copy_lines(void *dst, DWORD dst_pitch, const void *src, DWORD src_pitch, DWORD line_bytes, DWORD lines);
+                    //copies lines between different pitches (regions must not overlap)
+DWORD   pb_blit(void *dst, DWORD dst_pitch, int dx, int dy, const void *src, DWORD src_pitch, int sx, int sy, int w, int h, DWORD bytes_per_pixel);
+                    //GPU 2D rectangle copy (1, 2 or 4 bytes pixels), overlap allowed within a surface
+                    //(surfaces and pitches 64 bytes aligned, pitches < 64Kb)
+                    //copies are queued: they return a fence reached once done (see pb_fence_wait)
+                    //call them outside begin-end block
 
 void    pb_set_viewport(int dwx,int dwy,int width,int height,float zmin,float zmax);
 
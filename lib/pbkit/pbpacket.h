@@ -0,0 +1,72 @@
+//pbKit method packets (used by pb_push*, free of kernel dependencies for host side tests)
+// This library is free software; you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as
+// published by the Free Software Foundation; either version 2.1 of the
+// License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, see <http://www.gnu.org/licenses/>
+
+#ifndef _PBPACKET_H_
+#define _PBPACKET_H_
+
+#include <stdint.h>
+
+//A packet is a header (method, subchannel, parameters count) followed by its
+//parameters, written to consecutive registers unless the non-incrementing
+//flag is set in method. Writes to the register following the last one of
+//previous packet can grow it instead of starting a new one.
+
+#define PB_PACKET_MAX_PARAMS    2047
+#define PB_PACKET_NONINC        0x40000000
+
+typedef struct
+{
+    uint32_t    *head;  //header of last packet (NULL if it can't grow)
+    uint32_t    subchannel;
+    uint32_t    method;
+    uint32_t    count;
+} pb_packet_t;
+
+static inline uint32_t pb_packet_encode(uint32_t subchannel, uint32_t method, uint32_t nparam)
+{
+    return (nparam<<18)+(subchannel<<13)+method;
+}
+
+//grows last packet by nparam parameters if they can be written at p, returns 1 if done
+static inline int pb_packet_append(pb_packet_t *packet, uint32_t *p, uint32_t subchannel, uint32_t method, uint32_t nparam)
+{
+    if ((packet->head==NULL)||(p!=packet->head+1+packet->count)||(subchannel!=packet->subchannel)||
+        (method!=packet->method+packet->count*4)||(packet->count+nparam>PB_PACKET_MAX_PARAMS))
+        return 0;
+
+    packet->count+=nparam;
+    *packet->head=pb_packet_encode(subchannel,packet->method,packet->count);
+    return 1;
+}
+
+//writes a new header at p and remembers it for pb_packet_append if grow is set,
+//returns where parameters have to be written
+static inline uint32_t *pb_packet_start(pb_packet_t *packet, int grow, uint32_t *p, uint32_t subchannel, uint32_t method, uint32_t nparam)
+{
+    *p=pb_packet_encode(subchannel,method,nparam);
+
+    if ((grow)&&((method&PB_PACKET_NONINC)==0)) //non-incrementing packets can't grow
+    {
+        packet->head=p;
+        packet->subchannel=subchannel;
+        packet->method=method;
+        packet->count=nparam;
+    }
+    else
+        packet->head=NULL;
+
+    return p+1;
+}
+
+#endif
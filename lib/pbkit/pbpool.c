@@ -0,0 +1,488 @@
+//pbKit GPU memory pool (see pbpool.h)
+// This library is free software; you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as
+// published by the Free Software Foundation; either version 2.1 of the
+// License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, see <http://www.gnu.org/licenses/>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pbpool.h"
+#include "pbfence.h"
+
+struct pb_pool_block
+{
+    uintptr_t       addr;
+    uint32_t        size;
+    int             cls;        //-1: range (free or allocated), else slab size class
+    pb_pool_block_t *next;      //free ranges list (address order) or class slabs list
+    pb_pool_block_t *prev;
+    pb_pool_block_t *hnext;     //hash chain (allocated ranges and slabs)
+    uint16_t        *chunks;    //slab: stack of free chunk indices
+    uint32_t        nfree;      //slab: number of free chunks
+    uint32_t        *live;      //slab: 1 bit per chunk, set while allocated and not freed
+    int             pending;    //allocated range: freed, waiting for its fence
+};
+
+
+
+static uint32_t pb_pool_hash(uintptr_t addr)
+{
+    //ranges are page aligned, slabs are aligned on slab size
+    return ((addr>>12)^(addr>>22))&(PB_POOL_HASH_SIZE-1);
+}
+
+static void pb_pool_hash_insert(pb_pool_t *pool, pb_pool_block_t *b)
+{
+    uint32_t        h;
+
+    h=pb_pool_hash(b->addr);
+    b->hnext=pool->hash[h];
+    pool->hash[h]=b;
+}
+
+static pb_pool_block_t *pb_pool_hash_find(pb_pool_t *pool, uintptr_t addr)
+{
+    pb_pool_block_t *b;
+
+    for(b=pool->hash[pb_pool_hash(addr)];b;b=b->hnext)
+        if (b->addr==addr) return b;
+
+    return NULL;
+}
+
+static void pb_pool_hash_remove(pb_pool_t *pool, pb_pool_block_t *b)
+{
+    pb_pool_block_t **pp;
+
+    for(pp=&pool->hash[pb_pool_hash(b->addr)];*pp;pp=&(*pp)->hnext)
+        if (*pp==b)
+        {
+            *pp=b->hnext;
+            return;
+        }
+}
+
+static void pb_pool_unlink(pb_pool_block_t **list, pb_pool_block_t *b)
+{
+    if (b->prev) b->prev->next=b->next; else *list=b->next;
+    if (b->next) b->next->prev=b->prev;
+    b->next=NULL;
+    b->prev=NULL;
+}
+
+static void pb_pool_link_after(pb_pool_block_t **list, pb_pool_block_t *after, pb_pool_block_t *b)
+{
+    b->prev=after;
+    b->next=(after)?after->next:*list;
+    if (b->next) b->next->prev=b;
+    if (after) after->next=b; else *list=b;
+}
+
+static pb_pool_block_t *pb_pool_new_block(uintptr_t addr, uint32_t size, int cls)
+{
+    pb_pool_block_t *b;
+
+    b=malloc(sizeof(pb_pool_block_t));
+    if (b==NULL) return NULL;
+
+    memset(b,0,sizeof(pb_pool_block_t));
+    b->addr=addr;
+    b->size=size;
+    b->cls=cls;
+    return b;
+}
+
+//takes first free range able to hold size bytes at align, returns 0 if none
+static uintptr_t pb_pool_take_range(pb_pool_t *pool, uint32_t size, uint32_t align)
+{
+    pb_pool_block_t *r;
+    pb_pool_block_t *t;
+    uintptr_t       start;
+    uint32_t        head,tail;
+
+    for(r=pool->ranges;r;r=r->next)
+    {
+        start=(r->addr+align-1)&~(uintptr_t)(align-1);
+        head=(uint32_t)(start-r->addr);
+        if ((head>=r->size)||(r->size-head<size)) continue;
+        tail=r->size-head-size;
+
+        if (head)
+        {
+            r->size=head;
+            if (tail)
+            {
+                t=pb_pool_new_block(start+size,tail,-1);
+                if (t==NULL)
+                {
+                    r->size=head+size+tail;
+                    return 0;
+                }
+                pb_pool_link_after(&pool->ranges,r,t);
+            }
+        }
+        else if (tail)
+        {
+            r->addr+=size;
+            r->size=tail;
+        }
+        else
+        {
+            pb_pool_unlink(&pool->ranges,r);
+            free(r);
+        }
+        return start;
+    }
+
+    return 0;
+}
+
+//gives a range back, merging it with its free neighbours
+static void pb_pool_give_range(pb_pool_t *pool, pb_pool_block_t *b)
+{
+    pb_pool_block_t *prev;
+    pb_pool_block_t *next;
+
+    if (b==NULL) return; //metadata allocation failed, range is lost
+
+    prev=NULL;
+    for(next=pool->ranges;next&&(next->addr<b->addr);next=next->next) prev=next;
+
+    if ((prev)&&(prev->addr+prev->size==b->addr))
+    {
+        prev->size+=b->size;
+        free(b);
+        b=prev;
+    }
+    else
+        pb_pool_link_after(&pool->ranges,prev,b);
+
+    if ((next)&&(b->addr+b->size==next->addr))
+    {
+        b->size+=next->size;
+        pb_pool_unlink(&pool->ranges,next);
+        free(next);
+    }
+}
+
+static int pb_pool_class(uint32_t size, uint32_t align)
+{
+    int             cls;
+    uint32_t        s;
+
+    for(cls=0,s=PB_POOL_SMALL_MIN;(s<size)||(s<align);cls++,s<<=1);
+    return cls;
+}
+
+static uintptr_t pb_pool_alloc_chunk(pb_pool_t *pool, int cls)
+{
+    pb_pool_block_t *slab;
+    uint32_t        csize,n,i;
+    uintptr_t       addr;
+
+    csize=PB_POOL_SMALL_MIN<<cls;
+
+    slab=pool->slabs[cls];
+    if (slab==NULL)
+    {
+        addr=pb_pool_take_range(pool,PB_POOL_SLAB_SIZE,PB_POOL_SLAB_SIZE);
+        if (addr==0) return 0;
+
+        n=PB_POOL_SLAB_SIZE/csize;
+        slab=pb_pool_new_block(addr,PB_POOL_SLAB_SIZE,cls);
+        if (slab)
+        {
+            slab->chunks=malloc(n*sizeof(uint16_t));
+            slab->live=calloc((n+31)/32,sizeof(uint32_t));
+        }
+        if ((slab==NULL)||(slab->chunks==NULL)||(slab->live==NULL))
+        {
+            if (slab)
+            {
+                free(slab->chunks);
+                free(slab->live);
+            }
+            free(slab);
+            pb_pool_give_range(pool,pb_pool_new_block(addr,PB_POOL_SLAB_SIZE,-1));
+            return 0;
+        }
+
+        //lowest chunks are handed out first
+        for(i=0;i<n;i++) slab->chunks[i]=(uint16_t)(n-1-i);
+        slab->nfree=n;
+
+        pb_pool_hash_insert(pool,slab);
+        pb_pool_link_after(&pool->slabs[cls],NULL,slab);
+        pool->stats.slabs++;
+    }
+
+    i=slab->chunks[--slab->nfree];
+    if (slab->nfree==0) pb_pool_unlink(&pool->slabs[cls],slab);
+    slab->live[i>>5]|=1u<<(i&31);
+
+    pool->stats.used_bytes+=csize;
+    return slab->addr+i*csize;
+}
+
+static void pb_pool_free_chunk(pb_pool_t *pool, pb_pool_block_t *slab, uintptr_t addr)
+{
+    uint32_t        csize,n;
+
+    csize=PB_POOL_SMALL_MIN<<slab->cls;
+    n=PB_POOL_SLAB_SIZE/csize;
+
+    slab->chunks[slab->nfree++]=(uint16_t)((addr-slab->addr)/csize);
+    if (slab->nfree==1) pb_pool_link_after(&pool->slabs[slab->cls],NULL,slab);
+
+    //empty slab goes back to arena, unless it's the last one of its class (avoids thrashing)
+    if ((slab->nfree==n)&&((slab->prev)||(slab->next)))
+    {
+        pb_pool_unlink(&pool->slabs[slab->cls],slab);
+        pb_pool_hash_remove(pool,slab);
+        free(slab->chunks);
+        slab->chunks=NULL;
+        free(slab->live);
+        slab->live=NULL;
+        slab->cls=-1;
+        slab->nfree=0;
+        pb_pool_give_range(pool,slab);
+        pool->stats.slabs--;
+    }
+}
+
+//finds allocation at addr, returns its size (0 if addr isn't allocated)
+static uint32_t pb_pool_find(pb_pool_t *pool, uintptr_t addr, pb_pool_block_t **owner)
+{
+    pb_pool_block_t *b;
+    uint32_t        csize;
+
+    b=pb_pool_hash_find(pool,addr);
+    if ((b)&&(b->cls<0))
+    {
+        *owner=b;
+        return b->size;
+    }
+
+    b=pb_pool_hash_find(pool,addr&~(uintptr_t)(PB_POOL_SLAB_SIZE-1));
+    if ((b)&&(b->cls>=0))
+    {
+        csize=PB_POOL_SMALL_MIN<<b->cls;
+        if ((addr-b->addr)%csize) return 0;
+        *owner=b;
+        return csize;
+    }
+
+    return 0;
+}
+
+static void pb_pool_release(pb_pool_t *pool, uintptr_t addr)
+{
+    pb_pool_block_t *b;
+
+    if (pb_pool_find(pool,addr,&b)==0) return;
+
+    if (b->cls>=0)
+        pb_pool_free_chunk(pool,b,addr);
+    else
+    {
+        pb_pool_hash_remove(pool,b);
+        pb_pool_give_range(pool,b);
+    }
+    pool->stats.allocations--;
+}
+
+
+
+void pb_pool_init(pb_pool_t *pool)
+{
+    memset(pool,0,sizeof(pb_pool_t));
+}
+
+void pb_pool_destroy(pb_pool_t *pool)
+{
+    pb_pool_block_t *b;
+    pb_pool_block_t *next;
+    int             i;
+
+    for(b=pool->ranges;b;b=next)
+    {
+        next=b->next;
+        free(b);
+    }
+    for(i=0;i<PB_POOL_HASH_SIZE;i++)
+        for(b=pool->hash[i];b;b=next)
+        {
+            next=b->hnext;
+            free(b->chunks);
+            free(b->live);
+            free(b);
+        }
+    free(pool->pending);
+
+    memset(pool,0,sizeof(pb_pool_t));
+}
+
+int pb_pool_add_arena(pb_pool_t *pool, uintptr_t base, uint32_t size)
+{
+    pb_pool_block_t *b;
+
+    size&=~(PB_POOL_PAGE-1);
+    if ((pool->arena_count==PB_POOL_MAX_ARENAS)||(base&(PB_POOL_PAGE-1))||(size==0)) return -1;
+
+    b=pb_pool_new_block(base,size,-1);
+    if (b==NULL) return -1;
+    pb_pool_give_range(pool,b);
+
+    pool->arena_base[pool->arena_count]=base;
+    pool->arena_size[pool->arena_count]=size;
+    pool->arena_count++;
+    pool->stats.arena_bytes+=size;
+    return 0;
+}
+
+uintptr_t pb_pool_alloc(pb_pool_t *pool, uint32_t size, uint32_t align)
+{
+    pb_pool_block_t *b;
+    uintptr_t       addr;
+
+    if (align==0) align=1;
+
+    if ((size<=PB_POOL_SMALL_MAX)&&(align<=PB_POOL_SMALL_MAX))
+    {
+        addr=pb_pool_alloc_chunk(pool,pb_pool_class(size,align));
+    }
+    else
+    {
+        size=(size+PB_POOL_PAGE-1)&~(PB_POOL_PAGE-1);
+        if (align<PB_POOL_PAGE) align=PB_POOL_PAGE;
+
+        addr=pb_pool_take_range(pool,size,align);
+        if (addr)
+        {
+            b=pb_pool_new_block(addr,size,-1);
+            if (b==NULL)
+            {
+                pb_pool_give_range(pool,pb_pool_new_block(addr,size,-1));
+                addr=0;
+            }
+            else
+            {
+                pb_pool_hash_insert(pool,b);
+                pool->stats.used_bytes+=size;
+            }
+        }
+    }
+
+    if (addr)
+        pool->stats.allocations++;
+    else
+        pool->stats.failures++;
+
+    return addr;
+}
+
+int pb_pool_free(pb_pool_t *pool, uintptr_t addr, uint32_t fence)
+{
+    pb_pool_block_t     *b;
+    pb_pool_pending_t   *pending;
+    uint32_t            size,max,i,chunk;
+
+    size=pb_pool_find(pool,addr,&b);
+    if (size==0) return -1;
+
+    //already freed: queuing it again would hand it out twice (and overflow slab chunk stack)
+    chunk=0;
+    if (b->cls>=0)
+    {
+        chunk=(uint32_t)((addr-b->addr)/size);
+        if ((b->live[chunk>>5]&(1u<<(chunk&31)))==0) return -1;
+    }
+    else
+    if (b->pending) return -1;
+
+    if (pool->pending_count==pool->pending_max)
+    {
+        max=(pool->pending_max)?pool->pending_max*2:256;
+        pending=malloc(max*sizeof(pb_pool_pending_t));
+        if (pending==NULL) return -1;
+        for(i=0;i<pool->pending_count;i++)
+            pending[i]=pool->pending[(pool->pending_first+i)%pool->pending_max];
+        free(pool->pending);
+        pool->pending=pending;
+        pool->pending_first=0;
+        pool->pending_max=max;
+    }
+
+    if (b->cls>=0)
+        b->live[chunk>>5]&=~(1u<<(chunk&31));
+    else
+        b->pending=1;
+
+    pending=&pool->pending[(pool->pending_first+pool->pending_count)%pool->pending_max];
+    pending->addr=addr;
+    pending->size=size;
+    pending->fence=fence;
+    pool->pending_count++;
+
+    pool->stats.used_bytes-=size;
+    pool->stats.pending_bytes+=size;
+    return 0;
+}
+
+void pb_pool_collect(pb_pool_t *pool, uint32_t reached)
+{
+    pb_pool_pending_t   *pending;
+
+    while(pool->pending_count)
+    {
+        pending=&pool->pending[pool->pending_first];
+        if (!pb_fence_passed(reached,pending->fence)) break;
+
+        pb_pool_release(pool,pending->addr);
+        pool->stats.pending_bytes-=pending->size;
+
+        pool->pending_first=(pool->pending_first+1)%pool->pending_max;
+        pool->pending_count--;
+    }
+}
+
+int pb_pool_oldest_fence(pb_pool_t *pool, uint32_t *fence)
+{
+    if (pool->pending_count==0) return 0;
+
+    *fence=pool->pending[pool->pending_first].fence;
+    return 1;
+}
+
+void pb_pool_get_stats(pb_pool_t *pool, pb_pool_stats_t *stats)
+{
+    pb_pool_block_t *b;
+    uint32_t        ranges;
+    int             cls;
+
+    *stats=pool->stats;
+
+    ranges=0;
+    stats->largest_free=0;
+    for(b=pool->ranges;b;b=b->next)
+    {
+        ranges+=b->size;
+        if (b->size>stats->largest_free) stats->largest_free=b->size;
+    }
+
+    stats->free_bytes=ranges;
+    for(cls=0;cls<PB_POOL_CLASSES;cls++)
+        for(b=pool->slabs[cls];b;b=b->next)
+            stats->free_bytes+=b->nfree*(PB_POOL_SMALL_MIN<<cls);
+
+    stats->fragmentation=(ranges)?(uint32_t)(((uint64_t)(ranges-stats->largest_free)*100)/ranges):0;
+}
@@ -0,0 +1,86 @@
+//pbKit GPU memory pool (sub-allocates contiguous arenas, used by pb_mem_alloc)
+// This library is free software; you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as
+// published by the Free Software Foundation; either version 2.1 of the
+// License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, see <http://www.gnu.org/licenses/>
+
+#ifndef _PBPOOL_H_
+#define _PBPOOL_H_
+
+//Allocator core only: arenas are given by caller and fences are plain numbers,
+//so it doesn't depend on kernel or GPU and can be built on host for tests.
+//Metadata is kept apart from arenas (arenas are write-combined, never read them).
+//
+//Requests up to PB_POOL_SMALL_MAX bytes are served from slabs split in equal
+//chunks (size classes 64..2048 bytes), bigger ones are rounded to 4Kb pages and
+//taken first-fit from arenas free ranges (neighbour free ranges are merged).
+//Freed memory is only reused once the fence given at free time is reached.
+
+#include <stdint.h>
+
+#define PB_POOL_MAX_ARENAS      16
+#define PB_POOL_PAGE            4096
+#define PB_POOL_SLAB_SIZE       0x10000 //slabs are aligned on their size
+#define PB_POOL_SMALL_MIN       64
+#define PB_POOL_SMALL_MAX       2048
+#define PB_POOL_CLASSES         6   //64,128,256,512,1024,2048
+#define PB_POOL_HASH_SIZE       1024
+
+typedef struct pb_pool_block pb_pool_block_t;
+
+typedef struct
+{
+    uintptr_t   addr;
+    uint32_t    size;
+    uint32_t    fence;
+} pb_pool_pending_t;
+
+typedef struct
+{
+    uint32_t    arena_bytes;    //reserved by arenas
+    uint32_t    used_bytes;     //allocated (after rounding to size class or page)
+    uint32_t    pending_bytes;  //freed, but GPU may still use them
+    uint32_t    free_bytes;     //available (free ranges and free slab chunks)
+    uint32_t    largest_free;   //largest free range (biggest allocation possible without new arena)
+    uint32_t    fragmentation;  //percentage of free range bytes outside largest free range
+    uint32_t    allocations;    //live allocations
+    uint32_t    slabs;
+    uint32_t    failures;       //allocations that didn't fit in arenas
+} pb_pool_stats_t;
+
+typedef struct
+{
+    uintptr_t           arena_base[PB_POOL_MAX_ARENAS];
+    uint32_t            arena_size[PB_POOL_MAX_ARENAS];
+    int                 arena_count;
+
+    pb_pool_block_t     *ranges;    //free ranges, first-fit list
+    pb_pool_block_t     *slabs[PB_POOL_CLASSES];    //slabs with free chunks, per class
+    pb_pool_block_t     *hash[PB_POOL_HASH_SIZE];   //allocated ranges and slabs, by address
+
+    pb_pool_pending_t   *pending;   //fifo of deferred frees (fences are increasing)
+    uint32_t            pending_first;
+    uint32_t            pending_count;
+    uint32_t            pending_max;
+
+    pb_pool_stats_t     stats;
+} pb_pool_t;
+
+void        pb_pool_init(pb_pool_t *pool);
+void        pb_pool_destroy(pb_pool_t *pool);   //releases metadata (arenas belong to caller)
+int         pb_pool_add_arena(pb_pool_t *pool, uintptr_t base, uint32_t size);  //base page aligned, returns 0 if ok
+uintptr_t   pb_pool_alloc(pb_pool_t *pool, uint32_t size, uint32_t align);  //align is a power of 2, returns 0 if no room
+int         pb_pool_free(pb_pool_t *pool, uintptr_t addr, uint32_t fence);  //returns -1 if addr isn't allocated (or already freed)
+void        pb_pool_collect(pb_pool_t *pool, uint32_t reached); //reuses memory freed before fence reached
+int         pb_pool_oldest_fence(pb_pool_t *pool, uint32_t *fence); //returns 0 if nothing is pending
+void        pb_pool_get_stats(pb_pool_t *pool, pb_pool_stats_t *stats);
+
+#endif
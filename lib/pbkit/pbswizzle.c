@@ -0,0 +1,229 @@
+//pbKit texture swizzling (see pbswizzle.h)
+// This library is free software; you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as
+// published by the Free Software Foundation; either version 2.1 of the
+// License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, see <http://www.gnu.org/licenses/>
+
+#include "pbswizzle.h"
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+//Swizzled coordinates are stepped with (s-mask)&mask, which increments
+//the bits of s selected by mask as if they were contiguous.
+
+#define PB_SWIZZLE_LOOP(type)                                           \
+    for(y=0,ys=0;y<height;y++,ys=(ys-my)&my)                            \
+    {                                                                   \
+        const type *s=(const type *)((const uint8_t *)src+y*pitch);    \
+        type *d=(type *)dst+ys;                                         \
+        for(x=0,xs=0;x<width;x++,xs=(xs-mx)&mx) d[xs]=s[x];             \
+    }
+
+#define PB_UNSWIZZLE_LOOP(type)                                         \
+    for(y=0,ys=0;y<height;y++,ys=(ys-my)&my)                            \
+    {                                                                   \
+        const type *s=(const type *)src+ys;                             \
+        type *d=(type *)((uint8_t *)dst+y*pitch);                       \
+        for(x=0,xs=0;x<width;x++,xs=(xs-mx)&mx) d[x]=s[xs];             \
+    }
+
+#ifdef __SSE__
+
+//Swizzling walks the destination in order, 4x4 texels tile after tile, so each
+//64 bytes line is written completely before the next one (with non temporal
+//stores a partly written line would be flushed from write-combine buffers
+//several times). Tiles are in Morton order within the biggest square of tiles,
+//squares follow each other along the bigger dimension.
+
+//x (even bits) or y (odd bits) of a Morton index
+static uint32_t pb_morton_compact(uint32_t v)
+{
+    v&=0x55555555;
+    v=(v|(v>>1))&0x33333333;
+    v=(v|(v>>2))&0x0F0F0F0F;
+    v=(v|(v>>4))&0x00FF00FF;
+    v=(v|(v>>8))&0x0000FFFF;
+    return v;
+}
+
+//top left texel of tile i (width and height >= 4)
+static void pb_swizzle_tile(uint32_t i, uint32_t width, uint32_t height, uint32_t *x, uint32_t *y)
+{
+    uint32_t    side,square,t;
+
+    side=((width<height)?width:height)>>2; //square side in tiles
+    square=i/(side*side);
+    t=i&(side*side-1);
+    *x=pb_morton_compact(t)<<2;
+    *y=pb_morton_compact(t>>1)<<2;
+    if (width>height) *x+=square*side*4; else *y+=square*side*4;
+}
+
+//32 bits texels: a tile is a 64 bytes line of four 2x2 quads
+static void pb_swizzle32_sse(const uint8_t *src, uint32_t pitch, float *dst, uint32_t width, uint32_t height)
+{
+    uint32_t    i,x,y;
+    __m128      r0,r1,r2,r3;
+
+    for(i=0;i<width*height/16;i++,dst+=16)
+    {
+        pb_swizzle_tile(i,width,height,&x,&y);
+        r0=_mm_loadu_ps((const float *)(src+y*pitch)+x);
+        r1=_mm_loadu_ps((const float *)(src+(y+1)*pitch)+x);
+        r2=_mm_loadu_ps((const float *)(src+(y+2)*pitch)+x);
+        r3=_mm_loadu_ps((const float *)(src+(y+3)*pitch)+x);
+        _mm_stream_ps(dst,_mm_movelh_ps(r0,r1));
+        _mm_stream_ps(dst+4,_mm_movehl_ps(r1,r0));
+        _mm_stream_ps(dst+8,_mm_movelh_ps(r2,r3));
+        _mm_stream_ps(dst+12,_mm_movehl_ps(r3,r2));
+    }
+    _mm_sfence();
+}
+
+static void pb_unswizzle32_sse(const float *src, uint8_t *dst, uint32_t pitch, uint32_t width, uint32_t height, uint32_t mx, uint32_t my)
+{
+    uint32_t    x,y,xs,ys;
+    __m128      v;
+
+    mx&=~1;
+    my&=~2;
+    for(y=0,ys=0;y<height;y+=2,ys=(ys-my)&my)
+    {
+        float *r0=(float *)(dst+y*pitch);
+        float *r1=(float *)(dst+(y+1)*pitch);
+        const float *s=src+ys;
+        for(x=0,xs=0;x<width;x+=2,xs=(xs-mx)&mx)
+        {
+            v=_mm_load_ps(s+xs);
+            _mm_storel_pi((__m64 *)(r0+x),v);
+            _mm_storeh_pi((__m64 *)(r1+x),v);
+        }
+    }
+}
+
+//16 bits texels: a tile is 32 bytes (four 2x2 quads, texel pairs moved as 32 bits),
+//two tiles fill a 64 bytes line
+static void pb_swizzle16_sse(const uint8_t *src, uint32_t pitch, uint16_t *dst, uint32_t width, uint32_t height)
+{
+    uint32_t    i,x,y;
+    __m128      r0,r1,r2,r3;
+
+    for(i=0;i<width*height/16;i++,dst+=16)
+    {
+        pb_swizzle_tile(i,width,height,&x,&y);
+        r0=_mm_loadl_pi(_mm_setzero_ps(),(const __m64 *)((const uint16_t *)(src+y*pitch)+x));
+        r1=_mm_loadl_pi(_mm_setzero_ps(),(const __m64 *)((const uint16_t *)(src+(y+1)*pitch)+x));
+        r2=_mm_loadl_pi(_mm_setzero_ps(),(const __m64 *)((const uint16_t *)(src+(y+2)*pitch)+x));
+        r3=_mm_loadl_pi(_mm_setzero_ps(),(const __m64 *)((const uint16_t *)(src+(y+3)*pitch)+x));
+        _mm_stream_ps((float *)dst,_mm_unpacklo_ps(r0,r1));
+        _mm_stream_ps((float *)(dst+8),_mm_unpacklo_ps(r2,r3));
+    }
+    _mm_sfence();
+}
+
+static void pb_unswizzle16_sse(const uint16_t *src, uint8_t *dst, uint32_t pitch, uint32_t width, uint32_t height, uint32_t mx, uint32_t my)
+{
+    uint32_t    x,y,xs,ys;
+    __m128      v;
+
+    mx&=~5;
+    my&=~2;
+    for(y=0,ys=0;y<height;y+=2,ys=(ys-my)&my)
+    {
+        uint16_t *r0=(uint16_t *)(dst+y*pitch);
+        uint16_t *r1=(uint16_t *)(dst+(y+1)*pitch);
+        const uint16_t *s=src+ys;
+        for(x=0,xs=0;x<width;x+=4,xs=(xs-mx)&mx)
+        {
+            v=_mm_load_ps((const float *)(s+xs));
+            v=_mm_shuffle_ps(v,v,_MM_SHUFFLE(3,1,2,0));
+            _mm_storel_pi((__m64 *)(r0+x),v);
+            _mm_storeh_pi((__m64 *)(r1+x),v);
+        }
+    }
+}
+
+#endif
+
+void pb_swizzle_masks(uint32_t width, uint32_t height, uint32_t *mask_x, uint32_t *mask_y)
+{
+    uint32_t    i,bit;
+
+    *mask_x=0;
+    *mask_y=0;
+    for(i=1,bit=1;(i<width)||(i<height);i<<=1)
+    {
+        if (i<width) { *mask_x|=bit; bit<<=1; }
+        if (i<height) { *mask_y|=bit; bit<<=1; }
+    }
+}
+
+void pb_swizzle(const void *src, uint32_t pitch, void *dst, uint32_t width, uint32_t height, uint32_t bytes_per_texel)
+{
+    uint32_t    x,y,xs,ys,mx,my;
+
+    pb_swizzle_masks(width,height,&mx,&my);
+
+#ifdef __SSE__
+    if ((((uintptr_t)dst)&15)==0)
+    {
+        if ((bytes_per_texel==4)&&(width>=4)&&(height>=4))
+        {
+            pb_swizzle32_sse(src,pitch,dst,width,height);
+            return;
+        }
+        if ((bytes_per_texel==2)&&(width>=4)&&(height>=4))
+        {
+            pb_swizzle16_sse(src,pitch,dst,width,height);
+            return;
+        }
+    }
+#endif
+
+    switch(bytes_per_texel)
+    {
+        case 1: PB_SWIZZLE_LOOP(uint8_t); break;
+        case 2: PB_SWIZZLE_LOOP(uint16_t); break;
+        case 4: PB_SWIZZLE_LOOP(uint32_t); break;
+    }
+}
+
+void pb_unswizzle(const void *src, void *dst, uint32_t pitch, uint32_t width, uint32_t height, uint32_t bytes_per_texel)
+{
+    uint32_t    x,y,xs,ys,mx,my;
+
+    pb_swizzle_masks(width,height,&mx,&my);
+
+#ifdef __SSE__
+    if ((((uintptr_t)src)&15)==0)
+    {
+        if ((bytes_per_texel==4)&&(width>=2)&&(height>=2))
+        {
+            pb_unswizzle32_sse(src,dst,pitch,width,height,mx,my);
+            return;
+        }
+        if ((bytes_per_texel==2)&&(width>=4)&&(height>=2))
+        {
+            pb_unswizzle16_sse(src,dst,pitch,width,height,mx,my);
+            return;
+        }
+    }
+#endif
+
+    switch(bytes_per_texel)
+    {
+        case 1: PB_UNSWIZZLE_LOOP(uint8_t); break;
+        case 2: PB_UNSWIZZLE_LOOP(uint16_t); break;
+        case 4: PB_UNSWIZZLE_LOOP(uint32_t); break;
+    }
+}
@@ -0,0 +1,38 @@
+//pbKit texture swizzling (used by pb_texture_upload, free of kernel dependencies for host side tests)
+// This library is free software; you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as
+// published by the Free Software Foundation; either version 2.1 of the
+// License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, see <http://www.gnu.org/licenses/>
+
+#ifndef _PBSWIZZLE_H_
+#define _PBSWIZZLE_H_
+
+#include <stdint.h>
+
+//Swizzled (SZ_*) texture formats store texels in Morton order: texel address bits
+//alternate between x and y bits (x first) until the smaller dimension runs out,
+//remaining bits belong to the bigger dimension. Width and height are powers of 2.
+//
+//Texels are 1, 2 or 4 bytes. With SSE (-march=pentium3) 2 and 4 bytes texels are
+//moved 16 bytes at a time and swizzled data is written with non temporal stores,
+//one whole 64 bytes line after the other, so destination can be write-combined
+//memory (then it should be 16 bytes aligned, and textures at least 4x4).
+
+//swizzled address bits of x and y coordinates
+void    pb_swizzle_masks(uint32_t width, uint32_t height, uint32_t *mask_x, uint32_t *mask_y);
+
+//linear texture (pitch bytes per row) to swizzled texture
+void    pb_swizzle(const void *src, uint32_t pitch, void *dst, uint32_t width, uint32_t height, uint32_t bytes_per_texel);
+
+//swizzled texture to linear texture (pitch bytes per row)
+void    pb_unswizzle(const void *src, void *dst, uint32_t pitch, uint32_t width, uint32_t height, uint32_t bytes_per_texel);
+
+#endif
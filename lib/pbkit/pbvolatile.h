@@ -0,0 +1,47 @@
+//pbKit volatile methods (used by the shadow state and tools/pbstat, free of kernel dependencies for host side tools)
+// This library is free software; you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as
+// published by the Free Software Foundation; either version 2.1 of the
+// License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, see <http://www.gnu.org/licenses/>
+
+#ifndef _PBVOLATILE_H_
+#define _PBVOLATILE_H_
+
+#include <stdint.h>
+
+#include "nv_regs.h"
+
+//methods the shadow state never filters: triggers, data written at load pointers,
+//context Dma bindings (re-binding reloads the Dma object) and subprogram parameters
+static const uint32_t pb_VolatileRanges[][2]={
+    {0x00000000,0x00000000},                //SET_OBJECT
+    {NV097_NO_OPERATION,NV097_SET_CONTEXT_DMA_REPORT},
+    //offsets: memory behind them may have been rewritten since last write,
+    //resending them is what makes the GPU reload it (texture/surface caches)
+    {NV097_SET_SURFACE_COLOR_OFFSET,NV097_SET_SURFACE_ZETA_OFFSET},
+    {NV097_SET_TRANSFORM_PROGRAM,0x00000BFC},       //program and constants
+    {NV097_SET_VERTEX3F,0x0000171C},            //immediate mode vertices
+    {NV097_SET_VERTEX_DATA_ARRAY_OFFSET,0x0000175C},    //16 vertex array offsets
+    {NV097_CLEAR_REPORT_VALUE,NV097_CLEAR_REPORT_VALUE},
+    {NV097_GET_REPORT,NV097_GET_REPORT},
+    {NV097_SET_BEGIN_END,NV097_INLINE_ARRAY},
+    {NV097_SET_VERTEX_DATA2F_M,0x00001AFC},         //immediate mode vertex attributes
+    {NV097_SET_TEXTURE_OFFSET+0x00,NV097_SET_TEXTURE_OFFSET+0x00},  //texture offsets of the 4 stages
+    {NV097_SET_TEXTURE_OFFSET+0x40,NV097_SET_TEXTURE_OFFSET+0x40},
+    {NV097_SET_TEXTURE_OFFSET+0x80,NV097_SET_TEXTURE_OFFSET+0x80},
+    {NV097_SET_TEXTURE_OFFSET+0xC0,NV097_SET_TEXTURE_OFFSET+0xC0},
+    {NV097_SET_SEMAPHORE_OFFSET,NV097_BACK_END_WRITE_SEMAPHORE_RELEASE},
+    {NV097_SET_ZSTENCIL_CLEAR_VALUE,NV097_SET_CLEAR_RECT_VERTICAL}, //also PARAMETER_A & B
+    {NV097_SET_TRANSFORM_DATA,NV097_LAUNCH_TRANSFORM_PROGRAM},
+    {NV097_SET_TRANSFORM_PROGRAM_LOAD,NV097_SET_TRANSFORM_CONSTANT_LOAD},
+};
+
+#endif
@@ -91,7 +91,7 @@ int main(void)
     init_shader();
     init_textures();
 
-    alloc_vertices = MmAllocateContiguousMemoryEx(sizeof(vertices), 0, MAXRAM, 0, 0x404);
+    alloc_vertices = pb_mem_alloc(sizeof(vertices), PB_MEM_ALIGN_VERTEX);
     memcpy(alloc_vertices, vertices, sizeof(vertices));
     num_vertices = sizeof(vertices)/sizeof(vertices[0]);
     num_indices = sizeof(indices)/sizeof(indices[0]);
@@ -117,9 +117,8 @@ int main(void)
         pb_reset();
         pb_target_back_buffer();
 
-        /* Clear depth & stencil buffers */
-        pb_erase_depth_stencil_buffer(0, 0, width, height);
-        pb_fill(0, 0, width, height, 0xff202020);
+        /* Clear color, depth & stencil buffers */
+        pb_clear(NULL, 0, PB_CLEAR_COLOR | PB_CLEAR_DEPTH | PB_CLEAR_STENCIL, 0xff202020, 1.0f, 0);
         pb_erase_text_screen();
 
         /* Tilt and rotate the object a bit */
@@ -169,43 +168,22 @@ int main(void)
          * Check the intermediate file (*.inl) for the expected locations after
          * changing the code.
          */
-        p = pb_begin();
-
-        /* Set shader constants cursor at C0 */
-        p = pb_push1(p, NV20_TCL_PRIMITIVE_3D_VP_UPLOAD_CONST_ID, 96);
-
-        /* Send the model matrix */
-        pb_push(p++, NV20_TCL_PRIMITIVE_3D_VP_UPLOAD_CONST_X, 16);
-        memcpy(p, m_model, 16*4); p+=16;
-
-        /* Send the view matrix */
-        pb_push(p++, NV20_TCL_PRIMITIVE_3D_VP_UPLOAD_CONST_X, 16);
-        memcpy(p, m_view, 16*4); p+=16;
-
-        /* Send the projection matrix */
-        pb_push(p++, NV20_TCL_PRIMITIVE_3D_VP_UPLOAD_CONST_X, 16);
-        memcpy(p, m_proj, 16*4); p+=16;
-
-        /* Send camera position */
-        pb_push(p++, NV20_TCL_PRIMITIVE_3D_VP_UPLOAD_CONST_X, 4);
-        memcpy(p, v_cam_loc, 4*4); p+=4;
-
-        /* Send light position */
-        pb_push(p++, NV20_TCL_PRIMITIVE_3D_VP_UPLOAD_CONST_X, 4);
-        memcpy(p, v_light_pos, 4*4); p+=4;
-
-        /* Send light color */
-        pb_push(p++, NV20_TCL_PRIMITIVE_3D_VP_UPLOAD_CONST_X, 4);
-        memcpy(p, v_light_color, 4*4); p+=4;
-
-        /* Send ambient light intensity */
-        pb_push(p++, NV20_TCL_PRIMITIVE_3D_VP_UPLOAD_CONST_X, 4);
-        memcpy(p, &light_ambient, 4); p+=4;
-
-        /* Send shader constants 0 2 64 1 */
+        /* Set shader constants (only values that changed since last frame are
+         * sent, right before next draw). C0 is constant slot 96. */
+        pb_vs_const_set(96, m_model, 4);
+        pb_vs_const_set(100, m_view, 4);
+        pb_vs_const_set(104, m_proj, 4);
+        pb_vs_const_set(108, v_cam_loc, 1);
+        pb_vs_const_set(109, v_light_pos, 1);
+        pb_vs_const_set(110, v_light_color, 1);
+        float ambient[4] = {light_ambient, 0, 0, 0};
+        pb_vs_const_set(111, ambient, 1);
+
+        /* Set shader constants 0 2 64 1 */
         float constants_0[4] = {0, 2, 64, 1};
-        pb_push(p++, NV20_TCL_PRIMITIVE_3D_VP_UPLOAD_CONST_X, 4);
-        memcpy(p, constants_0, 4*4); p+=4;
+        pb_vs_const_set(112, constants_0, 1);
+
+        p = pb_begin();
 
         /* Clear all attributes */
         pb_push(p++,NV097_SET_VERTEX_DATA_ARRAY_FORMAT,16);
@@ -231,24 +209,25 @@ int main(void)
                            2, sizeof(Vertex), &alloc_vertices[6]);
 
         /* Begin drawing triangles */
+        pb_marker_begin("mesh");
         draw_indices();
+        pb_marker_end();
 
         /* Draw some text on the screen */
         pb_print("Mesh Demo\n");
         pb_print("Frames: %d\n", frames_total);
         if (fps > 0) {
-            pb_print("FPS: %d", fps);
+            pb_print("FPS: %d\n", fps);
         }
+        pb_marker_print();
         pb_draw_text_screen();
 
         while(pb_busy()) {
             /* Wait for completion... */
         }
 
-        /* Swap buffers (if we can) */
-        while (pb_finished()) {
-            /* Not ready to swap yet */
-        }
+        /* Swap buffers (waits for a free back buffer) */
+        pb_present(0xFFFFFFFF);
 
         frames++;
         frames_total++;
@@ -263,7 +242,7 @@ int main(void)
     }
 
     /* Unreachable cleanup code */
-    MmFreeContiguousMemory(alloc_vertices);
+    pb_mem_free(alloc_vertices);
     pb_show_debug_screen();
     pb_kill();
     return 0;
@@ -286,18 +265,15 @@ static void matrix_viewport(float out[4][4], float x, float y, float width, floa
 static void init_shader(void)
 {
     uint32_t *p;
-    int       i;
 
-    /* Setup vertex shader */
-    uint32_t vs_program[] = {
+    /* Setup vertex shader (pbkit uploads it again if it ever gets evicted) */
+    static const uint32_t vs_program[] = {
         #include "vs.inl"
     };
+    static pb_vs_program_t vs;
 
     p = pb_begin();
 
-    /* Set run address of shader */
-    p = pb_push1(p, NV097_SET_TRANSFORM_PROGRAM_START, 0);
-
     /* Set execution mode */
     p = pb_push1(p, NV097_SET_TRANSFORM_EXECUTION_MODE,
                  MASK(NV097_SET_TRANSFORM_EXECUTION_MODE_MODE, NV097_SET_TRANSFORM_EXECUTION_MODE_MODE_PROGRAM)
@@ -306,19 +282,9 @@ static void init_shader(void)
     p = pb_push1(p, NV097_SET_TRANSFORM_PROGRAM_CXT_WRITE_EN, 0);
     pb_end(p);
 
-    /* Set cursor and begin copying program */
-    p = pb_begin();
-    p = pb_push1(p, NV097_SET_TRANSFORM_PROGRAM_LOAD, 0);
-    pb_end(p);
-
-    /* Copy program instructions (16-bytes each) */
-    for (i=0; i<sizeof(vs_program)/16; i++) {
-        p = pb_begin();
-        pb_push(p++, NV097_SET_TRANSFORM_PROGRAM, 4);
-        memcpy(p, &vs_program[i*4], 4*4);
-        p+=4;
-        pb_end(p);
-    }
+    /* Upload program (16-bytes instructions) and set run address of shader */
+    pb_vs_program_init(&vs, (const DWORD *)vs_program, sizeof(vs_program)/16);
+    pb_vs_bind(&vs);
 
     /* Setup fragment shader */
     p = pb_begin();
@@ -332,7 +298,7 @@ static void init_textures(void)
     texture.width = texture_width;
     texture.height = texture_height;
     texture.pitch = texture.width*4;
-    texture.addr = MmAllocateContiguousMemoryEx(texture.pitch*texture.height, 0, MAXRAM, 0, 0x404);
+    texture.addr = pb_mem_alloc(texture.pitch*texture.height, PB_MEM_ALIGN_TEXTURE);
     memcpy(texture.addr, texture_rgba, sizeof(texture_rgba));
 }
 
@@ -351,30 +317,6 @@ static void set_attrib_pointer(unsigned int index, unsigned int format, unsigned
 /* Draw vertices using the index method */
 static void draw_indices(void)
 {
-    /* Indices are already packed as dwords, so we simply send them out in batches */
-    #define MIN(a,b) ((a)<(b)?(a):(b))
-    #define MAX_BATCH 120
-
-    uint32_t *p;
-    unsigned int i, num_this_batch;
-
-    for (i = 0; i < num_indices; ) {
-        /* Determine how many can be sent in this batch */
-        num_this_batch = MIN(MAX_BATCH, num_indices-i);
-
-        /* Begin by stating what these indices are and how many we'll send */
-        p = pb_begin();
-        p = pb_push1(p, NV097_SET_BEGIN_END, TRIANGLES);
-        pb_push(p++, 0x40000000|NV20_TCL_PRIMITIVE_3D_INDEX_DATA, num_this_batch);
-
-        /* Send the indices */
-        memcpy(p, &indices[i], num_this_batch * sizeof(uint32_t));
-        p += num_this_batch;
-
-        /* Finished with this batch */
-        p = pb_push1(p, NV097_SET_BEGIN_END, NV097_SET_BEGIN_END_OP_END);
-        pb_end(p);
-
-        i += num_this_batch;
-    }
+    /* Indices are already packed by pairs into dwords (first index in low half) */
+    pb_draw_indexed(TRIANGLES, (const uint16_t *)indices, num_indices * 2);
 }
@@ -83,9 +83,8 @@ int main(void)
         pb_reset();
         pb_target_back_buffer();
 
-        /* Clear depth & stencil buffers */
-        pb_erase_depth_stencil_buffer(0, 0, width, height);
-        pb_fill(0, 0, width, height, 0x00000000);
+        /* Clear color, depth & stencil buffers */
+        pb_clear(NULL, 0, PB_CLEAR_COLOR | PB_CLEAR_DEPTH | PB_CLEAR_STENCIL, 0x00000000, 1.0f, 0);
         pb_erase_text_screen();
 
         while(pb_busy()) {
@@ -0,0 +1,104 @@
+// Checks sample conversion (lib/hal/audioconv.c) against a scalar reference:
+// 8 bit mono and stereo, 16 bit mono and stereo, every source size up to
+// 200 bytes (so MMX blocks are followed by all possible tails), aligned and
+// unaligned sources, and nothing written after the converted samples.
+// Built twice by the Makefile: with MMX (conv) and without (convscalar).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <hal/audioconv.h>
+
+#ifdef __MMX__
+#define NAME    "conv (MMX)"
+#else
+#define NAME    "conv (scalar)"
+#endif
+
+#define MAX_BYTES   200
+#define GUARD       0x5A5A
+
+static int failures;
+
+static void check(int condition, const char *what, int bits, int channels, uint32_t bytes)
+{
+    if (!condition) {
+        if (failures++ < 10) {
+            printf("%s: FAIL %s (%d bits, %d channels, %u bytes)\n", NAME, what, bits, channels, bytes);
+        }
+    }
+}
+
+// returns number of 16 bit stereo samples
+static uint32_t reference(int16_t *dst, const uint8_t *src, uint32_t bytes, int bits, int channels)
+{
+    uint32_t count = (bits == 8) ? bytes : bytes / 2;
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        int16_t s;
+
+        if (bits == 8) {
+            s = (int16_t)((src[i] - 128) * 256);
+        } else {
+            s = (int16_t)(src[i * 2] | (src[i * 2 + 1] << 8));
+        }
+        dst[n++] = s;
+        if (channels == 1) {
+            dst[n++] = s;
+        }
+    }
+    return n;
+}
+
+static void run(int bits, int channels, uint32_t bytes, uint32_t offset)
+{
+    static uint8_t buffer[MAX_BYTES + 16];
+    static int16_t out[MAX_BYTES * 2 + 16];
+    static int16_t ref[MAX_BYTES * 2];
+    uint8_t *src = buffer + offset;
+    uint32_t size = XAudioConvertedSize(bytes, bits, channels);
+    uint32_t expected, converted;
+
+    for (uint32_t i = 0; i < bytes; i++) {
+        src[i] = (uint8_t)rand();
+    }
+    for (uint32_t i = 0; i < sizeof(out) / sizeof(out[0]); i++) {
+        out[i] = GUARD;
+    }
+
+    expected = reference(ref, src, bytes, bits, channels);
+    converted = XAudioConvert(out, src, bytes, bits, channels);
+
+    check(converted == expected, "wrong number of samples", bits, channels, bytes);
+    check(size == expected * 2, "XAudioConvertedSize doesn't match", bits, channels, bytes);
+    check(memcmp(out, ref, expected * 2) == 0, "samples differ from reference", bits, channels, bytes);
+    for (uint32_t i = expected; i < sizeof(out) / sizeof(out[0]); i++) {
+        check(out[i] == GUARD, "write past converted samples", bits, channels, bytes);
+    }
+}
+
+int main(void)
+{
+    srand(1);
+    for (int bits = 8; bits <= 16; bits += 8) {
+        for (int channels = 1; channels <= 2; channels++) {
+            for (uint32_t bytes = 0; bytes <= MAX_BYTES; bytes++) {
+                run(bits, channels, bytes, 0);
+                run(bits, channels, bytes, (bits == 8) ? 3 : 2);
+            }
+        }
+    }
+
+    check(XAudioConvertedSize(100, 24, 2) == 0, "24 bit samples accepted", 24, 2, 100);
+    check(XAudioConvertedSize(100, 16, 3) == 0, "3 channels accepted", 16, 3, 100);
+
+    if (failures) {
+        printf("%s: %d failures\n", NAME, failures);
+        return 1;
+    }
+    printf("%s: ok\n", NAME);
+    return 0;
+}
@@ -0,0 +1,149 @@
+// Benchmark of the software mixer (lib/hal/mixer.c): renders 8 seconds of
+// a mix of up to 32 voices (22.05kHz, 44.1kHz and 48kHz tones, mono and
+// stereo, full scale square waves included) into a WAV file to listen to,
+// and reports mixing speed in voices per ms: how many milliseconds of a
+// voice are mixed per millisecond of CPU time (the Xbox CPU is a lot
+// slower than a host one, compare results between builds).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#include <hal/mixer.h>
+
+#define SECONDS     8
+#define FRAMES      (XAUDIO_MIXER_RATE * SECONDS)
+#define RUNS        4
+
+static const unsigned int rates[] = { 22050, 44100, 48000 };
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void put16(FILE *f, unsigned int v)
+{
+    fputc(v & 0xFF, f);
+    fputc((v >> 8) & 0xFF, f);
+}
+
+static void put32(FILE *f, unsigned int v)
+{
+    put16(f, v & 0xFFFF);
+    put16(f, v >> 16);
+}
+
+static int write_wav(const char *path, const short *samples, unsigned int frames)
+{
+    FILE *f = fopen(path, "wb");
+
+    if (f == NULL) {
+        return -1;
+    }
+    fwrite("RIFF", 1, 4, f);
+    put32(f, 36 + frames * 4);
+    fwrite("WAVEfmt ", 1, 8, f);
+    put32(f, 16);
+    put16(f, 1);                        // PCM
+    put16(f, 2);
+    put32(f, XAUDIO_MIXER_RATE);
+    put32(f, XAUDIO_MIXER_RATE * 4);
+    put16(f, 4);
+    put16(f, 16);
+    fwrite("data", 1, 4, f);
+    put32(f, frames * 4);
+    for (unsigned int i = 0; i < frames * 2; i++) {
+        put16(f, (unsigned short)samples[i]);
+    }
+    return fclose(f);
+}
+
+// one second of a tone (square waves for every 4th voice)
+static short *make_voice(int n, unsigned int rate, int channels)
+{
+    short *s = malloc(rate * channels * sizeof(short));
+    double freq = 110.0 * pow(2.0, (n % 24) / 12.0);
+
+    if (s == NULL) {
+        return NULL;
+    }
+    for (unsigned int i = 0; i < rate; i++) {
+        double x = sin(i * 2 * M_PI * freq / rate);
+
+        if (n % 4 == 3) {
+            x = (x < 0) ? -1.0 : 1.0;
+        }
+        for (int c = 0; c < channels; c++) {
+            s[i * channels + c] = (short)(32767 * x * (c ? 0.5 : 1.0));
+        }
+    }
+    return s;
+}
+
+static void start_voices(XAUDIO_MIXER *mixer, short **sources, int voices)
+{
+    XAudioMixerReset(mixer);
+    for (int n = 0; n < voices; n++) {
+        unsigned int rate = rates[n % 3];
+        int channels = 1 + (n / 3) % 2;
+
+        // all voices together stay below saturation
+        XAudioMixerStart(mixer, sources[n], rate, channels, rate,
+                         XAUDIO_MIXER_VOLUME_MAX / XAUDIO_MIXER_VOICES, (n % 5 - 2) * 64, 1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = (argc > 1) ? argv[1] : "mix.wav";
+    static XAUDIO_MIXER mixer;
+    short *sources[XAUDIO_MIXER_VOICES];
+    short *out = malloc(FRAMES * 4);
+
+    if (out == NULL) {
+        fprintf(stderr, "mixbench: out of memory\n");
+        return 1;
+    }
+    for (int n = 0; n < XAUDIO_MIXER_VOICES; n++) {
+        sources[n] = make_voice(n, rates[n % 3], 1 + (n / 3) % 2);
+        if (sources[n] == NULL) {
+            fprintf(stderr, "mixbench: out of memory\n");
+            return 1;
+        }
+    }
+
+    for (int voices = 1; voices <= XAUDIO_MIXER_VOICES; voices *= 2) {
+        double start, elapsed;
+
+        start_voices(&mixer, sources, voices);
+        start = now();
+        for (int r = 0; r < RUNS; r++) {
+            XAudioMixerRender(&mixer, out, FRAMES);
+        }
+        elapsed = (now() - start) * 1000.0;
+
+        printf("mixbench: %2d voices: %7.2f ms per second of audio, %8.1f voices/ms\n", voices,
+               elapsed / (SECONDS * RUNS), (double)voices * SECONDS * 1000.0 * RUNS / elapsed);
+    }
+
+    // last run restarted from the beginning for the file
+    start_voices(&mixer, sources, XAUDIO_MIXER_VOICES);
+    XAudioMixerRender(&mixer, out, FRAMES);
+    if (write_wav(path, out, FRAMES) != 0) {
+        fprintf(stderr, "mixbench: can't write %s\n", path);
+        return 1;
+    }
+    printf("mixbench: %d voices mix written to %s\n", XAUDIO_MIXER_VOICES, path);
+
+    for (int n = 0; n < XAUDIO_MIXER_VOICES; n++) {
+        free(sources[n]);
+    }
+    free(out);
+    return 0;
+}
@@ -0,0 +1,202 @@
+// Benchmark of WAV decoding (lib/hal/wavdec.c): decodes 10 seconds of each
+// supported format (generated in memory, ADPCM blocks hold random codes) or
+// the WAV files given as arguments, and reports decoding time per second of
+// audio, as XAudioStreamGetStats does on the Xbox with decodeCost.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <hal/wavdec.h>
+
+#define SECONDS     10
+#define RUNS        4
+#define OUT_FRAMES  2048    // as the streaming player's buffers
+
+typedef struct {
+    const uint8_t *data;
+    uint32_t size;
+    uint32_t pos;
+} source_t;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const unsigned char *read_source(void *context, unsigned int size)
+{
+    source_t *source = context;
+    const uint8_t *data = source->data + source->pos;
+
+    if (source->size - source->pos < size) {
+        return NULL;
+    }
+    source->pos += size;
+    return data;
+}
+
+static void put16(uint8_t *p, uint32_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    put16(p, v & 0xFFFF);
+    put16(p + 2, v >> 16);
+}
+
+// WAV file of SECONDS seconds (whole blocks), its size goes into size
+static uint8_t *make_wav(int format, int channels, uint32_t rate, int bits, uint32_t block_align, uint32_t *size)
+{
+    uint32_t block_frames = (format == XAUDIO_WAV_PCM) ? 1 : 1 + (block_align / channels - 4) * 2;
+    uint32_t blocks = (rate * SECONDS + block_frames - 1) / block_frames;
+    uint32_t data_size = blocks * block_align;
+    uint8_t *wav = malloc(44 + data_size);
+
+    if (wav == NULL) {
+        return NULL;
+    }
+    memcpy(wav, "RIFF", 4);
+    put32(wav + 4, 36 + data_size);
+    memcpy(wav + 8, "WAVEfmt ", 8);
+    put32(wav + 16, 16);
+    put16(wav + 20, format);
+    put16(wav + 22, channels);
+    put32(wav + 24, rate);
+    put32(wav + 28, rate * block_align / block_frames);
+    put16(wav + 32, block_align);
+    put16(wav + 34, bits);
+    memcpy(wav + 36, "data", 4);
+    put32(wav + 40, data_size);
+
+    for (uint32_t i = 0; i < data_size; i++) {
+        wav[44 + i] = (uint8_t)rand();
+    }
+    // ADPCM block headers: first sample, step index, reserved byte
+    if (format != XAUDIO_WAV_PCM) {
+        for (uint32_t b = 0; b < blocks; b++) {
+            for (int c = 0; c < channels; c++) {
+                uint8_t *h = wav + 44 + b * block_align + c * 4;
+
+                h[2] = rand() % 89;
+                h[3] = 0;
+            }
+        }
+    }
+
+    *size = 44 + data_size;
+    return wav;
+}
+
+static uint8_t *load_wav(const char *path, uint32_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t *wav = NULL;
+    long length;
+
+    if (f == NULL) {
+        return NULL;
+    }
+    if ((fseek(f, 0, SEEK_END) == 0) && ((length = ftell(f)) > 0) && (fseek(f, 0, SEEK_SET) == 0)) {
+        wav = malloc(length);
+        if ((wav != NULL) && (fread(wav, 1, length, f) != (size_t)length)) {
+            free(wav);
+            wav = NULL;
+        }
+        *size = length;
+    }
+    fclose(f);
+    return wav;
+}
+
+static int bench(const char *name, const uint8_t *wav, uint32_t size)
+{
+    static XAUDIO_WAV_DECODER decoder;
+    static short out[OUT_FRAMES * 2];
+    source_t source;
+    uint64_t frames = 0;
+    double start, elapsed, seconds;
+    unsigned int n;
+
+    if (XAudioWavOpen(&decoder, wav, size) != 0) {
+        printf("wavbench: %s: not supported\n", name);
+        return -1;
+    }
+
+    start = now();
+    for (int r = 0; r < RUNS; r++) {
+        source.data = wav + decoder.dataOffset;
+        source.size = size - decoder.dataOffset;
+        source.pos = 0;
+        XAudioWavOpen(&decoder, wav, size);
+        do {
+            n = XAudioWavDecode(&decoder, out, OUT_FRAMES, read_source, &source);
+            frames += n;
+        } while (n == OUT_FRAMES);
+    }
+    elapsed = now() - start;
+    seconds = (double)frames / XAUDIO_WAV_RATE;
+
+    printf("wavbench: %-28s %7.1f us per second of audio (%6.0fx real time)\n", name,
+           elapsed * 1e6 / seconds, seconds / elapsed);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        int format, channels;
+        uint32_t rate;
+        int bits;
+        uint32_t block_align;
+    } formats[] = {
+        { "PCM 16 bit stereo 48kHz", XAUDIO_WAV_PCM, 2, 48000, 16, 4 },
+        { "PCM 16 bit stereo 44.1kHz", XAUDIO_WAV_PCM, 2, 44100, 16, 4 },
+        { "PCM 16 bit mono 22.05kHz", XAUDIO_WAV_PCM, 1, 22050, 16, 2 },
+        { "PCM 8 bit mono 22.05kHz", XAUDIO_WAV_PCM, 1, 22050, 8, 1 },
+        { "IMA ADPCM stereo 44.1kHz", XAUDIO_WAV_IMA_ADPCM, 2, 44100, 4, 2048 },
+        { "IMA ADPCM mono 22.05kHz", XAUDIO_WAV_IMA_ADPCM, 1, 22050, 4, 512 },
+        { "Xbox ADPCM stereo 48kHz", XAUDIO_WAV_XBOX_ADPCM, 2, 48000, 4, 72 },
+        { "Xbox ADPCM stereo 44.1kHz", XAUDIO_WAV_XBOX_ADPCM, 2, 44100, 4, 72 },
+    };
+    int result = 0;
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            uint32_t size;
+            uint8_t *wav = load_wav(argv[i], &size);
+
+            if (wav == NULL) {
+                fprintf(stderr, "wavbench: can't read %s\n", argv[i]);
+                return 1;
+            }
+            result |= bench(argv[i], wav, size);
+            free(wav);
+        }
+        return result ? 1 : 0;
+    }
+
+    srand(1);
+    for (uint32_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        uint32_t size;
+        uint8_t *wav = make_wav(formats[i].format, formats[i].channels, formats[i].rate,
+                                formats[i].bits, formats[i].block_align, &size);
+
+        if (wav == NULL) {
+            fprintf(stderr, "wavbench: out of memory\n");
+            return 1;
+        }
+        result |= bench(formats[i].name, wav, size);
+        free(wav);
+    }
+    return result ? 1 : 0;
+}
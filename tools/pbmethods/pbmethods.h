@@ -0,0 +1,21 @@
+// Method names of the 3D class, shared by pbstat and pbvalidate
+// (_methods.inl is generated from pbkit headers, see pbmethods.mk).
+
+#ifndef PBMETHODS_H
+#define PBMETHODS_H
+
+#include <stdint.h>
+
+typedef struct {
+    uint32_t method;
+    const char *name;
+} MethodName;
+
+// 3D class names first (nv_regs.h), renouveau names (nv_objects.h) after
+static const MethodName method_names[] = {
+#include "_methods.inl"
+};
+
+#define METHOD_NAME_COUNT (sizeof(method_names) / sizeof(method_names[0]))
+
+#endif
@@ -0,0 +1,9 @@
+# Method names of the 3D class, from pbkit headers (shared by pbstat and pbvalidate).
+# Including makefiles define PBKIT and depend on $(PBMETHODS_INL).
+
+PBMETHODS = $(dir $(lastword $(MAKEFILE_LIST)))
+PBMETHODS_INL = $(PBMETHODS)_methods.inl
+
+$(PBMETHODS_INL): $(PBKIT)/nv_regs.h $(PBKIT)/nv_objects.h
+	sed -n 's/^#   define \(NV097_[A-Z0-9_]*\) *\(0x[0-9A-Fa-f]*\)[[:space:]]*$$/{\2, "\1"},/p' $(PBKIT)/nv_regs.h > '$@'
+	sed -n 's/^#define \(NV20_TCL_PRIMITIVE_3D_[A-Za-z0-9_]*\)[[:space:]]*\(0x[0-9A-Fa-f]*\).*$$/{\2, "\1"},/p' $(PBKIT)/nv_objects.h >> '$@'
@@ -0,0 +1,421 @@
+// pbstat: decodes pbkit binary captures (see lib/pbkit/pbcapture.h) and
+// reports where push buffer bandwidth goes, frame by frame.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../../lib/pbkit/pbcapture.h"
+#include "../../lib/pbkit/pbvolatile.h"
+#include "pbmethods.h"
+
+
+#define METHOD_SLOTS    (2048 + 8) // 3D class methods, then one slot per other subchannel
+#define MAX_LARGEST     64
+
+typedef struct {
+    uint32_t address;
+    const uint32_t *words;
+    uint32_t count;
+} List;
+
+typedef struct {
+    long frame;
+    uint32_t dwords;
+} Block;
+
+typedef struct {
+    uint64_t dwords;
+    uint64_t blocks;
+    uint64_t packets;
+    uint64_t calls;
+    uint64_t jumps;
+    uint64_t malformed;
+    uint64_t draws;
+    uint64_t draw_dwords;     // dwords between end of previous draw and end of each draw
+    uint64_t max_draw_dwords;
+    uint64_t redundant;       // parameters rewritten with the value already in register
+    uint64_t writes[METHOD_SLOTS];
+} Stats;
+
+static List *lists;
+static int list_count;
+
+static uint32_t shadow[2048];
+static uint8_t shadow_valid[2048];
+static uint8_t is_volatile[2048];
+
+static MethodName *sorted_names; // method_names sorted by method
+
+static Stats frame_stats;
+static Stats total_stats;
+static long frame = -1; // blocks before first frame marker are initialization
+static uint64_t last_draw_end;
+
+static Block largest[MAX_LARGEST];
+static int largest_count;
+
+static int top = 10;
+static int summary_only = 0;
+
+
+static int compare_names(const void *a, const void *b)
+{
+    const MethodName *ma = a;
+    const MethodName *mb = b;
+    if (ma->method != mb->method) {
+        return (ma->method < mb->method) ? -1 : 1;
+    }
+    // keep table order (nv_regs.h names first) for identical methods
+    return (ma < mb) ? -1 : 1;
+}
+
+static void format_method(int slot, char *out, size_t size)
+{
+    if (slot >= 2048) {
+        snprintf(out, size, "subchannel %d", slot - 2048);
+        return;
+    }
+
+    uint32_t method = slot * 4;
+    int lo = 0, hi = (int)METHOD_NAME_COUNT - 1, best = -1;
+
+    // nearest name at or below method
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (sorted_names[mid].method <= method) {
+            best = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    while (best > 0 && sorted_names[best - 1].method == sorted_names[best].method) {
+        best--;
+    }
+
+    if (best < 0 || method - sorted_names[best].method >= 0x100) {
+        snprintf(out, size, "0x%04x", method);
+    } else if (sorted_names[best].method == method) {
+        snprintf(out, size, "0x%04x %s", method, sorted_names[best].name);
+    } else {
+        snprintf(out, size, "0x%04x %s+0x%x", method, sorted_names[best].name,
+                 method - sorted_names[best].method);
+    }
+}
+
+static const List *find_list(uint32_t address)
+{
+    for (int i = 0; i < list_count; i++) {
+        if (lists[i].address == address) {
+            return &lists[i];
+        }
+    }
+    return NULL;
+}
+
+static void write_method(uint32_t subchannel, uint32_t method, uint32_t value)
+{
+    if (subchannel != 0) {
+        frame_stats.writes[2048 + subchannel]++;
+        return;
+    }
+
+    uint32_t slot = method >> 2;
+    frame_stats.writes[slot]++;
+
+    if (!is_volatile[slot]) {
+        if (shadow_valid[slot] && shadow[slot] == value) {
+            frame_stats.redundant++;
+        }
+        shadow[slot] = value;
+        shadow_valid[slot] = 1;
+    }
+
+    if (method == 0x17FC && value == 0) { // SET_BEGIN_END(END)
+        uint64_t d = frame_stats.dwords - last_draw_end;
+        frame_stats.draws++;
+        frame_stats.draw_dwords += d;
+        if (d > frame_stats.max_draw_dwords) {
+            frame_stats.max_draw_dwords = d;
+        }
+        last_draw_end = frame_stats.dwords;
+    }
+}
+
+static void decode(const uint32_t *words, uint32_t count, int in_list)
+{
+    uint32_t i = 0;
+
+    while (i < count) {
+        uint32_t word = words[i++];
+        frame_stats.dwords++;
+
+        if ((word & 3) == 1) {
+            frame_stats.jumps++;
+        } else if ((word & 3) == 2) {
+            const List *list = find_list(word & ~3u);
+            frame_stats.calls++;
+            if (in_list || list == NULL) {
+                frame_stats.malformed++;
+            } else {
+                decode(list->words, list->count, 1);
+            }
+        } else if (word == 0x00020000) {
+            if (in_list) {
+                return;
+            }
+            frame_stats.malformed++;
+        } else if ((word & 0xE0030003) == 0 || (word & 0xE0030003) == 0x40000000) {
+            uint32_t n = (word >> 18) & 0x7FF;
+            uint32_t subchannel = (word >> 13) & 7;
+            uint32_t method = word & 0x1FFC;
+            int incrementing = (word & 0x40000000) == 0;
+
+            frame_stats.packets++;
+            if (n > count - i) {
+                frame_stats.malformed++;
+                n = count - i;
+            }
+            for (uint32_t j = 0; j < n; j++) {
+                frame_stats.dwords++;
+                write_method(subchannel, incrementing ? ((method + j * 4) & 0x1FFC) : method, words[i + j]);
+            }
+            i += n;
+        } else {
+            frame_stats.malformed++;
+        }
+    }
+}
+
+static void add_largest(uint32_t dwords)
+{
+    int i;
+
+    if (largest_count == top && (largest_count == 0 || largest[largest_count - 1].dwords >= dwords)) {
+        return;
+    }
+    if (largest_count < top) {
+        largest_count++;
+    }
+    for (i = largest_count - 1; i > 0 && largest[i - 1].dwords < dwords; i--) {
+        largest[i] = largest[i - 1];
+    }
+    largest[i].frame = frame;
+    largest[i].dwords = dwords;
+}
+
+static void print_histogram(const Stats *stats)
+{
+    char name[128];
+    uint8_t shown[METHOD_SLOTS] = { 0 };
+
+    for (int k = 0; k < top; k++) {
+        int best = -1;
+        for (int slot = 0; slot < METHOD_SLOTS; slot++) {
+            if (!shown[slot] && stats->writes[slot] &&
+                (best < 0 || stats->writes[slot] > stats->writes[best])) {
+                best = slot;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        shown[best] = 1;
+        format_method(best, name, sizeof(name));
+        printf("    %10llu  %s\n", (unsigned long long)stats->writes[best], name);
+    }
+}
+
+static void print_stats(const char *title, const Stats *stats)
+{
+    printf("%s: %llu dwords in %llu blocks, %llu packets, %llu calls",
+           title,
+           (unsigned long long)stats->dwords, (unsigned long long)stats->blocks,
+           (unsigned long long)stats->packets, (unsigned long long)stats->calls);
+    if (stats->jumps) {
+        printf(", %llu jumps", (unsigned long long)stats->jumps);
+    }
+    printf("\n");
+
+    if (stats->draws) {
+        printf("  %llu draws, %.1f dwords per draw (max %llu)\n",
+               (unsigned long long)stats->draws,
+               (double)stats->draw_dwords / stats->draws,
+               (unsigned long long)stats->max_draw_dwords);
+    }
+    printf("  %llu redundant state writes\n", (unsigned long long)stats->redundant);
+    if (stats->malformed) {
+        printf("  %llu malformed words (use pbvalidate)\n", (unsigned long long)stats->malformed);
+    }
+    print_histogram(stats);
+}
+
+static void end_frame(void)
+{
+    char title[64];
+
+    if (frame_stats.blocks) {
+        if (!summary_only) {
+            if (frame < 0) {
+                snprintf(title, sizeof(title), "init");
+            } else {
+                snprintf(title, sizeof(title), "frame %ld", frame);
+            }
+            print_stats(title, &frame_stats);
+        }
+
+        total_stats.dwords += frame_stats.dwords;
+        total_stats.blocks += frame_stats.blocks;
+        total_stats.packets += frame_stats.packets;
+        total_stats.calls += frame_stats.calls;
+        total_stats.jumps += frame_stats.jumps;
+        total_stats.malformed += frame_stats.malformed;
+        total_stats.draws += frame_stats.draws;
+        total_stats.draw_dwords += frame_stats.draw_dwords;
+        if (frame_stats.max_draw_dwords > total_stats.max_draw_dwords) {
+            total_stats.max_draw_dwords = frame_stats.max_draw_dwords;
+        }
+        total_stats.redundant += frame_stats.redundant;
+        for (int slot = 0; slot < METHOD_SLOTS; slot++) {
+            total_stats.writes[slot] += frame_stats.writes[slot];
+        }
+    }
+
+    memset(&frame_stats, 0, sizeof(frame_stats));
+    last_draw_end = 0;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-s] [-t count] capture\n", argv0);
+    fprintf(stderr, "  -s        only print summary of whole capture\n");
+    fprintf(stderr, "  -t count  number of methods and blocks listed (default 10)\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *filename = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0) {
+            summary_only = 1;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            top = atoi(argv[++i]);
+            if (top < 1) top = 1;
+            if (top > MAX_LARGEST) top = MAX_LARGEST;
+        } else if (argv[i][0] != '-' && filename == NULL) {
+            filename = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (filename == NULL) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Can't open %s\n", filename);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint32_t *data = malloc(size + 4);
+    uint32_t count = (uint32_t)(size / 4);
+    if (data == NULL || fread(data, 4, count, f) != count) {
+        fprintf(stderr, "Can't read %s\n", filename);
+        return 1;
+    }
+    fclose(f);
+
+    if (count < 2 || data[0] != PB_CAPTURE_MAGIC) {
+        fprintf(stderr, "%s isn't a pbkit capture\n", filename);
+        return 1;
+    }
+    if (data[1] != PB_CAPTURE_VERSION) {
+        fprintf(stderr, "%s: unsupported capture version %u\n", filename, data[1]);
+        return 1;
+    }
+
+    sorted_names = malloc(sizeof(method_names));
+    memcpy(sorted_names, method_names, sizeof(method_names));
+    qsort(sorted_names, METHOD_NAME_COUNT, sizeof(MethodName), compare_names);
+    for (size_t r = 0; r < sizeof(pb_VolatileRanges) / sizeof(pb_VolatileRanges[0]); r++) {
+        for (uint32_t m = pb_VolatileRanges[r][0]; m <= pb_VolatileRanges[r][1]; m += 4) {
+            is_volatile[m >> 2] = 1;
+        }
+    }
+
+    // display lists first, calls may come before their recording in file order
+    lists = malloc(sizeof(List) * (count / 3 + 1));
+    for (uint32_t i = 2; i + 2 <= count;) {
+        uint32_t tag = data[i];
+        uint32_t n = data[i + 1];
+        if (n > count - i - 2) {
+            break;
+        }
+        if (tag == PB_CAPTURE_LIST && n >= 1) {
+            // a list recorded again at same address replaces the old one
+            List *list = (List *)find_list(data[i + 2]);
+            if (list == NULL) {
+                list = &lists[list_count++];
+            }
+            list->address = data[i + 2];
+            list->words = &data[i + 3];
+            list->count = n - 1;
+        }
+        i += 2 + n;
+    }
+
+    for (uint32_t i = 2; i < count;) {
+        uint32_t tag = data[i];
+        uint32_t n = (i + 1 < count) ? data[i + 1] : 0;
+        if (i + 2 > count || n > count - i - 2) {
+            fprintf(stderr, "%s: truncated record at word %u\n", filename, i);
+            break;
+        }
+
+        switch (tag) {
+        case PB_CAPTURE_FRAME:
+            end_frame();
+            frame = (n >= 1) ? (long)data[i + 2] : frame + 1;
+            break;
+        case PB_CAPTURE_BLOCK:
+            frame_stats.blocks++;
+            add_largest(n);
+            decode(&data[i + 2], n, 0);
+            break;
+        case PB_CAPTURE_LIST:
+            break;
+        default:
+            fprintf(stderr, "%s: unknown record %u at word %u\n", filename, tag, i);
+            break;
+        }
+        i += 2 + n;
+    }
+    end_frame();
+
+    if (!summary_only) {
+        printf("\n");
+    }
+    print_stats("total", &total_stats);
+
+    printf("\nlargest blocks:\n");
+    for (int i = 0; i < largest_count; i++) {
+        if (largest[i].frame < 0) {
+            printf("    %10u  init\n", largest[i].dwords);
+        } else {
+            printf("    %10u  frame %ld\n", largest[i].dwords, largest[i].frame);
+        }
+    }
+
+    free(sorted_names);
+    free(lists);
+    free(data);
+    return 0;
+}
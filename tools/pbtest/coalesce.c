@@ -0,0 +1,159 @@
+// Checks coalescing of adjacent register writes (lib/pbkit/pbpacket.h): random
+// sequences of writes are encoded with and without it, then both streams are
+// decoded into (subchannel, register, value) writes, which must be the same.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "pbpacket.h"
+
+#define WRITES      4096
+#define STREAM_SIZE (WRITES * 5)
+
+typedef struct {
+    uint32_t subchannel;
+    uint32_t method;
+    uint32_t value;
+} Write;
+
+static uint32_t merged[STREAM_SIZE];
+static uint32_t unmerged[STREAM_SIZE];
+static Write merged_writes[WRITES * 4];
+static Write unmerged_writes[WRITES * 4];
+
+static int failures;
+
+static void check(int condition, const char *what, int seed)
+{
+    if (!condition) {
+        if (failures++ < 10) {
+            printf("coalesce: FAIL %s (seed %d)\n", what, seed);
+        }
+    }
+}
+
+// returns number of writes, *headers is set to number of packets
+static uint32_t decode(const uint32_t *words, uint32_t count, Write *writes, uint32_t *headers)
+{
+    uint32_t n = 0;
+
+    *headers = 0;
+    for (uint32_t i = 0; i < count;) {
+        uint32_t header = words[i++];
+        uint32_t params = (header >> 18) & 0x7FF;
+        uint32_t subchannel = (header >> 13) & 7;
+        uint32_t method = header & 0x1FFC;
+
+        (*headers)++;
+        for (uint32_t j = 0; j < params && i < count; j++) {
+            writes[n].subchannel = subchannel;
+            writes[n].method = (header & PB_PACKET_NONINC) ? method : method + j * 4;
+            writes[n].value = words[i++];
+            n++;
+        }
+    }
+    return n;
+}
+
+// same pb_packet_append/pb_packet_start sequence as pb_push_header
+static uint32_t *push(pb_packet_t *packet, int grow, uint32_t *p, uint32_t subchannel, uint32_t method,
+                      uint32_t nparam, const uint32_t *params)
+{
+    if (!pb_packet_append(packet, p, subchannel, method, nparam)) {
+        p = pb_packet_start(packet, grow, p, subchannel, method, nparam);
+    }
+    for (uint32_t i = 0; i < nparam; i++) {
+        *p++ = params[i];
+    }
+    return p;
+}
+
+static void run(int seed)
+{
+    pb_packet_t merged_packet = { NULL }, unmerged_packet = { NULL };
+    uint32_t *m = merged, *u = unmerged;
+    uint32_t method = 0x0300;
+    uint32_t merged_count, unmerged_count, merged_headers, unmerged_headers;
+
+    srand(seed);
+    for (int i = 0; i < WRITES; i++) {
+        uint32_t subchannel = (rand() % 8 == 0) ? 1 : 0;
+        uint32_t nparam = 1 + rand() % 4;
+        uint32_t params[4];
+        int r = rand() % 16;
+
+        // mostly writes following previous one, as state setting code does
+        if (r == 0) {
+            method = 0x0100 + 4 * (rand() % 0x700);
+        } else if (r == 1) {
+            method = (method - 8) & 0x1FFC;
+        }
+        if (method + nparam * 4 > 0x2000) {
+            method = 0x0100;
+        }
+        if (rand() % 32 == 0) {
+            method |= PB_PACKET_NONINC;
+        }
+        if (rand() % 64 == 0) {
+            // pb_begin/pb_end/pb_push_to: previous packet can't grow
+            merged_packet.head = NULL;
+            unmerged_packet.head = NULL;
+        }
+
+        for (uint32_t j = 0; j < nparam; j++) {
+            params[j] = (uint32_t)rand();
+        }
+        m = push(&merged_packet, 1, m, subchannel, method, nparam, params);
+        u = push(&unmerged_packet, 0, u, subchannel, method, nparam, params);
+
+        method = (method & 0x1FFC) + ((method & PB_PACKET_NONINC) ? 4 : nparam * 4);
+        method &= 0x1FFC;
+    }
+
+    merged_count = decode(merged, m - merged, merged_writes, &merged_headers);
+    unmerged_count = decode(unmerged, u - unmerged, unmerged_writes, &unmerged_headers);
+
+    check(unmerged_headers == WRITES, "unmerged stream has one header per push", seed);
+    check(merged_count == unmerged_count, "writes count differs", seed);
+    for (uint32_t i = 0; i < merged_count && i < unmerged_count; i++) {
+        check(merged_writes[i].subchannel == unmerged_writes[i].subchannel &&
+              merged_writes[i].method == unmerged_writes[i].method &&
+              merged_writes[i].value == unmerged_writes[i].value, "writes differ", seed);
+    }
+    check((uint32_t)(u - unmerged) - (uint32_t)(m - merged) == unmerged_headers - merged_headers,
+          "stream shrinks by more than removed headers", seed);
+    check(merged_headers < unmerged_headers / 2, "adjacent writes weren't merged", seed);
+}
+
+// packets stop growing at PB_PACKET_MAX_PARAMS parameters
+static void run_limit(void)
+{
+    static uint32_t stream[2048 + 16];
+    pb_packet_t packet = { NULL };
+    uint32_t params[4] = { 1, 2, 3, 4 };
+    uint32_t *p = stream;
+
+    for (uint32_t method = 0; method < 0x2000; method += 16) {
+        p = push(&packet, 1, p, 0, method, 4, params);
+    }
+
+    check(((stream[0] >> 18) & 0x7FF) == 2044, "first packet size", 0);
+    check(stream[2045] == pb_packet_encode(0, 0x1FF0, 4), "second packet header", 0);
+    check(p == stream + 2048 + 2, "stream size", 0);
+}
+
+int main(void)
+{
+    for (int seed = 1; seed <= 64; seed++) {
+        run(seed);
+    }
+    run_limit();
+
+    if (failures) {
+        printf("coalesce: %d failures\n", failures);
+        return 1;
+    }
+    printf("coalesce: ok\n");
+    return 0;
+}
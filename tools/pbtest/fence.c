@@ -0,0 +1,129 @@
+// Checks fence bookkeeping (lib/pbkit/pbfence.h) against a simulated GPU:
+// a command stream with semaphore releases, consumed by a GET pointer
+// advancing at random, while the CPU recycles per frame buffers.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "pbfence.h"
+
+#define COMMANDS        100000
+#define FRAMES_IN_FLIGHT 3
+
+typedef struct {
+    int release;        // 1: semaphore release of value, 0: other work
+    uint32_t value;
+} Command;
+
+static Command stream[COMMANDS];
+static unsigned int put;        // commands written by CPU
+static unsigned int get;        // commands executed by simulated GPU
+static uint32_t semaphore;      // last value released
+
+static uint32_t fence_value[COMMANDS];
+static unsigned int fence_pos[COMMANDS];
+static unsigned int fence_count;
+
+static int failures;
+
+static void check(int condition, const char *what, uint32_t value)
+{
+    if (!condition) {
+        if (failures++ < 10) {
+            printf("fence: FAIL %s (0x%08X)\n", what, value);
+        }
+    }
+}
+
+static void gpu_step(unsigned int n)
+{
+    while (n-- && get < put) {
+        if (stream[get].release) {
+            semaphore = stream[get].value;
+        }
+        get++;
+    }
+}
+
+static uint32_t insert(uint32_t *counter)
+{
+    uint32_t fence = pb_fence_next(counter);
+
+    stream[put].release = 1;
+    stream[put].value = fence;
+    fence_value[fence_count] = fence;
+    fence_pos[fence_count++] = put++;
+    return fence;
+}
+
+static void check_all(uint32_t counter)
+{
+    for (unsigned int i = 0; i < fence_count; i++) {
+        check(pb_fence_passed(semaphore, fence_value[i]) == (fence_pos[i] < get),
+              "reached state differs from GET position", fence_value[i]);
+        check(pb_fence_inserted(counter, fence_value[i]), "inserted fence not seen as inserted", fence_value[i]);
+    }
+    for (uint32_t i = 1; i < 8; i++) {
+        check(!pb_fence_inserted(counter, counter + i), "future fence seen as inserted", counter + i);
+        check(!pb_fence_passed(semaphore, counter + i), "future fence seen as reached", counter + i);
+    }
+}
+
+static void run(uint32_t start)
+{
+    uint32_t counter = start;
+    uint32_t frame_fence[FRAMES_IN_FLIGHT];
+    unsigned int frame_end[FRAMES_IN_FLIGHT];
+    int frame_used[FRAMES_IN_FLIGHT] = { 0 };
+    unsigned int frame = 0;
+
+    put = get = fence_count = 0;
+    semaphore = start;
+
+    while (put + 64 < COMMANDS) {
+        int slot = frame % FRAMES_IN_FLIGHT;
+
+        // buffer of this slot can only be rewritten once its fence is reached
+        if (frame_used[slot]) {
+            while (!pb_fence_passed(semaphore, frame_fence[slot])) {
+                gpu_step(rand() % 8);
+            }
+            check(get > frame_end[slot], "buffer recycled while GPU still uses it", frame_fence[slot]);
+        }
+
+        // frame work, with a few extra fences in the middle
+        for (int n = 1 + rand() % 40; n > 0; n--) {
+            stream[put].release = 0;
+            put++;
+            if (rand() % 16 == 0) {
+                insert(&counter);
+            }
+            gpu_step(rand() % 3);
+        }
+        frame_end[slot] = put - 1;
+        frame_fence[slot] = insert(&counter);
+        frame_used[slot] = 1;
+        frame++;
+
+        check_all(counter);
+    }
+
+    gpu_step(COMMANDS);
+    check_all(counter);
+    check(semaphore == counter, "last fence not reached after GPU drained", semaphore);
+}
+
+int main(void)
+{
+    srand(1);
+    run(0);
+    run(0xFFFFFF00); // counter wraps around during the run
+
+    if (failures) {
+        printf("fence: %d failures\n", failures);
+        return 1;
+    }
+    printf("fence: ok\n");
+    return 0;
+}
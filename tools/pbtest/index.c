@@ -0,0 +1,67 @@
+// Checks packing of 16 bit indices for ARRAY_ELEMENT16 (lib/pbkit/pbindex.h):
+// unpacking the dwords gives the indices back, in order, and nothing is
+// written after the returned pointer.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "pbindex.h"
+
+#define MAX_COUNT   1000
+#define GUARD       0xDEADBEEF
+
+static int failures;
+
+static void check(int condition, const char *what, uint32_t count)
+{
+    if (!condition) {
+        if (failures++ < 10) {
+            printf("index: FAIL %s (count %u)\n", what, count);
+        }
+    }
+}
+
+static void run(uint32_t count, uint32_t offset)
+{
+    static uint16_t buffer[MAX_COUNT + 2];
+    static uint32_t packed[MAX_COUNT / 2 + 8];
+    uint16_t *indices = buffer + offset; // odd offset: indices not 4 byte aligned
+    uint32_t size = pb_packed_indices16_size(count);
+    uint32_t *end;
+
+    for (uint32_t i = 0; i < count; i++) {
+        indices[i] = (uint16_t)rand();
+    }
+    for (uint32_t i = 0; i < sizeof(packed) / sizeof(packed[0]); i++) {
+        packed[i] = GUARD;
+    }
+
+    end = pb_pack_indices16(packed, indices, count);
+
+    check(size == count / 2, "size isn't count/2", count);
+    check(end == packed + size, "returned pointer doesn't match size", count);
+    for (uint32_t i = 0; i < size; i++) {
+        check((packed[i] & 0xFFFF) == indices[i * 2], "first index of pair isn't in low half", count);
+        check((packed[i] >> 16) == indices[i * 2 + 1], "second index of pair isn't in high half", count);
+    }
+    for (uint32_t i = size; i < sizeof(packed) / sizeof(packed[0]); i++) {
+        check(packed[i] == GUARD, "write past returned pointer", count);
+    }
+}
+
+int main(void)
+{
+    srand(1);
+    for (uint32_t count = 0; count <= MAX_COUNT; count++) {
+        run(count, 0);
+        run(count, 1);
+    }
+
+    if (failures) {
+        printf("index: %d failures\n", failures);
+        return 1;
+    }
+    printf("index: ok\n");
+    return 0;
+}
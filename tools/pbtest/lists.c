@@ -0,0 +1,218 @@
+// Benchmark of display list recording by worker threads (see pb_list_begin):
+// each thread records its own lists with per thread block state, then lists
+// are called from a push buffer in a fixed order. Output is decoded method
+// by method and checked to be the same whatever the threads count.
+//
+// This is a model of pbkit's recording, not pbkit itself: pb_list_* need the
+// kernel and the GPU, so List, push and list_begin_block stand for them here.
+// Packets are built with pbpacket.h, the header pbkit.c uses, and the block
+// state is per thread as pb_Recording and pb_Packet are.
+//
+// usage: lists [max threads]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "pbpacket.h"
+
+#define LISTS           64
+#define BLOCKS          2000    // per list
+#define BLOCK_DWORDS    128
+#define LIST_DWORDS     (BLOCKS * BLOCK_DWORDS + BLOCK_DWORDS + 1)
+#define SUBCH_3D        0
+#define PB_RETURN       0x00020000
+
+typedef struct {
+    uint32_t *start;
+    uint32_t *put;
+    uint32_t *limit;
+} List;
+
+static uint32_t *arena;         // all lists, offsets in it stand for GPU addresses
+static List lists[LISTS];
+static uint32_t pushbuffer[LISTS];
+
+// per thread block state, like pb_Recording and pb_Packet in pbkit.c
+static __thread List *recording;
+static __thread pb_packet_t packet;
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    int count;
+} Worker;
+
+static uint32_t *list_begin_block(void)
+{
+    return recording->put;
+}
+
+static void list_end_block(uint32_t *p)
+{
+    recording->put = p;
+    packet.head = NULL;
+}
+
+static uint32_t *push(uint32_t *p, uint32_t method, uint32_t nparam, const uint32_t *params)
+{
+    if (!pb_packet_append(&packet, p, SUBCH_3D, method, nparam)) {
+        p = pb_packet_start(&packet, 1, p, SUBCH_3D, method, nparam);
+    }
+    for (uint32_t i = 0; i < nparam; i++) {
+        *p++ = params[i];
+    }
+    return p;
+}
+
+// records a list of draws: state setting (mostly adjacent registers) and inline vertices
+static void record(List *list, uint32_t seed)
+{
+    recording = list;
+    list->put = list->start;
+
+    for (int b = 0; b < BLOCKS; b++) {
+        uint32_t *p = list_begin_block();
+        uint32_t params[4];
+
+        for (int s = 0; s < 8; s++) {
+            uint32_t method = 0x1B00 + 0x40 * (s & 3);
+            for (int j = 0; j < 4; j++) {
+                seed = seed * 1103515245 + 12345;
+                params[j] = seed >> 8;
+            }
+            p = push(p, method, 4, params);
+            p = push(p, method + 16, 2, params);
+        }
+        params[0] = 5; // triangles
+        p = push(p, 0x17FC, 1, params);
+        for (int v = 0; v < 12; v++) {
+            params[0] = seed + v;
+            p = push(p, 0x1818 | PB_PACKET_NONINC, 1, params);
+        }
+        params[0] = 0;
+        p = push(p, 0x17FC, 1, params);
+
+        list_end_block(p);
+    }
+
+    *list->put++ = PB_RETURN;
+    recording = NULL;
+}
+
+static void *worker(void *context)
+{
+    Worker *w = context;
+
+    for (int i = w->index; i < LISTS; i += w->count) {
+        record(&lists[i], (uint32_t)i * 7919);
+    }
+    return NULL;
+}
+
+// follows calls of push buffer and decodes method headers (parameters are
+// skipped, whatever their value), returns hash of all words GPU would read
+// or 0 if a list isn't made of well formed packets ending with its return
+static uint32_t replay(void)
+{
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < LISTS; i++) {
+        const uint32_t *p = arena + (pushbuffer[i] & ~3u) / 4;
+        const uint32_t *end = lists[i].put;
+
+        while (p < end && *p != PB_RETURN) {
+            uint32_t n = (*p >> 18) & 0x7FF;
+
+            // only increasing and non increasing method headers are recorded
+            if ((*p & 0xA0030003) != 0 || n == 0 || n >= (uint32_t)(end - p)) {
+                return 0;
+            }
+            for (uint32_t j = 0; j <= n; j++) {
+                hash = (hash ^ p[j]) * 16777619u;
+            }
+            p += 1 + n;
+        }
+        if (p != end - 1) {
+            return 0; // return missing, or not last word of list
+        }
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    int max_threads = (argc > 1) ? atoi(argv[1]) : 4;
+    uint32_t reference = 0;
+    Worker workers[64];
+
+    if (max_threads < 1 || max_threads > 64) {
+        fprintf(stderr, "usage: lists [max threads (1-64)]\n");
+        return 1;
+    }
+
+    arena = malloc(sizeof(uint32_t) * LIST_DWORDS * LISTS);
+    if (arena == NULL) {
+        fprintf(stderr, "lists: out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < LISTS; i++) {
+        lists[i].start = arena + i * LIST_DWORDS;
+        lists[i].limit = lists[i].start + BLOCKS * BLOCK_DWORDS;
+    }
+
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double start, elapsed;
+        uint64_t bytes = 0;
+        uint32_t hash;
+
+        memset(arena, 0, sizeof(uint32_t) * LIST_DWORDS * LISTS);
+
+        start = now();
+        for (int t = 0; t < threads; t++) {
+            workers[t].index = t;
+            workers[t].count = threads;
+            pthread_create(&workers[t].thread, NULL, worker, &workers[t]);
+        }
+        for (int t = 0; t < threads; t++) {
+            pthread_join(workers[t].thread, NULL);
+        }
+        elapsed = now() - start;
+
+        // render thread calls lists in a fixed order, whatever thread recorded them
+        for (int i = 0; i < LISTS; i++) {
+            pushbuffer[i] = (uint32_t)((lists[i].start - arena) * 4) | 2;
+            bytes += (lists[i].put - lists[i].start) * 4;
+        }
+
+        hash = replay();
+        if (hash == 0) {
+            printf("lists: %2d threads: malformed list\n", threads);
+            return 1;
+        }
+        if (threads == 1) {
+            reference = hash;
+        }
+
+        printf("lists: %2d threads %4d lists %8.1f MB/s %8.2f ms %s\n", threads, LISTS,
+               bytes / elapsed / 1e6, elapsed * 1000, (hash == reference) ? "ok" : "MISMATCH");
+        if (hash != reference) {
+            return 1;
+        }
+    }
+
+    free(arena);
+    return 0;
+}
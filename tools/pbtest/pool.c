@@ -0,0 +1,154 @@
+// Checks the GPU memory pool allocator (lib/pbkit/pbpool.c) with random
+// allocations and fenced frees: live allocations never overlap, memory is
+// only reused once its fence is reached, double frees are refused and
+// statistics account for every arena byte.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "pbpool.h"
+
+#define ARENA_SIZE  (4 * 1024 * 1024)
+#define MAX_LIVE    2000
+#define STEPS       200000
+
+typedef struct {
+    uintptr_t addr;
+    uint32_t size;
+    uint32_t fence;     // pending: fence given at free time
+} Allocation;
+
+static Allocation live[MAX_LIVE];
+static int live_count;
+static Allocation pending[STEPS];
+static int pending_first, pending_count;
+
+static int failures;
+
+static void check(int condition, const char *what, uintptr_t addr)
+{
+    if (!condition) {
+        if (failures++ < 10) {
+            printf("pool: FAIL %s (0x%lx)\n", what, (unsigned long)addr);
+        }
+    }
+}
+
+static int overlaps(uintptr_t addr, uint32_t size, const Allocation *a)
+{
+    return addr < a->addr + a->size && a->addr < addr + size;
+}
+
+static void check_stats(pb_pool_t *pool)
+{
+    pb_pool_stats_t stats;
+
+    pb_pool_get_stats(pool, &stats);
+    check(stats.used_bytes + stats.pending_bytes + stats.free_bytes == stats.arena_bytes,
+          "used, pending and free bytes don't add up to arenas", stats.arena_bytes);
+    check(stats.allocations == (uint32_t)(live_count + pending_count), "allocations count", stats.allocations);
+}
+
+static void collect(pb_pool_t *pool, uint32_t reached)
+{
+    pb_pool_collect(pool, reached);
+    while (pending_count && (int32_t)(reached - pending[pending_first].fence) >= 0) {
+        pending_first++;
+        pending_count--;
+    }
+}
+
+static void run(uint32_t start_fence)
+{
+    pb_pool_t pool;
+    uintptr_t bases[2] = { 0x10000000, 0x20000000 };
+    uint32_t fence = start_fence, reached = start_fence;
+
+    live_count = pending_first = pending_count = 0;
+
+    pb_pool_init(&pool);
+    check(pb_pool_add_arena(&pool, bases[0], ARENA_SIZE) == 0, "add arena", bases[0]);
+    check(pb_pool_add_arena(&pool, bases[1], ARENA_SIZE / 2) == 0, "add arena", bases[1]);
+    check(pb_pool_add_arena(&pool, bases[1] + 1, ARENA_SIZE) != 0, "unaligned arena accepted", bases[1] + 1);
+    check(pb_pool_free(&pool, bases[0], fence) != 0, "free of unallocated address accepted", bases[0]);
+
+    for (int step = 0; step < STEPS; step++) {
+        int r = rand() % 100;
+
+        if (r < 50 && live_count < MAX_LIVE) {
+            uint32_t size = (rand() % 4) ? 1 + rand() % PB_POOL_SMALL_MAX : 1 + rand() % (64 * 1024);
+            uint32_t align = 1u << (rand() % 13);
+            uintptr_t addr = pb_pool_alloc(&pool, size, align);
+
+            if (addr == 0) {
+                continue; // full: frees will make room
+            }
+            check((addr & (align - 1)) == 0, "misaligned allocation", addr);
+            check((addr >= bases[0] && addr + size <= bases[0] + ARENA_SIZE) ||
+                  (addr >= bases[1] && addr + size <= bases[1] + ARENA_SIZE / 2), "allocation out of arenas", addr);
+            for (int i = 0; i < live_count; i++) {
+                check(!overlaps(addr, size, &live[i]), "allocation overlaps a live one", addr);
+            }
+            for (int i = 0; i < pending_count; i++) {
+                check(!overlaps(addr, size, &pending[pending_first + i]), "pending memory reused before its fence", addr);
+            }
+            live[live_count].addr = addr;
+            live[live_count].size = size;
+            live_count++;
+        } else if (r < 90 && live_count) {
+            int i = rand() % live_count;
+
+            // GPU may use it until commands queued so far are executed
+            check(pb_pool_free(&pool, live[i].addr, fence + 1) == 0, "free refused", live[i].addr);
+            check(pb_pool_free(&pool, live[i].addr, fence + 1) != 0, "double free accepted", live[i].addr);
+            pending[pending_first + pending_count] = live[i];
+            pending[pending_first + pending_count].fence = fence + 1;
+            pending_count++;
+            live[i] = live[--live_count];
+        } else if (r < 95) {
+            fence++; // fence inserted
+        } else if (reached != fence) {
+            reached += 1 + rand() % (fence - reached); // GPU progress
+            collect(&pool, reached);
+        }
+
+        if (step % 1000 == 0) {
+            check_stats(&pool);
+        }
+    }
+
+    // a pending address freed again after release is refused too
+    if (pending_count) {
+        Allocation a = pending[pending_first + pending_count - 1];
+        collect(&pool, fence + 1);
+        check(pb_pool_free(&pool, a.addr, fence + 2) != 0, "free of released address accepted", a.addr);
+    }
+
+    while (live_count) {
+        check(pb_pool_free(&pool, live[live_count - 1].addr, fence + 1) == 0, "free refused", live[live_count - 1].addr);
+        live_count--;
+    }
+    collect(&pool, fence + 1);
+    check_stats(&pool);
+
+    pb_pool_stats_t stats;
+    pb_pool_get_stats(&pool, &stats);
+    check(stats.used_bytes == 0 && stats.pending_bytes == 0, "memory left allocated", stats.used_bytes);
+
+    pb_pool_destroy(&pool);
+}
+
+int main(void)
+{
+    srand(1);
+    run(0);
+    run(0xFFFFF000); // fences wrap around
+
+    if (failures) {
+        printf("pool: %d failures\n", failures);
+        return 1;
+    }
+    printf("pool: ok\n");
+    return 0;
+}
@@ -0,0 +1,102 @@
+// Checks texture swizzling (lib/pbkit/pbswizzle.c) against a reference that
+// interleaves coordinate bits one by one. Aligned buffers take the SSE paths,
+// buffers offset by a few bytes the scalar ones.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pbswizzle.h"
+
+#define MAX_SIZE    256
+#define MAX_BYTES   (MAX_SIZE * MAX_SIZE * 4)
+
+static uint8_t linear[MAX_BYTES * 2];
+static uint8_t expected[MAX_BYTES + 64];
+static uint8_t swizzled[MAX_BYTES + 64];
+static uint8_t unswizzled[MAX_BYTES * 2];
+
+static int failures;
+
+static void check(int condition, const char *what, uint32_t width, uint32_t height, uint32_t bpp, int offset)
+{
+    if (!condition) {
+        if (failures++ < 10) {
+            printf("swizzle: FAIL %s (%ux%u, %u bytes, %s)\n", what, width, height, bpp,
+                   offset ? "scalar" : "SSE");
+        }
+    }
+}
+
+// texel index in swizzled texture: x and y bits alternate (x first) until one runs out
+static uint32_t reference_index(uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    uint32_t index = 0, bit = 0;
+
+    for (uint32_t i = 1; i < width || i < height; i <<= 1) {
+        if (i < width) {
+            index |= ((x & i) ? 1u : 0u) << bit++;
+        }
+        if (i < height) {
+            index |= ((y & i) ? 1u : 0u) << bit++;
+        }
+    }
+    return index;
+}
+
+static void run(uint32_t width, uint32_t height, uint32_t bpp, uint32_t pitch, int offset)
+{
+    uint8_t *dst = swizzled + offset;
+    uint32_t size = width * height * bpp;
+
+    for (uint32_t i = 0; i < height * pitch; i++) {
+        linear[i] = (uint8_t)rand();
+    }
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            memcpy(expected + reference_index(x, y, width, height) * bpp, linear + y * pitch + x * bpp, bpp);
+        }
+    }
+
+    memset(swizzled, 0xCD, sizeof(swizzled));
+    pb_swizzle(linear, pitch, dst, width, height, bpp);
+    check(memcmp(dst, expected, size) == 0, "pb_swizzle differs from reference", width, height, bpp, offset);
+    check(dst[size] == 0xCD, "pb_swizzle writes past texture", width, height, bpp, offset);
+
+    // padding between rows must be left alone
+    memset(unswizzled, 0xCD, sizeof(unswizzled));
+    pb_unswizzle(dst, unswizzled, pitch, width, height, bpp);
+    for (uint32_t y = 0; y < height; y++) {
+        check(memcmp(unswizzled + y * pitch, linear + y * pitch, width * bpp) == 0,
+              "pb_unswizzle doesn't give linear texture back", width, height, bpp, offset);
+        for (uint32_t i = width * bpp; i < pitch; i++) {
+            check(unswizzled[y * pitch + i] == 0xCD, "pb_unswizzle writes in row padding", width, height, bpp, offset);
+        }
+    }
+}
+
+int main(void)
+{
+    static const uint32_t bpps[3] = { 1, 2, 4 };
+
+    srand(1);
+    for (uint32_t width = 1; width <= MAX_SIZE; width *= 2) {
+        for (uint32_t height = 1; height <= MAX_SIZE; height *= 2) {
+            for (int b = 0; b < 3; b++) {
+                uint32_t bpp = bpps[b];
+                // 16 byte aligned (SSE when available) and 4 bytes off (scalar)
+                run(width, height, bpp, width * bpp, 0);
+                run(width, height, bpp, width * bpp, 4);
+                run(width, height, bpp, width * bpp + 16, 0);
+            }
+        }
+    }
+
+    if (failures) {
+        printf("swizzle: %d failures\n", failures);
+        return 1;
+    }
+    printf("swizzle: ok\n");
+    return 0;
+}
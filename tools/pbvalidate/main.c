@@ -0,0 +1,167 @@
+// pbvalidate: lints pbkit binary captures (see lib/pbkit/pbcapture.h), or raw
+// push buffer dumps, for encoding and state errors the GPU would hang or fault on.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../../lib/pbkit/pbcapture.h"
+#include "pbvalidate.h"
+
+
+typedef struct {
+    long frame;             // blocks before first frame marker are initialization
+    uint64_t frame_start;   // stream offset of first word of frame
+    unsigned int printed;
+    unsigned int max_issues;
+    int quiet_warnings;
+} Context;
+
+static void print_issue(void *context, const PbvIssue *issue)
+{
+    Context *ctx = context;
+
+    if (issue->severity == PBV_WARNING && ctx->quiet_warnings) {
+        return;
+    }
+    if (ctx->printed++ >= ctx->max_issues) {
+        return;
+    }
+
+    if (ctx->frame < 0) {
+        printf("init");
+    } else {
+        printf("frame %ld", ctx->frame);
+    }
+    printf(", word %llu: %s: %s (0x%08X)\n",
+           (unsigned long long)(issue->offset - ctx->frame_start),
+           issue->severity == PBV_ERROR ? "error" : "warning",
+           issue->message, issue->word);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-r [-b address]] [-q] [-m count] file\n", argv0);
+    fprintf(stderr, "  -r        file is raw push buffer words, not a capture\n");
+    fprintf(stderr, "  -b addr   GPU address of raw file (jumps are followed, else decoding stops at first one)\n");
+    fprintf(stderr, "  -q        don't print warnings\n");
+    fprintf(stderr, "  -m count  maximum number of issues printed (default 100)\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *filename = NULL;
+    int raw = 0;
+    uint32_t base = PBV_NO_BASE;
+    Context ctx = { -1, 0, 0, 100, 0 };
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            raw = 1;
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            base = (uint32_t)strtoul(argv[++i], NULL, 0) & ~3u;
+        } else if (strcmp(argv[i], "-q") == 0) {
+            ctx.quiet_warnings = 1;
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            ctx.max_issues = (unsigned int)atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && filename == NULL) {
+            filename = argv[i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (filename == NULL) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Can't open %s\n", filename);
+        return 2;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint32_t *data = malloc(size + 4);
+    uint32_t count = (uint32_t)(size / 4);
+    if (data == NULL || fread(data, 4, count, f) != count) {
+        fprintf(stderr, "Can't read %s\n", filename);
+        return 2;
+    }
+    fclose(f);
+
+    PbvState *state = malloc(sizeof(PbvState));
+    if (state == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 2;
+    }
+    pbv_init(state, print_issue, &ctx);
+
+    if (raw) {
+        ctx.frame = 0;
+        pbv_validate_raw(state, data, count, base);
+        pbv_end_frame(state);
+    } else {
+        if (count < 2 || data[0] != PB_CAPTURE_MAGIC) {
+            fprintf(stderr, "%s isn't a pbkit capture (use -r for raw push buffer)\n", filename);
+            return 2;
+        }
+        if (data[1] != PB_CAPTURE_VERSION) {
+            fprintf(stderr, "%s: unsupported capture version %u\n", filename, data[1]);
+            return 2;
+        }
+
+        // display lists first, calls may come before their recording in file order
+        for (uint32_t i = 2; i + 2 <= count;) {
+            uint32_t n = data[i + 1];
+            if (n > count - i - 2) {
+                break;
+            }
+            if (data[i] == PB_CAPTURE_LIST && n >= 1) {
+                pbv_add_list(state, data[i + 2], &data[i + 3], n - 1);
+            }
+            i += 2 + n;
+        }
+
+        for (uint32_t i = 2; i < count;) {
+            uint32_t tag = data[i];
+            uint32_t n = (i + 1 < count) ? data[i + 1] : 0;
+            if (i + 2 > count || n > count - i - 2) {
+                fprintf(stderr, "%s: truncated record at word %u\n", filename, i);
+                break;
+            }
+
+            switch (tag) {
+            case PB_CAPTURE_FRAME:
+                pbv_end_frame(state);
+                ctx.frame = (n >= 1) ? (long)data[i + 2] : ctx.frame + 1;
+                ctx.frame_start = state->offset;
+                break;
+            case PB_CAPTURE_BLOCK:
+                pbv_validate(state, &data[i + 2], n);
+                break;
+            case PB_CAPTURE_LIST:
+                break;
+            default:
+                fprintf(stderr, "%s: unknown record %u at word %u\n", filename, tag, i);
+                break;
+            }
+            i += 2 + n;
+        }
+        pbv_end_frame(state);
+    }
+
+    if (ctx.printed > ctx.max_issues) {
+        printf("(%u more issues not shown)\n", ctx.printed - ctx.max_issues);
+    }
+    printf("%u errors, %u warnings in %llu words\n",
+           state->errors, state->warnings, (unsigned long long)state->offset);
+
+    int result = state->errors ? 1 : 0;
+    free(state);
+    free(data);
+    return result;
+}
@@ -0,0 +1,320 @@
+// pbvalidate: checks NV2A push buffer streams as built by pbkit
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pbvalidate.h"
+#include "pbmethods.h"
+
+
+// 3D class (kelvin) method ranges, including arrays the headers only give the base of
+static const uint32_t method_ranges[][2] = {
+    { 0x0000, 0x0000 }, // SET_OBJECT
+    { 0x0100, 0x0104 }, // NO_OPERATION, NOTIFY
+    { 0x0110, 0x0110 }, // WAIT_FOR_IDLE
+    { 0x0120, 0x0130 }, // flips
+    { 0x0180, 0x0188 }, // context Dmas
+    { 0x0190, 0x01A8 },
+    { 0x0200, 0x0214 }, // surface
+    { 0x0260, 0x027C }, // combiner alpha inputs
+    { 0x0288, 0x02A8 }, // final combiner, control, fog
+    { 0x02B4, 0x02B4 }, // window clip type
+    { 0x02C0, 0x02FC }, // window clip rectangles
+    { 0x0300, 0x03FC }, // enables, blend, depth, stencil, polygon modes, material, texgen
+    { 0x0410, 0x042C }, // texture matrix enables
+    { 0x043C, 0x07BC }, // point size, matrices
+    { 0x0840, 0x093C }, // texgen planes
+    { 0x09C0, 0x0A5C }, // fog, specular, flat shade, scene ambient, viewport offset, point params, eye
+    { 0x0A60, 0x0AFC }, // combiner factors and outputs, color key, viewport scale
+    { 0x0B00, 0x0BFC }, // transform program and constants
+    { 0x0C00, 0x0DFC }, // back lights
+    { 0x1000, 0x13FC }, // lights
+    { 0x147C, 0x14FC }, // stipple
+    { 0x1500, 0x171C }, // immediate mode vertices, vertex cache
+    { 0x1720, 0x179C }, // vertex arrays
+    { 0x17A0, 0x17D0 }, // back material, logic op, reports
+    { 0x17E0, 0x17E8 }, // eye direction
+    { 0x17F8, 0x1828 }, // begin/end and vertex submission
+    { 0x1880, 0x1AFC }, // immediate mode vertex attributes
+    { 0x1B00, 0x1BFC }, // texture stages
+    { 0x1D60, 0x1D9C }, // semaphores, antialiasing, clears
+    { 0x1E20, 0x1EA4 }, // specular fog, combiners, shaders, transform execution
+};
+
+#define SET_BEGIN_END       0x17FC
+#define ARRAY_ELEMENT16     0x1800
+#define ARRAY_ELEMENT32     0x1808
+#define DRAW_ARRAYS         0x1810
+#define INLINE_ARRAY        0x1818
+#define MAX_PRIMITIVE       10 // POLYGON
+
+static uint8_t known[2048];
+static int known_ready = 0;
+
+
+static void build_known(void)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(method_ranges) / sizeof(method_ranges[0]); i++) {
+        for (uint32_t m = method_ranges[i][0]; m <= method_ranges[i][1]; m += 4) {
+            known[m >> 2] = 1;
+        }
+    }
+    for (i = 0; i < METHOD_NAME_COUNT; i++) {
+        if (method_names[i].method < 0x2000) {
+            known[method_names[i].method >> 2] = 1;
+        }
+    }
+    known_ready = 1;
+}
+
+int pbv_known_method(uint32_t method)
+{
+    if (!known_ready) {
+        build_known();
+    }
+    return (method < 0x2000) && known[method >> 2];
+}
+
+void pbv_init(PbvState *state, PbvReport report, void *context)
+{
+    memset(state, 0, sizeof(*state));
+    state->report = report;
+    state->context = context;
+
+    if (!known_ready) {
+        build_known();
+    }
+}
+
+void pbv_add_list(PbvState *state, uint32_t address, const uint32_t *words, size_t count)
+{
+    int i;
+
+    for (i = 0; i < state->list_count; i++) {
+        if (state->lists[i].address == address) {
+            break;
+        }
+    }
+    if (i == state->list_count) {
+        if (state->list_count == PBV_MAX_LISTS) {
+            return;
+        }
+        state->list_count++;
+    }
+    state->lists[i].address = address;
+    state->lists[i].words = words;
+    state->lists[i].count = count;
+}
+
+static void report(PbvState *state, PbvSeverity severity, uint64_t offset, uint32_t word, const char *message)
+{
+    PbvIssue issue;
+
+    if (severity == PBV_ERROR) {
+        state->errors++;
+    } else {
+        state->warnings++;
+    }
+
+    if (state->report) {
+        issue.severity = severity;
+        issue.offset = offset;
+        issue.word = word;
+        issue.message = message;
+        state->report(state->context, &issue);
+    }
+}
+
+static int is_vertex_method(uint32_t method)
+{
+    return (method >= 0x1500 && method <= 0x171C) ||   // immediate mode vertices
+           (method >= ARRAY_ELEMENT16 && method <= INLINE_ARRAY) ||
+           (method >= 0x1880 && method <= 0x1AFC) ||   // immediate mode vertex attributes
+           method == 0x0100;                          // NO_OPERATION
+}
+
+static void check_write(PbvState *state, uint32_t subchannel, uint32_t method, uint32_t value, uint64_t offset)
+{
+    if (subchannel != 0) {
+        return; // only 3D class is known
+    }
+
+    if (!known[method >> 2]) {
+        report(state, PBV_WARNING, offset, value, "write to unknown 3D method");
+        return;
+    }
+
+    if (method == SET_BEGIN_END) {
+        if (value) {
+            if (state->in_begin_end) {
+                report(state, PBV_ERROR, offset, value, "SET_BEGIN_END begin inside begin/end pair");
+            }
+            if (value > MAX_PRIMITIVE) {
+                report(state, PBV_ERROR, offset, value, "SET_BEGIN_END with invalid primitive");
+            }
+            state->in_begin_end = 1;
+            state->begin_offset = offset;
+            state->inline_dwords = 0;
+            state->inline_reported = 0;
+        } else {
+            if (!state->in_begin_end) {
+                report(state, PBV_ERROR, offset, value, "SET_BEGIN_END end without begin");
+            }
+            state->in_begin_end = 0;
+        }
+        return;
+    }
+
+    if (method >= ARRAY_ELEMENT16 && method <= INLINE_ARRAY) {
+        if (!state->in_begin_end) {
+            report(state, PBV_ERROR, offset, value, "vertex data outside SET_BEGIN_END");
+        } else if (++state->inline_dwords > PBV_MAX_INLINE_DWORDS && !state->inline_reported) {
+            report(state, PBV_ERROR, offset, value, "too much vertex data in one SET_BEGIN_END pair");
+            state->inline_reported = 1;
+        }
+        return;
+    }
+
+    if (state->in_begin_end && !is_vertex_method(method)) {
+        report(state, PBV_ERROR, offset, value, "state change inside SET_BEGIN_END");
+    }
+}
+
+// returns number of words decoded, decoding stops after a jump (*jump is set to its target)
+static size_t validate(PbvState *state, const uint32_t *words, size_t count, int in_list, uint64_t call_offset,
+                       uint32_t *jump)
+{
+    size_t i = 0;
+
+    while (i < count) {
+        uint32_t word = words[i];
+        uint64_t offset = in_list ? call_offset : state->offset + i;
+        i++;
+
+        if ((word & 3) == 1) {
+            // stream continues at target, words after the jump aren't read
+            if (in_list) {
+                report(state, PBV_ERROR, offset, word, "jump inside display list");
+            }
+            *jump = word & ~3u;
+            return i;
+        }
+
+        if ((word & 3) == 2) {
+            if (in_list) {
+                report(state, PBV_ERROR, offset, word, "call inside display list (NV2A has one subroutine level)");
+                continue;
+            }
+            int l;
+            for (l = 0; l < state->list_count; l++) {
+                if (state->lists[l].address == (word & ~3u)) {
+                    break;
+                }
+            }
+            if (l == state->list_count) {
+                report(state, PBV_WARNING, offset, word, "call to unknown display list");
+            } else {
+                uint32_t list_jump;
+                validate(state, state->lists[l].words, state->lists[l].count, 1, offset, &list_jump);
+            }
+            continue;
+        }
+
+        if (word == 0x00020000) {
+            if (in_list) {
+                return i;
+            }
+            report(state, PBV_ERROR, offset, word, "return outside display list");
+            continue;
+        }
+
+        if ((word & 0xE0030003) != 0 && (word & 0xE0030003) != 0x40000000) {
+            report(state, PBV_ERROR, offset, word, "malformed method header (reserved bits set)");
+            continue;
+        }
+
+        uint32_t n = (word >> 18) & 0x7FF;
+        uint32_t subchannel = (word >> 13) & 7;
+        uint32_t method = word & 0x1FFC;
+        int incrementing = (word & 0x40000000) == 0;
+
+        if (n == 0) {
+            report(state, PBV_WARNING, offset, word, "method header without parameters");
+            continue;
+        }
+        if (n > count - i) {
+            report(state, PBV_ERROR, offset, word, "method count runs past end of block");
+            n = (uint32_t)(count - i);
+        }
+
+        for (uint32_t j = 0; j < n; j++) {
+            uint32_t m = incrementing ? method + j * 4 : method;
+            if (m >= 0x2000) {
+                report(state, PBV_ERROR, offset, word, "incrementing packet runs past last method");
+                break;
+            }
+            check_write(state, subchannel, m, words[i + j], in_list ? call_offset : state->offset + i + j);
+        }
+        i += n;
+    }
+
+    if (in_list) {
+        report(state, PBV_ERROR, call_offset, 0, "display list without return");
+    }
+    return i;
+}
+
+void pbv_validate(PbvState *state, const uint32_t *words, size_t count)
+{
+    uint32_t jump;
+    size_t n = validate(state, words, count, 0, 0, &jump);
+
+    // pbkit writes jumps between blocks, never inside them
+    if (n < count) {
+        report(state, PBV_ERROR, state->offset + n - 1, words[n - 1], "jump inside block, words after it are never read");
+    }
+    state->offset += count;
+}
+
+void pbv_validate_raw(PbvState *state, const uint32_t *words, size_t count, uint32_t base)
+{
+    uint8_t *visited = calloc(count ? count : 1, 1);
+    uint64_t start = state->offset;
+    uint64_t decoded = 0;
+    size_t i = 0;
+
+    if (visited == NULL) {
+        return;
+    }
+
+    // offsets reported are word indexes in image
+    while (i < count && !visited[i]) {
+        uint32_t jump = 1; // targets are aligned: 1 means no jump
+        size_t n;
+
+        state->offset = start + i;
+        n = validate(state, words + i, count - i, 0, 0, &jump);
+        memset(visited + i, 1, n);
+        decoded += n;
+        if (jump == 1) {
+            break; // end of image
+        }
+        if (base == PBV_NO_BASE || jump < base || (jump - base) / 4 >= count) {
+            break; // target unknown or out of image
+        }
+        i = (jump - base) / 4;
+    }
+
+    free(visited);
+    state->offset = start + decoded;
+}
+
+void pbv_end_frame(PbvState *state)
+{
+    if (state->in_begin_end) {
+        report(state, PBV_ERROR, state->begin_offset, SET_BEGIN_END, "SET_BEGIN_END pair not closed at end of frame");
+        state->in_begin_end = 0;
+    }
+}
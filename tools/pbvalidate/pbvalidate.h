@@ -0,0 +1,83 @@
+// pbvalidate: checks NV2A push buffer streams as built by pbkit
+// (method headers from EncodeMethod, subchannels, jump/call/return words).
+
+#ifndef PBVALIDATE_H
+#define PBVALIDATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// largest number of vertex words between SET_BEGIN_END pairs: NV2A_MAX_BATCH_LENGTH
+// of xemu's nv2a (hw/xbox/nv2a), the size of its inline array and element buffers,
+// which drops data past it. No public documentation gives the hardware limit.
+#define PBV_MAX_INLINE_DWORDS 0x1FFFF
+
+#define PBV_MAX_LISTS 1024
+
+typedef enum {
+    PBV_ERROR,
+    PBV_WARNING
+} PbvSeverity;
+
+typedef struct {
+    PbvSeverity severity;
+    uint64_t offset;      // word index in validated stream (counting all pbv_validate calls)
+    uint32_t word;        // offending word (header or parameter)
+    const char *message;
+} PbvIssue;
+
+typedef void (*PbvReport)(void *context, const PbvIssue *issue);
+
+typedef struct {
+    uint32_t address;
+    const uint32_t *words;
+    size_t count;
+} PbvList;
+
+typedef struct {
+    PbvReport report;
+    void *context;
+
+    uint64_t offset;
+    int in_begin_end;
+    uint64_t begin_offset;
+    uint32_t inline_dwords;   // vertex data words since SET_BEGIN_END
+    int inline_reported;
+
+    PbvList lists[PBV_MAX_LISTS];
+    int list_count;
+
+    unsigned int errors;
+    unsigned int warnings;
+} PbvState;
+
+void pbv_init(PbvState *state, PbvReport report, void *context);
+
+// makes a display list available to push buffer calls (address as found in call words)
+void pbv_add_list(PbvState *state, uint32_t address, const uint32_t *words, size_t count);
+
+// validates a sequence of complete blocks, state carries over to next call
+void pbv_validate(PbvState *state, const uint32_t *words, size_t count);
+
+// validates a raw push buffer image (e.g. dumped from GPU memory) from its first
+// word. Jumps inside the image are followed (base is the GPU address of words),
+// decoding stops at a jump out of it or back to words already validated, and at
+// first jump if base is PBV_NO_BASE.
+#define PBV_NO_BASE 0xFFFFFFFF
+void pbv_validate_raw(PbvState *state, const uint32_t *words, size_t count, uint32_t base);
+
+// checks done at frame boundaries and at end of stream
+void pbv_end_frame(PbvState *state);
+
+// returns 1 if method is known for the 3D class (subchannel 0)
+int pbv_known_method(uint32_t method);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
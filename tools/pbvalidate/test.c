@@ -0,0 +1,316 @@
+// Checks pbvalidate diagnostics: crafted streams, good and bad, must give
+// exactly the expected issues (severity, word offset and message), in order.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pbvalidate.h"
+
+#define MAX_ISSUES  16
+#define MAX_WORDS   (PBV_MAX_INLINE_DWORDS + 1024)
+
+#define HEADER(method, count)   (((uint32_t)(count) << 18) | (method))
+#define NONINC(method, count)   (0x40000000 | HEADER(method, count))
+#define JUMP(address)           ((address) | 1)
+#define CALL(address)           ((address) | 2)
+#define RETURN                  0x00020000
+
+#define NO_OPERATION    0x0100
+#define SET_BEGIN_END   0x17FC
+#define INLINE_ARRAY    0x1818
+#define SET_COLOR_MASK  0x0358
+#define UNKNOWN_METHOD  0x1C00
+#define TRIANGLES       5
+
+typedef struct {
+    PbvSeverity severity;
+    uint64_t offset;
+    const char *message;
+} Expected;
+
+static PbvIssue issues[MAX_ISSUES];
+static unsigned int issue_count;
+static uint32_t words[MAX_WORDS];
+static uint32_t count;
+static int failures;
+
+static void collect(void *context, const PbvIssue *issue)
+{
+    if (issue_count < MAX_ISSUES) {
+        issues[issue_count] = *issue;
+    }
+    issue_count++;
+}
+
+static void push(uint32_t word)
+{
+    words[count++] = word;
+}
+
+static void fail(const char *name, const char *what)
+{
+    if (failures++ < 10) {
+        printf("pbvalidate: FAIL %s: %s\n", name, what);
+    }
+}
+
+// compares issues collected since last call with expected ones
+static void expect(const char *name, const Expected *expected, unsigned int n)
+{
+    char what[256];
+
+    if (issue_count != n) {
+        snprintf(what, sizeof(what), "%u issues instead of %u (first: %s)", issue_count, n,
+                 issue_count ? issues[0].message : "none");
+        fail(name, what);
+    } else {
+        for (unsigned int i = 0; i < n; i++) {
+            if (issues[i].severity != expected[i].severity || issues[i].offset != expected[i].offset ||
+                strcmp(issues[i].message, expected[i].message) != 0) {
+                snprintf(what, sizeof(what), "got '%s' at %llu, expected '%s' at %llu", issues[i].message,
+                         (unsigned long long)issues[i].offset, expected[i].message,
+                         (unsigned long long)expected[i].offset);
+                fail(name, what);
+            }
+        }
+    }
+    issue_count = 0;
+    count = 0;
+}
+
+// validates words pushed so far as one block, then ends the frame
+static void run(PbvState *state, const char *name, const Expected *expected, unsigned int n)
+{
+    pbv_init(state, collect, NULL);
+    pbv_validate(state, words, count);
+    pbv_end_frame(state);
+    expect(name, expected, n);
+}
+
+static void triangle(void)
+{
+    push(HEADER(SET_BEGIN_END, 1));
+    push(TRIANGLES);
+    push(NONINC(INLINE_ARRAY, 3));
+    push(0);
+    push(0);
+    push(0);
+    push(HEADER(SET_BEGIN_END, 1));
+    push(0);
+}
+
+static void test_good(PbvState *state)
+{
+    push(HEADER(NO_OPERATION, 1));
+    push(0);
+    push(HEADER(SET_COLOR_MASK, 1));
+    push(0x01010101);
+    triangle();
+    push(JUMP(0x1000)); // last word of a block: as pbkit writes them
+    run(state, "valid stream", NULL, 0);
+}
+
+static void test_headers(PbvState *state)
+{
+    static const Expected expected[] = {
+        { PBV_ERROR, 0, "malformed method header (reserved bits set)" },
+        { PBV_ERROR, 1, "malformed method header (reserved bits set)" },
+        { PBV_WARNING, 2, "method header without parameters" },
+        { PBV_WARNING, 4, "write to unknown 3D method" },
+        { PBV_WARNING, 6, "write to unknown 3D method" },
+        { PBV_ERROR, 5, "incrementing packet runs past last method" },
+        { PBV_ERROR, 8, "method count runs past end of block" },
+    };
+
+    push(0x00040103);                   // jump/call bits both set
+    push(0x20040100);                   // reserved bit 29
+    push(HEADER(NO_OPERATION, 0));
+    push(HEADER(UNKNOWN_METHOD, 1));
+    push(0);
+    push(HEADER(0x1FFC, 2));
+    push(0);
+    push(0);
+    push(HEADER(NO_OPERATION, 3));
+    push(0);
+    run(state, "malformed headers", expected, sizeof(expected) / sizeof(expected[0]));
+}
+
+static void test_begin_end(PbvState *state)
+{
+    static const Expected expected[] = {
+        { PBV_ERROR, 1, "SET_BEGIN_END end without begin" },
+        { PBV_ERROR, 3, "vertex data outside SET_BEGIN_END" },
+        { PBV_ERROR, 7, "SET_BEGIN_END begin inside begin/end pair" },
+        { PBV_ERROR, 9, "state change inside SET_BEGIN_END" },
+        { PBV_ERROR, 12, "SET_BEGIN_END with invalid primitive" },
+        { PBV_ERROR, 12, "SET_BEGIN_END pair not closed at end of frame" },
+    };
+
+    push(HEADER(SET_BEGIN_END, 1));
+    push(0);
+    push(NONINC(INLINE_ARRAY, 1));
+    push(0);
+    push(HEADER(SET_BEGIN_END, 1));
+    push(TRIANGLES);
+    push(HEADER(SET_BEGIN_END, 1));
+    push(TRIANGLES);
+    push(HEADER(SET_COLOR_MASK, 1));
+    push(0);
+    push(NONINC(SET_BEGIN_END, 2));     // end, then begin with a bad primitive
+    push(0);
+    push(11);
+    run(state, "unbalanced SET_BEGIN_END", expected, sizeof(expected) / sizeof(expected[0]));
+}
+
+// n vertex data words in one SET_BEGIN_END pair
+static void inline_words(uint32_t n)
+{
+    push(HEADER(SET_BEGIN_END, 1));
+    push(TRIANGLES);
+    while (n) {
+        uint32_t packet = (n > 2047) ? 2047 : n;
+
+        push(NONINC(INLINE_ARRAY, packet));
+        for (uint32_t i = 0; i < packet; i++) {
+            push(i);
+        }
+        n -= packet;
+    }
+    push(HEADER(SET_BEGIN_END, 1));
+    push(0);
+}
+
+static void test_inline_limit(PbvState *state)
+{
+    uint32_t packets = PBV_MAX_INLINE_DWORDS / 2047;
+    // offset of vertex word PBV_MAX_INLINE_DWORDS+1: begin (2 words), headers of the full
+    // packets and of the one holding it, vertex words before it
+    uint64_t offset = 2 + packets + 1 + PBV_MAX_INLINE_DWORDS;
+    Expected expected[] = {
+        { PBV_ERROR, offset, "too much vertex data in one SET_BEGIN_END pair" },
+    };
+
+    inline_words(PBV_MAX_INLINE_DWORDS);
+    run(state, "inline array at limit", NULL, 0);
+
+    inline_words(PBV_MAX_INLINE_DWORDS + 1);
+    run(state, "inline array past limit", expected, 1);
+}
+
+static void test_lists(PbvState *state)
+{
+    static const uint32_t list[] = { HEADER(NO_OPERATION, 1), 0, RETURN };
+    static const uint32_t no_return[] = { HEADER(NO_OPERATION, 1), 0 };
+    static const uint32_t nested[] = { CALL(0x1000), JUMP(0x3000), RETURN };
+    static const uint32_t bad[] = { HEADER(SET_BEGIN_END, 1), 0, RETURN };
+    static const Expected expected[] = {
+        { PBV_WARNING, 1, "call to unknown display list" },
+        { PBV_ERROR, 2, "display list without return" },
+        { PBV_ERROR, 3, "call inside display list (NV2A has one subroutine level)" },
+        { PBV_ERROR, 3, "jump inside display list" },
+        { PBV_ERROR, 4, "SET_BEGIN_END end without begin" },
+        { PBV_ERROR, 5, "return outside display list" },
+    };
+
+    push(CALL(0x1000));
+    push(CALL(0x5000));
+    push(CALL(0x2000));
+    push(CALL(0x3000));
+    push(CALL(0x4000));                 // issues in a list are reported at the call
+    push(RETURN);
+    pbv_init(state, collect, NULL);
+    pbv_add_list(state, 0x1000, list, sizeof(list) / sizeof(list[0]));
+    pbv_add_list(state, 0x2000, no_return, sizeof(no_return) / sizeof(no_return[0]));
+    pbv_add_list(state, 0x3000, nested, sizeof(nested) / sizeof(nested[0]));
+    pbv_add_list(state, 0x4000, bad, sizeof(bad) / sizeof(bad[0]));
+    pbv_validate(state, words, count);
+    expect("calls and returns", expected, sizeof(expected) / sizeof(expected[0]));
+}
+
+static void test_jumps(PbvState *state)
+{
+    static const Expected in_block[] = {
+        { PBV_ERROR, 2, "jump inside block, words after it are never read" },
+    };
+    static const Expected raw[] = {
+        { PBV_ERROR, 9, "SET_BEGIN_END end without begin" },
+    };
+    static const Expected raw_no_base[] = {
+        { PBV_ERROR, 3, "malformed method header (reserved bits set)" },
+    };
+
+    push(HEADER(NO_OPERATION, 1));
+    push(0);
+    push(JUMP(0x1000));
+    push(HEADER(NO_OPERATION, 1));
+    push(0);
+    run(state, "jump inside block", in_block, 1);
+
+    // raw image at 0x8000: jumps over garbage, decodes the end, then jumps
+    // back to its start (already validated): 8 words decoded, 3 skipped
+    push(HEADER(NO_OPERATION, 1));      // 0
+    push(0);
+    push(JUMP(0x8000 + 6 * 4));
+    push(0xFFFFFFFF);                   // 3: never read
+    push(0xFFFFFFFF);
+    push(0xFFFFFFFF);
+    push(HEADER(NO_OPERATION, 1));      // 6
+    push(0);
+    push(HEADER(SET_BEGIN_END, 1));
+    push(0);                            // 9: reported at its image index
+    push(JUMP(0x8000));
+    pbv_init(state, collect, NULL);
+    pbv_validate_raw(state, words, count, 0x8000);
+    if (state->offset != 8) {
+        fail("raw image", "decoded words count isn't 8");
+    }
+    expect("raw image", raw, 1);
+
+    // without base decoding stops at first jump, a jump out of image too
+    push(JUMP(0x8000 + 3 * 4));
+    push(0);
+    push(0);
+    push(0xFFFFFFFF);
+    pbv_init(state, collect, NULL);
+    pbv_validate_raw(state, words, count, PBV_NO_BASE);
+    if (state->offset != 1) {
+        fail("raw image without base", "decoded words count isn't 1");
+    }
+    expect("raw image without base", NULL, 0);
+
+    push(JUMP(0x8000 + 3 * 4));
+    push(0);
+    push(0);
+    push(0xFFFFFFFF);
+    push(JUMP(0x100000));
+    pbv_init(state, collect, NULL);
+    pbv_validate_raw(state, words, count, 0x8000);
+    expect("raw image jump out", raw_no_base, 1);
+}
+
+int main(void)
+{
+    PbvState *state = malloc(sizeof(PbvState));
+
+    if (state == NULL) {
+        printf("pbvalidate: out of memory\n");
+        return 1;
+    }
+
+    test_good(state);
+    test_headers(state);
+    test_begin_end(state);
+    test_inline_limit(state);
+    test_lists(state);
+    test_jumps(state);
+
+    free(state);
+    if (failures) {
+        printf("pbvalidate: %d failures\n", failures);
+        return 1;
+    }
+    printf("pbvalidate: ok\n");
+    return 0;
+}